@@ -0,0 +1,489 @@
+#include "lib2d.h"
+#include "atlas.h"
+#include "nine_patch.h"
+#include "primitives.h"
+#include "profile.h"
+#include "renderer.h"
+#include "resources.h"
+#include "stretchy_buffer.h"
+#include "template.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Times the CPU side of lib2d without a window. Build with -DNULL_RENDER=ON
+// so nothing waits on a GPU (or -DSOFT_RENDER=ON to include rasterizing),
+// then run `lib2d_bench [frames] [filter]`. Results are printed as JSON.
+// Only the benchmarks whose name contains `filter` are run, if given.
+//
+// Micro benchmarks time one operation, the scenes whole frames. The
+// benchmark is built from the library's sources rather than linked to it, so
+// it can reach the functions the library doesn't export.
+
+#define WIDTH 1280
+#define HEIGHT 720
+
+#ifdef SOFT_RENDER
+// Rasterizing a frame costs far more than building it, so the soft backend
+// renders fewer frames, and quads_100k only runs when asked for by name.
+#define MICRO_FRAMES 5
+#define SCENE_FRAMES 10
+#else
+#define MICRO_FRAMES 50
+#define SCENE_FRAMES 100
+#endif
+
+static const char* filter;
+
+static
+bool
+selected(const char* name) {
+    return !filter || strstr(name, filter);
+}
+
+static
+float
+r(void) {
+    return rand()/(float)RAND_MAX;
+}
+
+static bool first_result;
+
+static
+void
+micro_result(const char* name, double ns, long ops) {
+    printf("%s\n    {\"name\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.1f}",
+            first_result ? "" : ",", name, ops, ns/ops);
+    first_result = false;
+}
+
+static
+void
+add_images(struct l2d_scene* scene) {
+    uint8_t quad[16*16*4];
+    memset(quad, 0xff, sizeof(quad));
+    l2d_set_image_data(scene, l2d_ident_from_str("quad"), 16, 16,
+            l2d_IMAGE_FORMAT_RGBA_8888, quad, 0);
+
+    // Opaque middle, one pixel of stretch markers on every side.
+    uint8_t patch[10*10*4];
+    for (int y=0; y<10; y++) {
+        for (int x=0; x<10; x++) {
+            uint8_t* p = patch + (y*10+x)*4;
+            bool border = x == 0 || y == 0 || x == 9 || y == 9;
+            bool mark = (x >= 4 && x <= 5) || (y >= 4 && y <= 5);
+            p[0] = p[1] = p[2] = border ? 0 : 0xff;
+            p[3] = border && !mark ? 0 : 0xff;
+        }
+    }
+    l2d_set_image_data(scene, l2d_ident_from_str("patch"), 10, 10,
+            l2d_IMAGE_FORMAT_RGBA_8888, patch, l2d_IMAGE_N_PATCH);
+}
+
+static
+struct l2d_scene*
+new_scene(void) {
+    struct l2d_scene* scene = l2d_scene_new(l2d_init_default_resources());
+    l2d_scene_set_viewport(scene, WIDTH, HEIGHT);
+    add_images(scene);
+    return scene;
+}
+
+static
+struct l2d_sprite*
+new_sprite(struct l2d_scene* scene, const char* image) {
+    struct l2d_sprite* s = l2d_sprite_new(scene, l2d_ident_from_str(image), 0);
+    l2d_sprite_set_size(s, 16 + r()*32, 16 + r()*32, 0);
+    l2d_sprite_xy(s, r()*WIDTH, r()*HEIGHT, 0, 0);
+    return s;
+}
+
+static
+void
+warm_up(struct l2d_scene* scene) {
+    // Upload images, sort, grow the scratch buffers.
+    for (int i=0; i<3; i++) {
+        l2d_scene_step(scene, 1/60.f);
+        l2d_scene_render(scene);
+    }
+}
+
+static
+void
+bench_anim_step(void) {
+    const long ops = 1000000;
+    struct l2d_anim* anims = NULL;
+    float value = 0;
+    l2d_anim_new(&anims, 1, 1, l2d_ANIM_REPEAT | l2d_ANIM_EASE_IN);
+    uint64_t start = profile_now_ns();
+    for (long i=0; i<ops; i++) {
+        l2d_anim_step(&anims, 1/60.f, &value);
+    }
+    micro_result("anim_step", profile_now_ns() - start, ops);
+    l2d_anim_release_all(&anims);
+}
+
+static
+void
+bench_ident_from_str(void) {
+    const int count = 1024;
+    const long ops = 200000;
+    char names[1024][32];
+    for (int i=0; i<count; i++) {
+        sprintf(names[i], "sprite_%i", i);
+        l2d_ident_from_str(names[i]);
+    }
+    uint64_t start = profile_now_ns();
+    for (long i=0; i<ops; i++) {
+        l2d_ident_from_str(names[i % count]);
+    }
+    micro_result("ident_from_str", profile_now_ns() - start, ops);
+}
+
+static
+void
+bench_replace_vars(void) {
+    const long ops = 100000;
+    struct template_var vars[] = {
+        {"HEAD", "uniform sampler2D mask;\nvarying vec2 maskCoord;\n"},
+        {"BODY", "gl_FragColor *= texture2D(mask, maskCoord).a;\n"},
+        {"SAMPLE", "texture2D(texture, texCoord_v)"},
+        {"PRECISION", "mediump"},
+        {0, 0}};
+    const char* source =
+        "precision PRECISION float;\n"
+        "uniform sampler2D texture;\n"
+        "varying vec2 texCoord_v;\n"
+        "HEAD\n"
+        "void main() {\n"
+        "    vec4 tex = SAMPLE;\n"
+        "    gl_FragColor = tex;\n"
+        "    BODY\n"
+        "}\n";
+    uint64_t start = profile_now_ns();
+    for (long i=0; i<ops; i++) {
+        free(replace_vars(vars, source, "#version 100\n"));
+    }
+    micro_result("replace_vars", profile_now_ns() - start, ops);
+}
+
+static
+void
+bench_atlas_pack(void) {
+    const long ops = 200;
+    struct atlas* atlas = atlas_new(4);
+    uint8_t* pixels = calloc(64*64*4, 1);
+    for (int i=0; i<256; i++) {
+        atlas_add_entry(atlas, 8 + rand()%56, 8 + rand()%56, pixels,
+                ATLAS_ENTRY_EXTRUDE_BORDER);
+    }
+    uint64_t start = profile_now_ns();
+    for (long i=0; i<ops; i++) {
+        unsigned int w, h;
+        free(atlas_pack(atlas, 2048, 2048, &w, &h));
+    }
+    micro_result("atlas_pack_256", profile_now_ns() - start, ops);
+    atlas_delete(atlas);
+    free(pixels);
+}
+
+static
+void
+bench_nine_patch_build_geo(void) {
+    const long ops = 200000;
+    struct l2d_scene* scene = new_scene();
+    struct build_params params = {
+        .image = l2d_resources_load_image(l2d_scene_get_resources(scene),
+                l2d_ident_from_str("patch"), l2d_IMAGE_N_PATCH),
+    };
+    uint64_t start = profile_now_ns();
+    for (long i=0; i<ops; i++) {
+        sbempty(params.geoVerticies);
+        sbempty(params.geoIndicies);
+        params.bounds_width = 32 + i%64;
+        params.bounds_height = 32 + i%48;
+        l2d_nine_patch_build_geo(&params);
+    }
+    micro_result("nine_patch_build_geo", profile_now_ns() - start, ops);
+    sbfree(params.geoVerticies);
+    sbfree(params.geoIndicies);
+    l2d_scene_delete(scene);
+}
+
+// Time spent bringing the draw order up to date, per drawer, after
+// `changed` of 10000 drawers changed order.
+static
+void
+bench_sort(const char* name, int changed) {
+    const int count = 10000;
+    const int frames = MICRO_FRAMES;
+    struct l2d_scene* scene = new_scene();
+    struct l2d_sprite** sprites = malloc(count*sizeof(struct l2d_sprite*));
+    for (int i=0; i<count; i++) {
+        sprites[i] = new_sprite(scene, "quad");
+        l2d_sprite_set_order(sprites[i], rand()%1000);
+    }
+    warm_up(scene);
+
+    uint64_t sort_ns = 0;
+    for (int f=0; f<frames; f++) {
+        for (int i=0; i<changed; i++) {
+            l2d_sprite_set_order(sprites[rand()%count], rand()%1000);
+        }
+        l2d_scene_step(scene, 1/60.f);
+        l2d_scene_render(scene);
+        struct l2d_frame_stats stats;
+        l2d_scene_get_frame_stats(scene, &stats);
+        sort_ns += stats.sort_ns;
+    }
+    micro_result(name, sort_ns, (long)frames*count);
+    free(sprites);
+    l2d_scene_delete(scene);
+}
+
+// Frames in which a single drawer changes, so every other one is added to
+// its batch from its cached verticies. Nine patches aren't instanced, so
+// they all go through batch_add. Only building the batches is timed.
+static
+void
+bench_batch_add(void) {
+    const int count = 10000;
+    const int frames = MICRO_FRAMES;
+    struct l2d_scene* scene = new_scene();
+    struct l2d_sprite* moving = NULL;
+    for (int i=0; i<count; i++) {
+        moving = new_sprite(scene, "patch");
+    }
+    warm_up(scene);
+
+    uint64_t ns = 0;
+    for (int f=0; f<frames; f++) {
+        l2d_sprite_xy(moving, r()*WIDTH, r()*HEIGHT, 0, 0);
+        l2d_scene_step(scene, 1/60.f);
+        l2d_scene_render(scene);
+        struct l2d_frame_stats stats;
+        l2d_scene_get_frame_stats(scene, &stats);
+        ns += stats.batch_ns;
+    }
+    micro_result("batch_add", ns, (long)frames*count);
+    l2d_scene_delete(scene);
+}
+
+// Building quads for the same rotated, scaled sites through site_to_affine
+// and through the 4x4 matrix, under the projection drawDrawerList uses.
+static
+void
+bench_generate_rects(void) {
+    const int count = 10000;
+    const int rounds = 20;
+    struct matrix projection;
+    matrix_identity(&projection);
+    projection.m[2*4+3] = .5f/WIDTH;
+    matrix_translate_inplace(&projection, -1.f, 1.f, 0.f);
+    matrix_scale_inplace(&projection, 2.f/WIDTH, -2.f/HEIGHT, 1.f);
+
+    struct site* sites = malloc(count*sizeof(struct site));
+    for (int i=0; i<count; i++) {
+        struct site* s = &sites[i];
+        site_init(s);
+        s->rect.r = 8.f + r()*64.f;
+        s->rect.b = 8.f + r()*64.f;
+        quaternion_angle_axis(&s->quaternion, r()*360.f, 0.f, 0.f, 1.f);
+        s->x = r()*WIDTH;
+        s->y = r()*HEIGHT;
+        s->z = r()*10.f;
+        s->scale_x = .5f + r();
+        s->scale_y = .5f + r();
+    }
+    struct vertex* fast = malloc(count*4*sizeof(struct vertex));
+    struct vertex* slow = malloc(count*4*sizeof(struct vertex));
+    vertex_index* indicies = malloc(count*6*sizeof(vertex_index));
+
+    const char* names[2] = {"generate_rect_matrix", "generate_rect_affine"};
+    for (int affine=0; affine<2; affine++) {
+        struct vertex* out = affine ? fast : slow;
+        int affine_count = 0;
+        uint64_t start = profile_now_ns();
+        for (int n=0; n<rounds; n++) {
+            affine_count = renderer_generate_rects(sites, count, &projection,
+                    affine, out, indicies);
+        }
+        micro_result(names[affine], profile_now_ns() - start,
+                (long)rounds*count);
+        if (affine && affine_count != count)
+            fprintf(stderr, "generate_rect: %d of %d sites not affine\n",
+                    count - affine_count, count);
+    }
+
+    // Both paths must agree, or the comparison means nothing.
+    float worst = 0.f;
+    for (int i=0; i<count*4; i++) {
+        float a[2], b[2];
+        vertex_unpack(&fast[i], a, NULL, NULL, NULL, NULL, NULL);
+        vertex_unpack(&slow[i], b, NULL, NULL, NULL, NULL, NULL);
+        float dx = fabsf(a[0] - b[0])*WIDTH/2, dy = fabsf(a[1] - b[1])*HEIGHT/2;
+        if (dx > worst) worst = dx;
+        if (dy > worst) worst = dy;
+    }
+    if (worst > .01f)
+        fprintf(stderr, "generate_rect: paths differ by %g px\n", worst);
+
+    free(sites);
+    free(fast);
+    free(slow);
+    free(indicies);
+}
+
+static
+int
+compare_double(const void* lhs, const void* rhs) {
+    double a = *(const double*)lhs, b = *(const double*)rhs;
+    return (a > b) - (a < b);
+}
+
+// Times stepping and rendering `frames` frames of the scene.
+static
+void
+run_scene(const char* name, struct l2d_scene* scene, int sprites,
+        int frames) {
+    warm_up(scene);
+
+    double* times = malloc(frames*sizeof(double));
+    double total = 0;
+    struct l2d_frame_stats stats;
+    for (int i=0; i<frames; i++) {
+        uint64_t start = profile_now_ns();
+        l2d_scene_step(scene, 1/60.f);
+        l2d_scene_render(scene);
+        times[i] = (profile_now_ns() - start)/1e6;
+        total += times[i];
+    }
+    l2d_scene_get_frame_stats(scene, &stats);
+    qsort(times, frames, sizeof(double), compare_double);
+
+    printf("%s\n    {\"name\": \"%s\", \"sprites\": %d, \"frames\": %d, "
+            "\"ns_per_sprite\": %.1f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, "
+            "\"p99_ms\": %.3f, \"max_ms\": %.3f, \"draw_calls\": %lu, "
+            "\"state_calls\": %lu, \"state_calls_elided\": %lu, "
+            "\"pixels_depth_rejected\": %lu}",
+            first_result ? "" : ",", name, sprites, frames,
+            total*1e6/frames/sprites,
+            times[frames*50/100], times[frames*90/100],
+            times[frames*99/100], times[frames-1], stats.draw_calls,
+            stats.state_calls, stats.state_calls_elided,
+            stats.pixels_depth_rejected);
+    first_result = false;
+    free(times);
+    l2d_scene_delete(scene);
+}
+
+// Spinning sprites, so no drawer can reuse last frame's geometry.
+static
+void
+scene_sprites(const char* name, const char* image, int count, int frames) {
+    struct l2d_scene* scene = new_scene();
+    for (int i=0; i<count; i++) {
+        struct l2d_sprite* s = new_sprite(scene, image);
+        l2d_sprite_rot(s, 360, 1 + r(), l2d_ANIM_REPEAT);
+    }
+    run_scene(name, scene, count, frames);
+}
+
+// Chains of children, each turning relative to its parent, so every frame
+// has to walk down the whole hierarchy.
+static
+void
+scene_hierarchy(int chains, int depth, int frames) {
+    struct l2d_scene* scene = new_scene();
+    for (int i=0; i<chains; i++) {
+        struct l2d_sprite* parent = new_sprite(scene, "quad");
+        l2d_sprite_rot(parent, 360, 1 + r(), l2d_ANIM_REPEAT);
+        for (int j=1; j<depth; j++) {
+            struct l2d_sprite* child = l2d_sprite_new(scene,
+                    l2d_ident_from_str("quad"), 0);
+            l2d_sprite_set_size(child, 16, 16, 0);
+            l2d_sprite_set_parent(child, parent);
+            l2d_sprite_xy(child, 8, 0, 0, 0);
+            l2d_sprite_rot(child, 360, 2 + r(), l2d_ANIM_REPEAT);
+            parent = child;
+        }
+    }
+    run_scene("hierarchy", scene, chains*depth, frames);
+}
+
+// Sprites spread over a handful of effects, which can't share batches.
+static
+void
+scene_effects(int count, int frames) {
+    struct l2d_scene* scene = new_scene();
+    struct l2d_effect* effects[8];
+    for (int i=0; i<8; i++) {
+        effects[i] = l2d_effect_new();
+        float m[16] = {0};
+        m[0] = m[5] = m[10] = m[15] = .5f + i/16.f;
+        l2d_effect_color_matrix(effects[i], -1, m);
+        if (i & 1)
+            l2d_effect_blur_h(effects[i], -1);
+        if (i & 2)
+            l2d_effect_dilate(effects[i], -1);
+    }
+    for (int i=0; i<count; i++) {
+        struct l2d_sprite* s = new_sprite(scene, "quad");
+        l2d_sprite_set_effect(s, effects[rand()%8]);
+        l2d_sprite_rot(s, 360, 1 + r(), l2d_ANIM_REPEAT);
+    }
+    run_scene("effects", scene, count, frames);
+    for (int i=0; i<8; i++) {
+        l2d_effect_delete(effects[i]);
+    }
+}
+
+int
+main(int argc, char** argv) {
+    int frames = argc > 1 ? atoi(argv[1]) : SCENE_FRAMES;
+    if (frames < 1) frames = 1;
+    filter = argc > 2 ? argv[2] : NULL;
+    srand(1);
+
+    printf("{\n  \"micro\": [");
+    first_result = true;
+    if (selected("anim_step"))
+        bench_anim_step();
+    if (selected("ident_from_str"))
+        bench_ident_from_str();
+    if (selected("replace_vars"))
+        bench_replace_vars();
+    if (selected("atlas_pack_256"))
+        bench_atlas_pack();
+    if (selected("nine_patch_build_geo"))
+        bench_nine_patch_build_geo();
+    if (selected("sort_all"))
+        bench_sort("sort_all", 10000);
+    if (selected("sort_merge"))
+        bench_sort("sort_merge", 100);
+    if (selected("batch_add"))
+        bench_batch_add();
+    if (selected("generate_rect"))
+        bench_generate_rects();
+
+    printf("\n  ],\n  \"scenes\": [");
+    first_result = true;
+    if (selected("quads_10k"))
+        scene_sprites("quads_10k", "quad", 10000, frames);
+#ifdef SOFT_RENDER
+    if (filter && selected("quads_100k"))
+#else
+    if (selected("quads_100k"))
+#endif
+        scene_sprites("quads_100k", "quad", 100000, frames);
+    if (selected("nine_patch_10k"))
+        scene_sprites("nine_patch_10k", "patch", 10000, frames);
+    if (selected("hierarchy"))
+        scene_hierarchy(1000, 10, frames);
+    if (selected("effects"))
+        scene_effects(5000, frames);
+    printf("\n  ]\n}\n");
+    return 0;
+}
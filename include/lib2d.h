@@ -116,6 +116,14 @@ L2D_EXPORTED
 void
 l2d_scene_render(struct l2d_scene*);
 
+// Whether rendering would draw anything different from the last frame. Ask
+// after l2d_scene_step. Hosts that keep their last frame on screen can skip
+// rendering until this returns true; the others still save the batch
+// building, as an unchanged frame is replayed from the last one.
+L2D_EXPORTED
+bool
+l2d_scene_needs_render(struct l2d_scene*);
+
 L2D_EXPORTED
 void
 l2d_scene_set_viewport(struct l2d_scene*, int w, int h);
@@ -129,6 +137,84 @@ L2D_EXPORTED
 bool
 l2d_scene_feed_click(struct l2d_scene*, float x, float y, int button);
 
+// Keeps the sprites drawn to the screen in a grid of `cell_size` pixel cells,
+// so each frame only looks at the ones near the view. Worth it when most of a
+// large world is off screen. A cell a few times the typical sprite size works
+// well. 0 turns it off, the default.
+L2D_EXPORTED
+void
+l2d_scene_set_spatial_index(struct l2d_scene*, float cell_size);
+
+// Why a batch was drawn before the next drawer could join it.
+enum l2d_flush_reason {
+    l2d_FLUSH_TEXTURE, // different texture, and no room in the batch for it
+    l2d_FLUSH_MATERIAL,
+    l2d_FLUSH_BLEND,
+    l2d_FLUSH_MASK,
+    l2d_FLUSH_DESATURATE,
+    l2d_FLUSH_INSTANCING, // instanced or texture table use changed
+    l2d_FLUSH_DEPTH, // different depth level, see l2d_BLEND_DISABLED
+    l2d_FLUSH_FULL, // out of vertex indicies
+    l2d_FLUSH_END, // no drawers left for the target or screen
+    l2d_FLUSH_REASON_COUNT,
+};
+
+// What the last l2d_scene_render cost. Backend work (draw calls onwards)
+// includes image uploads and the scene's render targets.
+struct l2d_frame_stats {
+    unsigned long drawers_visited; // looked at, only nearby ones with an index
+    unsigned long drawers_culled; // of those, off screen or hidden
+    unsigned long batches;
+    unsigned long draw_calls;
+    unsigned long vertices;
+    unsigned long indices;
+    unsigned long vertex_bytes;
+    unsigned long index_bytes;
+    unsigned long texture_bytes;
+    unsigned long textures_uploaded;
+    unsigned long programs_compiled;
+    // Program, texture, uniform, blend, buffer and vertex attribute state
+    // calls made, and the ones skipped because the state was already set.
+    unsigned long state_calls;
+    unsigned long state_calls_elided;
+    // Pixels the depth test kept from being shaded, see l2d_BLEND_DISABLED.
+    // Only the software backend counts them, GL always reports 0.
+    unsigned long pixels_depth_rejected;
+    unsigned long flushes[l2d_FLUSH_REASON_COUNT];
+    bool sorted; // drawers whose order changed were sorted
+    uint64_t sort_ns; // bringing the draw order up to date, sorted or not
+    uint64_t batch_ns; // adding drawers to batches, not drawing them
+    bool replayed; // nothing changed, see l2d_scene_needs_render
+};
+
+L2D_EXPORTED
+void
+l2d_scene_get_frame_stats(struct l2d_scene*, struct l2d_frame_stats*);
+
+
+/**
+ * Profiling
+ *
+ * Built with PROFILE_ZONES, lib2d times its hot paths (stepping, sorting,
+ * batching, uploads, atlas packing, shader compiles) and keeps the last
+ * zones each thread recorded. Without it these do nothing.
+ */
+typedef void (*l2d_profile_cb)(void* userdata, const char* zone,
+        uint64_t start_ns, uint64_t end_ns, int thread);
+
+// Also hands every zone to `cb` as it ends, on the thread that timed it.
+// NULL stops.
+L2D_EXPORTED
+void
+l2d_profile_set_callback(l2d_profile_cb cb, void* userdata);
+
+// Writes the kept zones as Chrome trace_event JSON, for chrome://tracing or
+// Perfetto. Call it between frames. Returns false if the file can't be
+// written or lib2d was built without PROFILE_ZONES.
+L2D_EXPORTED
+bool
+l2d_profile_write_trace(const char* path);
+
 
 /**
  * Effects
@@ -239,6 +325,11 @@ L2D_EXPORTED
 void
 l2d_sprite_set_order(struct l2d_sprite*, int order);
 
+// Hidden sprites are skipped when rendering, their children are not.
+L2D_EXPORTED
+void
+l2d_sprite_set_visible(struct l2d_sprite*, bool visible);
+
 L2D_EXPORTED
 void
 l2d_sprite_set_on_click(struct l2d_sprite*, l2d_event_cb, void*);
@@ -361,4 +452,21 @@ L2D_EXPORTED
 void
 l2d_image_release(struct l2d_image*);
 
+
+/**
+ * Software renderer
+ *
+ * Only available in SOFT_RENDER builds. By default the main viewport is
+ * rendered into a buffer owned by lib2d; set_framebuffer redirects it into
+ * caller owned RGBA memory, top row first. Pass NULL to switch back.
+ */
+L2D_EXPORTED
+void
+l2d_soft_render_set_framebuffer(uint8_t* rgba, int width, int height,
+        int stride);
+
+L2D_EXPORTED
+const uint8_t*
+l2d_soft_render_get_pixels(int* width, int* height, int* stride);
+
 #endif
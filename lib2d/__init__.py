@@ -77,6 +77,7 @@ def init():
     # set correct return types
     _lib.l2d_ident_as_char.restype = ctypes.c_char_p
     _lib.l2d_ident_from_str.restype = l2d_ident
+    _lib.l2d_scene_needs_render.restype = ctypes.c_bool
     
     # initialize default resources
     _defaultresources = _lib.l2d_init_default_resources()
@@ -132,6 +133,9 @@ class Scene(object):
     def render(self):
         _lib.l2d_scene_render(self._ptr)
 
+    def needs_render(self):
+        return _lib.l2d_scene_needs_render(self._ptr)
+
     def set_viewport(self, w, h):
         _lib.l2d_scene_set_viewport(self._ptr, int(w), int(h))
 
@@ -143,6 +147,9 @@ class Scene(object):
                                      ctypes.c_float(dt),
                                      int(flags))
 
+    def set_spatial_index(self, cell_size):
+        _lib.l2d_scene_set_spatial_index(self._ptr, ctypes.c_float(cell_size))
+
     def feed_click(self, x, y, button=1):
         return _lib.l2d_scene_feed_click(self._ptr,
                                          ctypes.c_float(x),
@@ -305,6 +312,9 @@ class Sprite(object):
     def order(self, order):
         _lib.l2d_sprite_set_order(self._ptr, order)
 
+    def visible(self, visible):
+        _lib.l2d_sprite_set_visible(self._ptr, visible)
+
     def scale(self, scale, dt=0, flags=0):
         scale, dt = self.__float_wrap(scale, dt)
         _lib.l2d_sprite_scale(self._ptr, scale, dt, flags)
@@ -63,6 +63,8 @@ extern {
     fn l2d_scene_set_viewport(scene: *const l2d_scene, w: c_int, h: c_int);
     fn l2d_scene_set_translate(scene: *const l2d_scene, x: c_float, y: c_float, z: c_float, dt: c_float, flags: u32);
     fn l2d_scene_feed_click(scene: *const l2d_scene, x: c_float, y: c_float, button: c_int);
+    fn l2d_scene_set_spatial_index(scene: *const l2d_scene, cell_size: c_float);
+    fn l2d_scene_needs_render(scene: *const l2d_scene) -> bool;
 
     fn l2d_sprite_new(scene: *const l2d_scene, image: l2d_ident, flags: u32) -> *const l2d_sprite;
     fn l2d_sprite_delete(sprite: *const l2d_sprite);
@@ -73,6 +75,7 @@ extern {
     fn l2d_sprite_set_parent(sprite: *const l2d_sprite, parent: *const l2d_sprite);
     fn l2d_sprite_set_size(sprite: *const l2d_sprite, w: c_int, h: c_int, sprite_flags: u32);
     fn l2d_sprite_set_order(sprite: *const l2d_sprite, order: c_int);
+    fn l2d_sprite_set_visible(sprite: *const l2d_sprite, visible: bool);
     //fn l2d_sprite_set_on_click(sprite: *const l2d_sprite, );
     //fn l2d_sprite_set_on_anim_end(sprite: *const l2d_sprite, );
     fn l2d_sprite_set_stop_anims_on_hide(sprite: *const l2d_sprite, v: bool);
@@ -153,6 +156,12 @@ impl Sprite {
         }
     }
 
+    pub fn set_visible(&mut self, visible: bool) {
+        unsafe {
+            l2d_sprite_set_visible(self.raw, visible);
+        }
+    }
+
     pub fn xy(&mut self, x: f32, y: f32, dt: f32, anim_flags: u32) {
         unsafe {
             l2d_sprite_xy(self.raw, x as c_float, y as c_float, dt as c_float, anim_flags);
@@ -217,6 +226,18 @@ impl Scene {
             l2d_scene_render(self.raw)
         }
     }
+
+    pub fn needs_render(&mut self) -> bool {
+        unsafe {
+            l2d_scene_needs_render(self.raw)
+        }
+    }
+
+    pub fn set_spatial_index(&mut self, cell_size: f32) {
+        unsafe {
+            l2d_scene_set_spatial_index(self.raw, cell_size as c_float)
+        }
+    }
 }
 
 
@@ -1,5 +1,6 @@
 #include "atlas.h"
 #include "stretchy_buffer.h"
+#include "profile.h"
 #include <stdlib.h>
 
 struct atlas_entry {
@@ -112,6 +113,7 @@ uint8_t*
 atlas_pack(struct atlas* atlas,
         unsigned int max_width, unsigned int max_height,
         unsigned int* data_w, unsigned int* data_h) {
+    PROFILE_BEGIN(atlas_pack);
 
     sbfree(atlas->dont_fit);
     atlas->dont_fit = NULL;
@@ -249,6 +251,7 @@ atlas_pack(struct atlas* atlas,
     sbforeachv(struct atlas_entry* e, atlas->dont_fit) {
         sbpush(atlas->entries, e);
     }
+    PROFILE_END(atlas_pack);
     return res;
 }
 
@@ -2,7 +2,11 @@
 #include "atlas.h"
 #include "stretchy_buffer.h"
 #include "primitives.h"
+#include "render_api.h"
+#include "profile.h"
+#include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 static
 struct atlas_ref*
@@ -12,29 +16,59 @@ static
 struct atlas_ref*
 get_or_create_atlas(struct atlas_bank*, enum l2d_image_format);
 
+#define ATLAS_PAGE_SIZE 2048
+// Layers are passed to the shaders as unorm8, see struct vertex. Pages past
+// this go to another array.
+#define ATLAS_MAX_LAYERS 256
+
 struct atlas_bank_entry {
     struct atlas_entry* atlas_entry;
     struct texture* texture;
     struct rect texture_region;
+    int layer;
     uint32_t flags;
 };
 
+struct atlas_array;
+
 struct atlas_ref {
     struct atlas* atlas;
     struct texture* texture;
     enum l2d_image_format format;
     bool dirty;
+    struct atlas_array* array; // NULL unless pages are layered
+    int layer;
+    // Packed but not uploaded yet, see upload_array.
+    uint8_t* packed;
+    unsigned int packed_width, packed_height;
     struct atlas_bank_entry** entries; // stretchy_buffer
 }; 
 
+// An array texture holding pages of one format as its layers.
+struct atlas_array {
+    struct texture* texture;
+    enum l2d_image_format format;
+    unsigned int width, height; // of every layer, 0 until allocated
+    int capacity; // layers allocated
+    struct atlas_ref** pages; // stretchy_buffer, the page on each layer
+};
+
 struct atlas_bank {
     struct atlas_ref** atlas_refs; // stretchy_buffer
+    // Pages of a format are layers of array textures if the backend
+    // supports them. -1 until the first resolve asks.
+    int layered;
+    int max_layers; // per array
+    struct atlas_array** arrays; // stretchy_buffer
 };
 
 struct atlas_bank*
 atlas_bank_new() {
     struct atlas_bank* bank = malloc(sizeof(struct atlas_bank));
     bank->atlas_refs = NULL;
+    bank->layered = -1;
+    bank->max_layers = 0;
+    bank->arrays = NULL;
     return bank;
 }
 
@@ -43,60 +77,216 @@ atlas_bank_delete(struct atlas_bank* bank) {
     // TODO
 }
 
+static
+int
+format_bpp(enum l2d_image_format format) {
+    switch (format) {
+    case l2d_IMAGE_FORMAT_RGBA_8888: return 4;
+    case l2d_IMAGE_FORMAT_RGB_888: return 3;
+    case l2d_IMAGE_FORMAT_RGB_565: return 2;
+    case l2d_IMAGE_FORMAT_A_8: return 1;
+    default: assert(false); return 0;
+    }
+}
+
+// Moves the entries that didn't fit in the last pack of `ref` to a new page.
+// It is added to the end of bank->atlas_refs, dirty.
+static
+void
+move_pack_failed(struct atlas_bank* bank, struct atlas_ref* ref) {
+    struct atlas_entry* const* failed = atlas_get_pack_failed(ref->atlas, NULL);
+    if (!sbcount(failed))
+        return;
+    struct atlas_ref* new_ref = create_atlas(bank, ref->format);
+    new_ref->dirty = true;
+
+    sbforeachv(struct atlas_entry* e, failed) {
+        atlas_move_entry(new_ref->atlas, ref->atlas, e);
+        for (int i=0; i<sbcount(ref->entries); i++) {
+            struct atlas_bank_entry* b_e = ref->entries[i];
+            if (b_e->atlas_entry == e) {
+                sbremove(ref->entries, i, 1);
+                sbpush(new_ref->entries, b_e);
+                break;
+            }
+        }
+    }
+}
+
+static
+void
+update_entries(struct atlas_ref* ref, struct texture* texture,
+        unsigned int out_w, unsigned int out_h) {
+    sbforeachv(struct atlas_bank_entry* b_e, ref->entries) {
+        b_e->texture = texture;
+        b_e->layer = ref->layer;
+        unsigned int x, y, w, h;
+        atlas_entry_get_packed_location(b_e->atlas_entry,
+                &x, &y, &w, &h);
+        float fx = 1.0/out_w;
+        float fy = 1.0/out_h;
+        if (b_e->flags) {
+            x ++;
+            y ++;
+            w -= 2;
+            h -= 2;
+        }
+        b_e->texture_region.l = x * fx;
+        b_e->texture_region.t = y * fy;
+        b_e->texture_region.r = (x+w)*fx;
+        b_e->texture_region.b = (y+h)*fy;
+    }
+}
+
+static
+void
+resolve_page(struct atlas_bank* bank, struct l2d_image_bank* ib,
+        struct atlas_ref* ref) {
+    ref->dirty = false;
+    unsigned int out_w, out_h;
+    uint8_t* data = atlas_pack(ref->atlas, ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE,
+            &out_w, &out_h);
+    texture_set_image_data(ib, ref->texture, out_w, out_h,
+            ref->format, data, true);
+    free(data);
+
+    move_pack_failed(bank, ref);
+    update_entries(ref, ref->texture, out_w, out_h);
+}
+
+// Gives the page a layer in the last array of its format, or in a new one
+// once that is full.
+static
+void
+attach_array(struct atlas_bank* bank, struct atlas_ref* ref) {
+    struct atlas_array* array = NULL;
+    for (int i=sbcount(bank->arrays)-1; i>=0; i--) {
+        if (bank->arrays[i]->format == ref->format) {
+            array = bank->arrays[i];
+            break;
+        }
+    }
+    if (!array || sbcount(array->pages) == bank->max_layers) {
+        array = malloc(sizeof(struct atlas_array));
+        array->texture = ib_texture_new();
+        ib_texture_incref(array->texture);
+        array->format = ref->format;
+        array->width = array->height = 0;
+        array->capacity = 0;
+        array->pages = NULL;
+        sbpush(bank->arrays, array);
+    }
+    ref->array = array;
+    ref->layer = sbcount(array->pages);
+    sbpush(array->pages, ref);
+}
+
+static
+void
+pack_layer(struct atlas_bank* bank, struct atlas_ref* ref) {
+    ref->dirty = false;
+    if (!ref->array) {
+        attach_array(bank, ref);
+    }
+    free(ref->packed);
+    ref->packed = atlas_pack(ref->atlas, ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE,
+            &ref->packed_width, &ref->packed_height);
+    move_pack_failed(bank, ref);
+}
+
+// Doubles `size` until it is at least `needed`, up to ATLAS_PAGE_SIZE.
+static
+unsigned int
+grow_size(unsigned int size, unsigned int needed) {
+    if (size == 0) return needed;
+    while (size < needed) size *= 2;
+    return size < ATLAS_PAGE_SIZE ? size : ATLAS_PAGE_SIZE;
+}
+
+// Uploads the array's newly packed pages, each to its own layer. The array
+// is only allocated again once a page outgrows its layers or there are no
+// layers left, and then with room to spare so that it rarely happens.
+static
+void
+upload_array(struct atlas_bank* bank, struct l2d_image_bank* ib,
+        struct atlas_array* array) {
+    unsigned int width = array->width, height = array->height;
+    bool packed = false;
+    sbforeachv(struct atlas_ref* ref, array->pages) {
+        if (!ref->packed) continue;
+        packed = true;
+        if (ref->packed_width > width) width = ref->packed_width;
+        if (ref->packed_height > height) height = ref->packed_height;
+    }
+    if (!packed)
+        return;
+
+    if (width != array->width || height != array->height
+            || sbcount(array->pages) > array->capacity) {
+        array->width = grow_size(array->width, width);
+        array->height = grow_size(array->height, height);
+        int capacity = array->capacity*2;
+        if (capacity < sbcount(array->pages))
+            capacity = sbcount(array->pages);
+        if (capacity > bank->max_layers)
+            capacity = bank->max_layers;
+        array->capacity = capacity;
+        texture_set_layers(ib, array->texture, array->width, array->height,
+                capacity, array->format, NULL, true);
+
+        // The new texture starts out empty, the clean pages are packed
+        // again for their pixels. Their entries haven't changed, so neither
+        // does their layout.
+        sbforeachv(struct atlas_ref* ref, array->pages) {
+            if (ref->packed) continue;
+            ref->packed = atlas_pack(ref->atlas, ATLAS_PAGE_SIZE,
+                    ATLAS_PAGE_SIZE, &ref->packed_width, &ref->packed_height);
+        }
+    }
+
+    sbforeachv(struct atlas_ref* ref, array->pages) {
+        if (!ref->packed) continue;
+        texture_set_layer(ib, array->texture, ref->layer,
+                ref->packed_width, ref->packed_height, array->format,
+                ref->packed);
+        free(ref->packed);
+        ref->packed = NULL;
+    }
+    // Entries are placed relative to the size of the layers, which only
+    // changes for all pages at once.
+    sbforeachv(struct atlas_ref* ref, array->pages) {
+        update_entries(ref, array->texture, array->width, array->height);
+    }
+}
+
 bool
 atlas_bank_resolve(struct atlas_bank* bank, struct l2d_image_bank* ib) {
-    bool reresolve = false;
+    PROFILE_BEGIN(atlas_bank_resolve);
+    if (bank->layered == -1) {
+        bank->layered = render_api_supports_texture_arrays();
+        bank->max_layers = render_api_max_texture_layers();
+        if (bank->max_layers > ATLAS_MAX_LAYERS)
+            bank->max_layers = ATLAS_MAX_LAYERS;
+    }
     bool found_dirty = false;
-    sbforeachv(struct atlas_ref* ref, bank->atlas_refs) {
+    // Pages that overflow add new dirty ones at the end, reached by the
+    // same loop.
+    for (int i=0; i<sbcount(bank->atlas_refs); i++) {
+        struct atlas_ref* ref = bank->atlas_refs[i];
         if (!ref->dirty) continue;
         found_dirty = true;
-        ref->dirty = false;
-        unsigned int out_w, out_h;
-        uint8_t* data = atlas_pack(ref->atlas, 2048, 2048, &out_w, &out_h);
-        texture_set_image_data(ib, ref->texture, out_w, out_h,
-                ref->format, data, true);
-        free(data);
-
-        struct atlas_entry* const* failed = atlas_get_pack_failed(ref->atlas, NULL);
-        if (sbcount(failed)) {
-            reresolve = true;
-            struct atlas_ref* new_ref = create_atlas(bank, ref->format);
-            new_ref->dirty = true;
-
-            sbforeachv(struct atlas_entry* e, failed) {
-                atlas_move_entry(new_ref->atlas, ref->atlas, e);
-                for (int i=0; i<sbcount(ref->entries); i++) {
-                    struct atlas_bank_entry* b_e = ref->entries[i];
-                    if (b_e->atlas_entry == e) {
-                        sbremove(ref->entries, i, 1);
-                        sbpush(new_ref->entries, b_e);
-                        break;
-                    }
-                }
-            }
+        if (bank->layered) {
+            pack_layer(bank, ref);
+        } else {
+            resolve_page(bank, ib, ref);
         }
-
-        sbforeachv(struct atlas_bank_entry* b_e, ref->entries) {
-            b_e->texture = ref->texture;
-            unsigned int x, y, w, h;
-            atlas_entry_get_packed_location(b_e->atlas_entry,
-                    &x, &y, &w, &h);
-            float fx = 1.0/out_w;
-            float fy = 1.0/out_h;
-            if (b_e->flags) {
-                x ++;
-                y ++;
-                w -= 2;
-                h -= 2;
-            }
-            b_e->texture_region.l = x * fx;
-            b_e->texture_region.t = y * fy;
-            b_e->texture_region.r = (x+w)*fx;
-            b_e->texture_region.b = (y+h)*fy;
+    }
+    if (found_dirty && bank->layered) {
+        sbforeachv(struct atlas_array* array, bank->arrays) {
+            upload_array(bank, ib, array);
         }
     }
-
-    if (reresolve) atlas_bank_resolve(bank, ib);
+    PROFILE_END(atlas_bank_resolve);
     return found_dirty;
 }
 
@@ -105,6 +295,7 @@ atlas_bank_new_entry(struct atlas_bank* bank, int width, int height,
         uint8_t* data, enum l2d_image_format format, uint32_t flags) {
     struct atlas_bank_entry* e = malloc(sizeof(struct atlas_bank_entry));
     e->texture = NULL;
+    e->layer = 0;
 
     struct atlas_ref* ref = get_or_create_atlas(bank, format);
     ref->dirty = true;
@@ -125,24 +316,25 @@ atlas_bank_get_region(struct atlas_bank_entry* e) {
     return e->texture_region;
 }
 
+int
+atlas_bank_get_layer(struct atlas_bank_entry* e) {
+    return e->layer;
+}
+
 
 static
 struct atlas_ref*
 create_atlas(struct atlas_bank* bank, enum l2d_image_format format) {
-    int bpp = 0;
-    switch (format) {
-    case l2d_IMAGE_FORMAT_RGBA_8888: bpp = 4; break;
-    case l2d_IMAGE_FORMAT_RGB_888: bpp = 3; break;
-    case l2d_IMAGE_FORMAT_RGB_565: bpp = 2; break;
-    case l2d_IMAGE_FORMAT_A_8: bpp = 1; break;
-    default: assert(false);
-    }
     struct atlas_ref* ref = malloc(sizeof(struct atlas_ref));
     sbpush(bank->atlas_refs, ref);
-    ref->atlas = atlas_new(bpp);
+    ref->atlas = atlas_new(format_bpp(format));
     ref->texture = ib_texture_new();
     ib_texture_incref(ref->texture);
     ref->format = format;
+    ref->dirty = false;
+    ref->array = NULL;
+    ref->layer = 0;
+    ref->packed = NULL;
     ref->entries = NULL;
     return ref;
 }
@@ -28,4 +28,8 @@ atlas_bank_get_texture(struct atlas_bank_entry*);
 struct rect
 atlas_bank_get_region(struct atlas_bank_entry*);
 
+// The entry's layer if its texture is an array, 0 otherwise.
+int
+atlas_bank_get_layer(struct atlas_bank_entry*);
+
 #endif
@@ -0,0 +1,314 @@
+#include "grid.h"
+#include "stretchy_buffer.h"
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+// Items covering more cells than this go in the loose list instead, so a
+// single huge item can't make every move expensive.
+#define GRID_MAX_ITEM_CELLS 16
+// Keeps cell coordinates well inside an int.
+#define GRID_MAX_COORD (1 << 20)
+#define GRID_MIN_CAPACITY 64
+// Emptied cells' item buffers kept for new cells, so items moving between
+// cells don't allocate.
+#define GRID_MAX_SPARE 64
+
+struct grid_cell {
+    int x, y;
+    bool used;
+    struct grid_item** items; // stretchy buffer
+};
+
+struct grid {
+    float cell_size;
+    struct grid_cell* cells; // open addressing, capacity is a power of two
+    int cell_capacity;
+    int cell_count;
+    struct grid_item** loose; // stretchy buffer
+    struct grid_item*** spare; // stretchy buffer of empty item buffers
+    int item_count;
+    uint32_t stamp;
+};
+
+static
+unsigned int
+cell_hash(int x, int y) {
+    uint32_t h = (uint32_t)x*0x9e3779b1u ^ (uint32_t)y*0x85ebca77u;
+    return h ^ (h >> 15);
+}
+
+// The cell at (x, y), or the unused slot it would go in.
+static
+struct grid_cell*
+cell_slot(struct grid* g, int x, int y) {
+    unsigned int mask = g->cell_capacity - 1;
+    unsigned int i = cell_hash(x, y) & mask;
+    while (g->cells[i].used && (g->cells[i].x != x || g->cells[i].y != y)) {
+        i = (i + 1) & mask;
+    }
+    return &g->cells[i];
+}
+
+static
+void
+grid_resize(struct grid* g, int capacity) {
+    struct grid_cell* old = g->cells;
+    int old_capacity = g->cell_capacity;
+    g->cell_capacity = capacity;
+    g->cells = calloc(g->cell_capacity, sizeof(struct grid_cell));
+    for (int i=0; i<old_capacity; i++) {
+        if (old[i].used)
+            *cell_slot(g, old[i].x, old[i].y) = old[i];
+    }
+    free(old);
+}
+
+static
+struct grid_cell*
+cell_get(struct grid* g, int x, int y) {
+    struct grid_cell* c = cell_slot(g, x, y);
+    if (c->used)
+        return c;
+    if ((g->cell_count + 1)*2 > g->cell_capacity) {
+        grid_resize(g, g->cell_capacity*2);
+        c = cell_slot(g, x, y);
+    }
+    c->x = x;
+    c->y = y;
+    c->used = true;
+    c->items = NULL;
+    if (sbcount(g->spare)) {
+        c->items = sblast(g->spare);
+        sbremovelast(g->spare);
+    }
+    g->cell_count++;
+    return c;
+}
+
+// Removes an empty cell. Later cells of its probe run are shifted back into
+// the hole, so lookups never need tombstones. The table shrinks once it is
+// mostly empty, which keeps walking all of it proportional to the cells.
+static
+void
+cell_remove(struct grid* g, struct grid_cell* c) {
+    if (sbcount(g->spare) < GRID_MAX_SPARE) {
+        sbpush(g->spare, c->items);
+    } else {
+        sbfree(c->items);
+    }
+
+    unsigned int mask = g->cell_capacity - 1;
+    unsigned int hole = c - g->cells;
+    unsigned int i = hole;
+    for (;;) {
+        i = (i + 1) & mask;
+        struct grid_cell* next = &g->cells[i];
+        if (!next->used)
+            break;
+        // It can move back if its home slot isn't between the hole and it.
+        unsigned int home = cell_hash(next->x, next->y) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            g->cells[hole] = *next;
+            hole = i;
+        }
+    }
+    g->cells[hole].used = false;
+    g->cells[hole].items = NULL;
+    g->cell_count--;
+
+    if (g->cell_capacity > GRID_MIN_CAPACITY
+            && g->cell_count*8 < g->cell_capacity) {
+        grid_resize(g, g->cell_capacity/2);
+    }
+}
+
+static
+int
+cell_coord(struct grid* g, float v) {
+    float c = floorf(v/g->cell_size);
+    if (c < -GRID_MAX_COORD) return -GRID_MAX_COORD;
+    if (c > GRID_MAX_COORD) return GRID_MAX_COORD;
+    return (int)c;
+}
+
+// Returns false if the rect doesn't map to a usable range of cells.
+static
+bool
+cell_range(struct grid* g, struct rect const* r,
+        int* x0, int* y0, int* x1, int* y1) {
+    if (!isfinite(r->l) || !isfinite(r->t) || !isfinite(r->r)
+            || !isfinite(r->b))
+        return false;
+    *x0 = cell_coord(g, r->l);
+    *y0 = cell_coord(g, r->t);
+    *x1 = cell_coord(g, r->r);
+    *y1 = cell_coord(g, r->b);
+    return true;
+}
+
+struct grid*
+grid_new(float cell_size) {
+    struct grid* g = malloc(sizeof(struct grid));
+    g->cell_size = cell_size;
+    g->cells = NULL;
+    g->cell_capacity = 0;
+    g->cell_count = 0;
+    g->loose = NULL;
+    g->spare = NULL;
+    g->item_count = 0;
+    g->stamp = 0;
+    grid_resize(g, GRID_MIN_CAPACITY);
+    return g;
+}
+
+void
+grid_delete(struct grid* g) {
+    for (int i=0; i<g->cell_capacity; i++) {
+        sbfree(g->cells[i].items);
+    }
+    free(g->cells);
+    sbfree(g->loose);
+    for (int i=0; i<sbcount(g->spare); i++) {
+        sbfree(g->spare[i]);
+    }
+    sbfree(g->spare);
+    free(g);
+}
+
+void
+grid_item_init(struct grid_item* item, void* data) {
+    item->data = data;
+    item->x0 = item->y0 = 0;
+    item->x1 = item->y1 = -1;
+    item->loose_index = -1;
+    item->stamp = 0;
+    item->linked = false;
+}
+
+static
+void
+grid_unlink(struct grid* g, struct grid_item* item) {
+    if (item->loose_index >= 0) {
+        struct grid_item* last = sblast(g->loose);
+        g->loose[item->loose_index] = last;
+        last->loose_index = item->loose_index;
+        sbremovelast(g->loose);
+        item->loose_index = -1;
+    }
+    for (int y=item->y0; y<=item->y1; y++) {
+        for (int x=item->x0; x<=item->x1; x++) {
+            struct grid_cell* c = cell_slot(g, x, y);
+            assert(c->used);
+            for (int i=0; i<sbcount(c->items); i++) {
+                if (c->items[i] == item) {
+                    c->items[i] = sblast(c->items);
+                    sbremovelast(c->items);
+                    break;
+                }
+            }
+            if (!sbcount(c->items))
+                cell_remove(g, c);
+        }
+    }
+    item->x1 = item->y1 = -1;
+    item->x0 = item->y0 = 0;
+}
+
+void
+grid_update(struct grid* g, struct grid_item* item,
+        struct rect const* bounds) {
+    int x0, y0, x1, y1;
+    bool fits = bounds && cell_range(g, bounds, &x0, &y0, &x1, &y1)
+        && (int64_t)(x1 - x0 + 1)*(y1 - y0 + 1) <= GRID_MAX_ITEM_CELLS;
+
+    if (item->linked) {
+        if (fits && item->loose_index < 0 && x0 == item->x0
+                && y0 == item->y0 && x1 == item->x1 && y1 == item->y1)
+            return;
+        if (!fits && item->loose_index >= 0)
+            return;
+        grid_unlink(g, item);
+    } else {
+        item->linked = true;
+        g->item_count++;
+    }
+
+    if (!fits) {
+        item->loose_index = sbcount(g->loose);
+        sbpush(g->loose, item);
+        return;
+    }
+    item->x0 = x0;
+    item->y0 = y0;
+    item->x1 = x1;
+    item->y1 = y1;
+    for (int y=y0; y<=y1; y++) {
+        for (int x=x0; x<=x1; x++) {
+            struct grid_cell* c = cell_get(g, x, y);
+            sbpush(c->items, item);
+        }
+    }
+}
+
+void
+grid_remove(struct grid* g, struct grid_item* item) {
+    if (!item->linked)
+        return;
+    grid_unlink(g, item);
+    item->linked = false;
+    g->item_count--;
+}
+
+static
+void
+cell_collect(struct grid* g, struct grid_cell* c, void*** out) {
+    for (int i=0; i<sbcount(c->items); i++) {
+        struct grid_item* item = c->items[i];
+        if (item->stamp != g->stamp) {
+            item->stamp = g->stamp;
+            sbpush(*out, item->data);
+        }
+    }
+}
+
+bool
+grid_query(struct grid* g, struct rect const* area, void*** out) {
+    int x0, y0, x1, y1;
+    if (!cell_range(g, area, &x0, &y0, &x1, &y1))
+        return false;
+    int64_t area_cells = (int64_t)(x1 - x0 + 1)*(y1 - y0 + 1);
+    if (area_cells > g->item_count)
+        return false;
+
+    // Items spanning several cells are returned once.
+    if (++g->stamp == 0) {
+        for (int i=0; i<g->cell_capacity; i++) {
+            for (int j=0; j<sbcount(g->cells[i].items); j++) {
+                g->cells[i].items[j]->stamp = 0;
+            }
+        }
+        g->stamp = 1;
+    }
+
+    if (area_cells > g->cell_capacity) {
+        for (int i=0; i<g->cell_capacity; i++) {
+            struct grid_cell* c = &g->cells[i];
+            if (c->used && c->x >= x0 && c->x <= x1
+                    && c->y >= y0 && c->y <= y1)
+                cell_collect(g, c, out);
+        }
+    } else {
+        for (int y=y0; y<=y1; y++) {
+            for (int x=x0; x<=x1; x++) {
+                struct grid_cell* c = cell_slot(g, x, y);
+                if (c->used)
+                    cell_collect(g, c, out);
+            }
+        }
+    }
+    for (int i=0; i<sbcount(g->loose); i++) {
+        sbpush(*out, g->loose[i]->data);
+    }
+    return true;
+}
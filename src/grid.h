@@ -0,0 +1,55 @@
+#ifndef __LIB2D_GRID__
+#define __LIB2D_GRID__
+
+#include "primitives.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * A uniform grid over an unbounded plane, used to find the items whose
+ * bounds may touch a rect without looking at every item. Cells are kept in
+ * a hash table, so only the cells something was placed in take memory.
+ *
+ * Items are owned by the caller and embedded in whatever they describe.
+ * Items with no usable bounds, or bounds covering too many cells, are kept
+ * in a list every query returns.
+ */
+struct grid_item {
+    void* data;
+    int x0, y0, x1, y1; // cells covered, none if x1 < x0
+    int loose_index; // in the grid's loose list, or -1
+    uint32_t stamp; // last query that returned the item
+    bool linked;
+};
+
+struct grid;
+
+struct grid*
+grid_new(float cell_size);
+
+void
+grid_delete(struct grid*);
+
+void
+grid_item_init(struct grid_item*, void* data);
+
+/**
+ * Places the item, or moves it if it is already in the grid. NULL bounds
+ * put the item in the list every query returns.
+ */
+void
+grid_update(struct grid*, struct grid_item*, struct rect const* bounds);
+
+void
+grid_remove(struct grid*, struct grid_item*);
+
+/**
+ * Appends the data of every item that may intersect `area` to the stretchy
+ * buffer `*out`, each once and in no particular order. Returns false without
+ * touching `*out` if the area spans more cells than there are items, in
+ * which case walking all of them is cheaper.
+ */
+bool
+grid_query(struct grid*, struct rect const* area, void*** out);
+
+#endif
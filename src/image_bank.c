@@ -5,7 +5,7 @@
 #include "render_api.h"
 #include "atlas_bank.h"
 #include "primitives.h"
-#include "gl.h"
+#include "profile.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -16,9 +16,11 @@
 
 struct texture {
     int refcount;
+    uint32_t id;
     uint32_t native_ptr;
     int width;
     int height;
+    int layers; // 0 unless it is a TEXTURE_2D_ARRAY
     enum texture_type textureType;
 };
 
@@ -34,6 +36,7 @@ struct l2d_image {
     struct atlas_bank_entry* atlas_bank_entry;
     struct texture* texture;
     struct rect texture_region;
+    int texture_layer;
 
     struct l2d_nine_patch* nine_patch;
     struct l2d_target* renderTarget;
@@ -47,9 +50,13 @@ struct l2d_image_bank {
     struct l2d_image* imageList; // images upon which no action is needed
     //struct l2d_image* imageToUploadList; // needs to be uploaded
 
+    // Uploaded in the order they were queued, see queue_upload.
     struct pending_upload* pendingUploadList;
+    struct pending_upload** pendingUploadTail;
 
     struct atlas_bank* atlas_bank;
+
+    uint32_t generation;
 };
 
 struct l2d_image_bank*
@@ -57,7 +64,9 @@ ib_new(void) {
     struct l2d_image_bank* ib = (struct l2d_image_bank*)malloc(sizeof(struct l2d_image_bank));
     ib->imageList = NULL;
     ib->pendingUploadList = NULL;
+    ib->pendingUploadTail = &ib->pendingUploadList;
     ib->atlas_bank = atlas_bank_new();
+    ib->generation = 0;
     return ib;
 }
 
@@ -114,6 +123,7 @@ ib_image_new(struct l2d_image_bank* ib) {
     image->texture_region.t = 0;
     image->texture_region.r = 1;
     image->texture_region.b = 1;
+    image->texture_layer = 0;
     image->nine_patch = NULL;
     image->renderTarget = NULL;
 
@@ -186,59 +196,95 @@ struct pending_upload {
     void* data;
     int width;
     int height;
+    int layers;
+    int layer; // the only layer replaced if >= 0, see texture_set_layer
 
     struct pending_upload* next;
 };
 
+static
+void
+queue_upload(struct l2d_image_bank* ib, struct pending_upload* u) {
+    u->next = NULL;
+    *ib->pendingUploadTail = u;
+    ib->pendingUploadTail = &u->next;
+}
+
 static
 void
 doPendingUpload(struct pending_upload* u) {
     if (!ib_texture_decref(u->texture)) {
+        enum texture_type type = u->layers || u->layer >= 0
+            ? TEXTURE_2D_ARRAY : TEXTURE_2D;
         if (!u->texture->native_ptr) {
-            u->texture->native_ptr = render_api_texture_new(TEXTURE_2D);
-            u->texture->textureType = TEXTURE_2D;
+            u->texture->native_ptr = render_api_texture_new(type);
+            u->texture->textureType = type;
         }
+        assert(u->texture->textureType == type);
         struct render_api_upload_info info = {
             .data=u->data,
-            .texture_type=TEXTURE_2D,
+            .texture_type=type,
             .native_ptr=u->texture->native_ptr,
             .clamp=u->clamp,
             .format=u->format,
             .width=u->width,
-            .height=u->height
+            .height=u->height,
+            .layers=u->layers,
+            .update_layer=u->layer >= 0,
+            .layer=u->layer,
         };
         render_api_texture_upload(&info);
-        u->texture->width = u->width;
-        u->texture->height = u->height;
+        if (u->layer < 0) {
+            u->texture->width = u->width;
+            u->texture->height = u->height;
+            u->texture->layers = u->layers;
+        }
     }
     if (u->data) free(u->data);
 }
 
 void
 ib_upload_pending(struct l2d_image_bank* ib) {
+    PROFILE_BEGIN(ib_upload_pending);
     if (atlas_bank_resolve(ib->atlas_bank, ib)) {
+        ib->generation++;
         struct l2d_image* im = ib->imageList;
         while (im) {
             if (im->atlas_bank_entry) {
                 ib_image_set_texture(im, atlas_bank_get_texture(im->atlas_bank_entry));
                 im->texture_region = atlas_bank_get_region(im->atlas_bank_entry);
+                im->texture_layer = atlas_bank_get_layer(im->atlas_bank_entry);
             }
             im = im->next;
         }
     }
 
+    if (ib->pendingUploadList)
+        ib->generation++;
     while (ib->pendingUploadList) {
         struct pending_upload* u = ib->pendingUploadList;
         doPendingUpload(u);
         ib->pendingUploadList = u->next;
         free(u);
     }
+    ib->pendingUploadTail = &ib->pendingUploadList;
+    PROFILE_END(ib_upload_pending);
 }
 
 void
 texture_set_image_data(struct l2d_image_bank* ib, struct texture* tex,
         int width, int height, enum l2d_image_format format,
         void const* data, bool clamp) {
+    texture_set_layers(ib, tex, width, height, 0, format, data, clamp);
+}
+
+// A copy of `data` to be uploaded to the texture, not yet queued.
+static
+struct pending_upload*
+upload_new(struct l2d_image_bank* ib, struct texture* tex,
+        int width, int height, int layers, enum l2d_image_format format,
+        void const* data, bool clamp) {
+    ib->generation++;
     struct pending_upload* u =
         (struct pending_upload*)malloc(sizeof(struct pending_upload));
     u->clamp = clamp;
@@ -248,6 +294,8 @@ texture_set_image_data(struct l2d_image_bank* ib, struct texture* tex,
 
     u->width = width;
     u->height = height;
+    u->layers = layers;
+    u->layer = -1;
     u->format = format;
 
     int bytesPerPixel = 0;
@@ -259,22 +307,45 @@ texture_set_image_data(struct l2d_image_bank* ib, struct texture* tex,
     default: assert(false);
     }
 
-    const int size = width*height*bytesPerPixel;
-    u->data = malloc(size);
-    memcpy(u->data, data, size);
+    const size_t size =
+        (size_t)width*height*bytesPerPixel*(layers ? layers : 1);
+    u->data = NULL;
+    if (data) {
+        u->data = malloc(size);
+        memcpy(u->data, data, size);
+    }
+    return u;
+}
+
+void
+texture_set_layers(struct l2d_image_bank* ib, struct texture* tex,
+        int width, int height, int layers, enum l2d_image_format format,
+        void const* data, bool clamp) {
+    queue_upload(ib, upload_new(ib, tex, width, height, layers, format,
+                data, clamp));
+}
 
-    u->next = ib->pendingUploadList;
-    ib->pendingUploadList = u;
+void
+texture_set_layer(struct l2d_image_bank* ib, struct texture* tex, int layer,
+        int width, int height, enum l2d_image_format format,
+        void const* data) {
+    struct pending_upload* u = upload_new(ib, tex, width, height, 0, format,
+            data, true);
+    u->layer = layer;
+    queue_upload(ib, u);
 }
 
 struct texture*
 ib_texture_new(void) {
+    static uint32_t next_id = 1;
     struct texture* tex =
         (struct texture*)malloc(sizeof(struct texture));
     tex->refcount = 0;
+    tex->id = next_id++;
     tex->native_ptr = 0;
     tex->width = 0;
     tex->height = 0;
+    tex->layers = 0;
     tex->textureType = 0;
     return tex;
 }
@@ -284,6 +355,7 @@ image_set_data(struct l2d_image* image,
         int width, int height, enum l2d_image_format format,
         void* data, uint32_t flags) {
 
+    image->ib->generation++;
     image->format = format;
 
     int bytesPerPixel = 0;
@@ -337,6 +409,7 @@ image_set_data(struct l2d_image* image,
 void
 l2d_image_set_nine_patch(struct l2d_image* image,
         struct l2d_nine_patch* patch) {
+    image->ib->generation++;
     image->nine_patch = patch;
 }
 
@@ -347,6 +420,7 @@ l2d_image_get_nine_patch(struct l2d_image* image) {
 
 void
 image_set_flip_y(struct l2d_image* image, bool flip) {
+    image->ib->generation++;
     image->flip_y = flip;
 }
 
@@ -369,6 +443,7 @@ l2d_image_bind(struct l2d_image* image, int32_t handle, int texture_slot) {
 
 void
 ib_image_set_texture(struct l2d_image* image, struct texture* tex) {
+    image->ib->generation++;
     struct texture* oldTex = image->texture;
     ib_texture_incref(tex);
     image->texture = tex;
@@ -396,12 +471,18 @@ ib_image_setAsRenderTarget(struct l2d_image* image,
 
     u->width = width;
     u->height = height;
+    u->layers = 0;
+    u->layer = -1;
     u->format = l2d_IMAGE_FORMAT_RGBA_8888;
 
     u->data = NULL;
 
-    u->next = image->ib->pendingUploadList;
-    image->ib->pendingUploadList = u;
+    queue_upload(image->ib, u);
+}
+
+uint32_t
+ib_generation(struct l2d_image_bank* ib) {
+    return ib->generation;
 }
 
 bool
@@ -411,12 +492,20 @@ ib_image_same_texture(struct l2d_image* lhs, struct l2d_image* rhs) {
     return lhs->texture == rhs->texture;
 }
 
+uint32_t
+ib_image_texture_id(struct l2d_image* image) {
+    if (!image || !image->texture) return 0;
+    return image->texture->id;
+}
+
+bool
+ib_image_is_layered(struct l2d_image* image) {
+    return image && image->texture && image->texture->layers;
+}
+
 int
-image_sort_compare(struct l2d_image* lhs, struct l2d_image* rhs) {
-    if (lhs->texture == rhs->texture) {
-        return 0;
-    }
-    return lhs->texture - rhs->texture;
+ib_image_texture_layer(struct l2d_image* image) {
+    return image->texture_layer;
 }
 
 int
@@ -447,14 +536,7 @@ ib_image_format(struct l2d_image* im) {
 }
 
 bool
-ib_image_bind_framebuffer_texture(struct l2d_image* image) {
-    // TODO abstract GL
+ib_image_bind_framebuffer_texture(struct l2d_image* image, uint32_t fbo) {
     assert(image->texture);
-    if (image->texture->native_ptr) {
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                GL_TEXTURE_2D, image->texture->native_ptr, 0);
-        return true;
-    } else {
-        return false;
-    }
+    return render_api_framebuffer_attach(fbo, image->texture->native_ptr);
 }
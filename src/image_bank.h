@@ -20,6 +20,11 @@ ib_delete(struct l2d_image_bank*);
 void
 ib_upload_pending(struct l2d_image_bank*);
 
+// Changes whenever an image's pixels, texture or layout might have, so
+// callers can tell if what they drew last is out of date.
+uint32_t
+ib_generation(struct l2d_image_bank*);
+
 void
 ib_image_bind(struct l2d_image* image, int pixelSizeUniform, int32_t handle,
         int texture_slot);
@@ -40,8 +45,18 @@ void
 ib_image_setAsRenderTarget(struct l2d_image*,
         struct l2d_target*, int width, int height);
 
+// Small number identifying the image's texture, 0 if it has none yet. Used
+// to group drawers by texture when sorting.
+uint32_t
+ib_image_texture_id(struct l2d_image*);
+
+// Whether the image's texture is a TEXTURE_2D_ARRAY, as atlas pages are when
+// the backend supports it. ib_image_texture_layer is the image's layer.
+bool
+ib_image_is_layered(struct l2d_image*);
+
 int
-image_sort_compare(struct l2d_image*, struct l2d_image*);
+ib_image_texture_layer(struct l2d_image*);
 
 int
 ib_image_get_width(struct l2d_image*);
@@ -74,6 +89,20 @@ void
 texture_set_image_data(struct l2d_image_bank*, struct texture*, int width, int height,
         enum l2d_image_format, void const* data, bool clamp);
 
+// Like texture_set_image_data but makes a TEXTURE_2D_ARRAY of `layers`
+// consecutive width*height images. Its contents are left undefined if data
+// is NULL.
+void
+texture_set_layers(struct l2d_image_bank*, struct texture*, int width,
+        int height, int layers, enum l2d_image_format, void const* data,
+        bool clamp);
+
+// Replaces the top left width*height of one layer of a texture made by
+// texture_set_layers, leaving the others as they are.
+void
+texture_set_layer(struct l2d_image_bank*, struct texture*, int layer,
+        int width, int height, enum l2d_image_format, void const* data);
+
 bool
 ib_image_same_texture(struct l2d_image* lhs, struct l2d_image* rhs);
 
@@ -91,6 +120,6 @@ enum l2d_image_format
 ib_image_format(struct l2d_image*);
 
 bool
-ib_image_bind_framebuffer_texture(struct l2d_image*);
+ib_image_bind_framebuffer_texture(struct l2d_image*, uint32_t fbo);
 
 #endif
@@ -0,0 +1,123 @@
+#define _POSIX_C_SOURCE 200809L
+#include "job.h"
+#include <stdlib.h>
+
+#define MAX_THREADS 32
+
+static int thread_count = 0;
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static pthread_t threads[MAX_THREADS];
+
+// Current job. Written by the calling thread while holding `lock`, before
+// `generation` is bumped.
+static job_func job_fn;
+static void* job_userdata;
+static int job_count;
+static volatile int job_next;
+static int job_active;
+static unsigned int generation;
+
+static
+void
+run_job(void) {
+    int i;
+    while ((i = __sync_fetch_and_add(&job_next, 1)) < job_count) {
+        job_fn(job_userdata, i);
+    }
+}
+
+static
+void*
+worker(void* unused) {
+    unsigned int seen = 0;
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (generation == seen) {
+            pthread_cond_wait(&wake, &lock);
+        }
+        seen = generation;
+        pthread_mutex_unlock(&lock);
+
+        run_job();
+
+        pthread_mutex_lock(&lock);
+        if (--job_active == 0) {
+            pthread_cond_signal(&done);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+int
+job_thread_count(void) {
+    if (thread_count) return thread_count;
+
+    const char* env = getenv("L2D_THREADS");
+    int n = env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > MAX_THREADS) n = MAX_THREADS;
+
+    int started = 1;
+    for (int i=0; i<n-1; i++) {
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+            break;
+        pthread_detach(threads[i]);
+        started++;
+    }
+    thread_count = started;
+    return thread_count;
+}
+
+void
+job_parallel_for(int count, job_func func, void* userdata) {
+    int n = job_thread_count();
+    if (n == 1 || count <= 1) {
+        for (int i=0; i<count; i++) {
+            func(userdata, i);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    job_fn = func;
+    job_userdata = userdata;
+    job_count = count;
+    job_next = 0;
+    job_active = n-1;
+    generation++;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&lock);
+
+    run_job();
+
+    pthread_mutex_lock(&lock);
+    while (job_active) {
+        pthread_cond_wait(&done, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+#else
+
+int
+job_thread_count(void) {
+    thread_count = 1;
+    return thread_count;
+}
+
+void
+job_parallel_for(int count, job_func func, void* userdata) {
+    for (int i=0; i<count; i++) {
+        func(userdata, i);
+    }
+}
+
+#endif
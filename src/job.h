@@ -0,0 +1,22 @@
+#ifndef __LIB2D_JOB__
+#define __LIB2D_JOB__
+
+/**
+ * A tiny fork/join thread pool. `job_parallel_for` calls `func` once for
+ * every index in [0, count) spread over the worker threads and the calling
+ * thread, and returns when all of them are done. Calls must not be nested.
+ */
+typedef void (*job_func)(void* userdata, int index);
+
+void
+job_parallel_for(int count, job_func func, void* userdata);
+
+/**
+ * Number of threads (including the caller) that `job_parallel_for` spreads
+ * work over. Defaults to the number of online cores, or the L2D_THREADS
+ * environment variable if set.
+ */
+int
+job_thread_count(void);
+
+#endif
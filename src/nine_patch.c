@@ -12,7 +12,7 @@
 #endif
 #endif
 
-static const unsigned short g3x3Indices[] = {
+static const vertex_index g3x3Indices[] = {
     0, 5, 1,    0, 4, 5,
     1, 6, 2,    1, 5, 6,
     2, 7, 3,    2, 6, 7,
@@ -64,7 +64,7 @@ struct geo_vert {
 
 static
 void
-fillIndices(uint16_t indices[], int xCount, int yCount) {
+fillIndices(vertex_index indices[], int xCount, int yCount) {
     int n = 0;
     for (int y = 0; y < yCount; y++) {
         for (int x = 0; x < xCount; x++) {
@@ -179,12 +179,12 @@ l2d_nine_patch_build_geo(struct build_params* params) {
     indexCount = (patch->numXDivs+1) * (patch->numYDivs+1) * 2 * 3;
 
     struct geo_vert* v = sbadd(params->geoVerticies, vCount);
-    unsigned short* ind = sbadd(params->geoIndicies, indexCount);
+    vertex_index* ind = sbadd(params->geoIndicies, indexCount);
 
 
     // we use <= for YDivs, since the prebuild indices work for 3x2 and 3x1 too
     if (patch->numXDivs == 2 && patch->numYDivs <= 2) {
-        memcpy(ind, g3x3Indices, indexCount*sizeof(unsigned short));
+        memcpy(ind, g3x3Indices, indexCount*sizeof(vertex_index));
     } else {
         fillIndices(ind, patch->numXDivs + 1, patch->numYDivs + 1);
     }
@@ -2,13 +2,14 @@
 #define LIB2D_NINE_PATCH_H
 
 #include <stdint.h>
+#include "renderer.h"
 
 struct l2d_nine_patch;
 struct geo_vert;
 struct build_params {
     struct l2d_image* image;
     struct geo_vert* geoVerticies;
-    unsigned short* geoIndicies;
+    vertex_index* geoIndicies;
     float bounds_width;
     float bounds_height;
 };
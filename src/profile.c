@@ -0,0 +1,231 @@
+#define _POSIX_C_SOURCE 200809L
+#include "profile.h"
+#include "lib2d.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+
+uint64_t
+profile_now_ns(void) {
+    static LARGE_INTEGER frequency;
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart/frequency.QuadPart)*1000000000ull
+        + (uint64_t)(now.QuadPart%frequency.QuadPart)*1000000000ull
+            /frequency.QuadPart;
+}
+#else
+#include <time.h>
+
+uint64_t
+profile_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+#endif
+
+static l2d_profile_cb callback;
+static void* callback_userdata;
+
+#ifdef PROFILE_ZONES
+
+#define MAX_THREADS 32
+#define RING_SIZE 16384 // zones kept per thread, a power of two
+
+struct zone {
+    const char* name;
+    uint64_t start, end;
+};
+
+// Only its own thread writes to a ring. `head` counts the zones ever
+// written and is published after the zone, so a reader sees whole zones.
+struct ring {
+    struct zone zones[RING_SIZE];
+    unsigned long head;
+};
+
+// Thread locals and the few atomics the rings need.
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+
+static
+int
+claim_thread(int* count) {
+    return InterlockedIncrement((volatile LONG*)count) - 1;
+}
+
+static
+void
+store_release(void* volatile* p, void* value) {
+    MemoryBarrier();
+    *p = value;
+}
+
+static
+void*
+load_acquire(void* volatile* p) {
+    void* value = *p;
+    MemoryBarrier();
+    return value;
+}
+
+static
+void
+store_head(struct ring* r, unsigned long head) {
+    MemoryBarrier();
+    *(volatile unsigned long*)&r->head = head;
+}
+
+static
+unsigned long
+load_head(struct ring* r) {
+    unsigned long head = *(volatile unsigned long*)&r->head;
+    MemoryBarrier();
+    return head;
+}
+
+// Like load_head, but also keeps the reads before it from moving after.
+static
+unsigned long
+reload_head(struct ring* r) {
+    MemoryBarrier();
+    return *(volatile unsigned long*)&r->head;
+}
+#else
+#define THREAD_LOCAL __thread
+
+static
+int
+claim_thread(int* count) {
+    return __atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
+}
+
+static
+void
+store_release(void* volatile* p, void* value) {
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+static
+void*
+load_acquire(void* volatile* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static
+void
+store_head(struct ring* r, unsigned long head) {
+    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+}
+
+static
+unsigned long
+load_head(struct ring* r) {
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+// Like load_head, but also keeps the reads before it from moving after.
+static
+unsigned long
+reload_head(struct ring* r) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+}
+#endif
+
+static void* volatile rings[MAX_THREADS]; // struct ring*
+static int ring_count;
+static THREAD_LOCAL struct ring* own_ring;
+static THREAD_LOCAL int own_thread = -1; // -2 once out of rings
+
+static
+struct ring*
+get_ring(void) {
+    if (own_thread == -1) {
+        int i = claim_thread(&ring_count);
+        if (i >= MAX_THREADS) {
+            own_thread = -2;
+            return NULL;
+        }
+        own_ring = calloc(1, sizeof(struct ring));
+        own_thread = i;
+        store_release(&rings[i], own_ring);
+    }
+    return own_ring;
+}
+
+void
+profile_record(const char* zone, uint64_t start) {
+    uint64_t end = profile_now_ns();
+    struct ring* r = get_ring();
+    l2d_profile_cb cb = callback;
+    if (cb)
+        cb(callback_userdata, zone, start, end, own_thread);
+    if (!r)
+        return;
+
+    unsigned long head = r->head;
+    struct zone* z = &r->zones[head & (RING_SIZE-1)];
+    z->name = zone;
+    z->start = start;
+    z->end = end;
+    store_head(r, head+1);
+}
+
+#endif
+
+L2D_EXPORTED
+void
+l2d_profile_set_callback(l2d_profile_cb cb, void* userdata) {
+    callback_userdata = userdata;
+    callback = cb;
+}
+
+L2D_EXPORTED
+bool
+l2d_profile_write_trace(const char* path) {
+#ifdef PROFILE_ZONES
+    FILE* f = fopen(path, "w");
+    if (!f)
+        return false;
+
+    // Threads keep recording while their rings are copied out, so zones
+    // are only kept if the ring's head shows they weren't written over.
+    struct zone* copy = malloc(sizeof(struct zone)*RING_SIZE);
+    fprintf(f, "{\"traceEvents\":[");
+    bool first = true;
+    for (int i=0; i<MAX_THREADS; i++) {
+        struct ring* r = load_acquire(&rings[i]);
+        if (!r)
+            continue;
+        unsigned long head = load_head(r);
+        unsigned long tail = head > RING_SIZE ? head - RING_SIZE : 0;
+        for (unsigned long j=tail; j<head; j++) {
+            copy[j & (RING_SIZE-1)] = r->zones[j & (RING_SIZE-1)];
+        }
+        // The zone at the new head may be half written too.
+        unsigned long newHead = reload_head(r);
+        if (newHead + 1 > tail + RING_SIZE)
+            tail = newHead + 1 - RING_SIZE;
+        for (unsigned long j=tail; j<head; j++) {
+            struct zone* z = &copy[j & (RING_SIZE-1)];
+            // Timestamps are in microseconds.
+            fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,"
+                    "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    first ? "" : ",", z->name, i,
+                    z->start/1000.0, (z->end - z->start)/1000.0);
+            first = false;
+        }
+    }
+    free(copy);
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0;
+#else
+    return false;
+#endif
+}
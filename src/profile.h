@@ -0,0 +1,31 @@
+#ifndef __LIB2D_PROFILE__
+#define __LIB2D_PROFILE__
+
+#include <stdint.h>
+
+/**
+ * Monotonic time in nanoseconds, for measuring how long parts of a frame
+ * take. Only differences between two calls mean anything.
+ */
+uint64_t
+profile_now_ns(void);
+
+/**
+ * Timing zones. PROFILE_BEGIN(zone) starts timing in the current scope,
+ * PROFILE_END(zone) records it under the name `zone`, so every path out of
+ * the scope must end it. Both compile to nothing unless lib2d is built with
+ * PROFILE_ZONES, see l2d_profile_write_trace.
+ */
+#ifdef PROFILE_ZONES
+#define PROFILE_BEGIN(zone) const uint64_t profile_##zone = profile_now_ns()
+#define PROFILE_END(zone) profile_record(#zone, profile_##zone)
+#else
+#define PROFILE_BEGIN(zone)
+#define PROFILE_END(zone)
+#endif
+
+// Records a zone from `start` to now on the calling thread.
+void
+profile_record(const char* zone, uint64_t start);
+
+#endif
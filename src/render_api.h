@@ -9,10 +9,24 @@
 #define SHADER_EXTERNAL_IMAGE (1 << 0)
 #define SHADER_MASK (1 << 1)
 #define SHADER_DESATURATE (1 << 2)
+#define SHADER_INSTANCED (1 << 3)
+// The main texture or the mask is a TEXTURE_2D_ARRAY. The main texture's
+// layer comes with each vertex, the mask's from shader_handles.maskLayer.
+#define SHADER_TEXTURE_ARRAY (1 << 4)
+#define SHADER_MASK_ARRAY (1 << 5)
+// The main texture is picked per vertex from up to MAX_BATCH_TEXTURES
+// TEXTURE_2D textures bound to shader_handles.batchTextures.
+#define SHADER_MULTI_TEXTURE (1 << 6)
+
+#define MAX_BATCH_TEXTURES 8
 
 #define SHADER_VARIANT_COUNT ((SHADER_EXTERNAL_IMAGE \
             | SHADER_MASK \
             | SHADER_DESATURATE \
+            | SHADER_INSTANCED \
+            | SHADER_TEXTURE_ARRAY \
+            | SHADER_MASK_ARRAY \
+            | SHADER_MULTI_TEXTURE \
             )+ 1)
 
 struct shader;
@@ -32,9 +46,22 @@ struct shader_handles {
     int32_t maskTexture;
     int32_t maskTextureCoordMat;
     int32_t eyePos;
+    int32_t maskLayer;
+    int32_t depth; // clip space z of the batch, see render_api_set_depth
+    // SHADER_INSTANCED only
+    int32_t cornerAttrib;
+    int32_t instanceXAttrib;
+    int32_t instanceYAttrib;
+    int32_t instanceWAttrib;
+    int32_t texRegionAttrib;
+    // SHADER_MULTI_TEXTURE only, [0] is textureHandle
+    int32_t batchTextures[MAX_BATCH_TEXTURES];
 };
 
+// Backends only make handles for the variants a material or shader is
+// actually used with, in render_api_material_use.
 struct material_handles {
+    unsigned int variant;
     bool invalid;
     int32_t* imageUniforms;
     int32_t* podUniforms;
@@ -58,6 +85,7 @@ struct material_image_uniform {
 enum texture_type {
     TEXTURE_2D,
     TEXTURE_EXTERNAL_OES,
+    TEXTURE_2D_ARRAY,
 };
 
 uint32_t
@@ -73,8 +101,13 @@ render_api_texture_bind(enum texture_type, uint32_t native_ptr,
 
 
 struct render_api_upload_info {
-    void* data;
+    void* data; // layers are consecutive images
     int width, height;
+    int layers; // 0 unless texture_type is TEXTURE_2D_ARRAY
+    // Only replace the top left width*height of `layer` in the already
+    // allocated array, data being that one image.
+    bool update_layer;
+    int layer;
     enum texture_type texture_type;
     enum l2d_image_format format;
     uint32_t native_ptr;
@@ -87,16 +120,74 @@ render_api_texture_upload(struct render_api_upload_info*);
 void
 render_api_get_viewport(int[4]);
 
+uint32_t
+render_api_framebuffer_new(void);
+
+// Attaches the texture as the color buffer of the framebuffer. Returns false
+// if the texture hasn't been created yet.
+bool
+render_api_framebuffer_attach(uint32_t fbo, uint32_t texture_native_ptr);
+
+// Whether render_api_draw_batch can take batches of struct instance.
+bool
+render_api_supports_instancing(void);
+
+// Whether TEXTURE_2D_ARRAY textures can be created and drawn from.
+bool
+render_api_supports_texture_arrays(void);
+
+// How many layers a TEXTURE_2D_ARRAY texture may have.
+int
+render_api_max_texture_layers(void);
+
+// How many textures a SHADER_MULTI_TEXTURE batch may use, at most
+// MAX_BATCH_TEXTURES. 1 if the variant isn't supported.
+int
+render_api_max_batch_textures(void);
+
+// Draws batch->instanceCount quads if it is nonzero, the indexed verticies
+// otherwise. Instanced batches use a SHADER_INSTANCED variant.
 void
 render_api_draw_batch(struct batch*, struct shader_handles*, struct
         material*, struct material_handles*, enum l2d_blend);
 
+void
+render_api_set_float(int32_t handle, float x);
+
 void
 render_api_set_vec(int32_t handle, float x, float y, float z, float w);
 
+// Column major, like struct matrix.
+void
+render_api_set_matrix(int32_t handle, float const m[16]);
+
 void
 render_api_draw_start(int fbo_target, int viewport_w, int viewport_h);
 
+enum render_api_depth {
+    DEPTH_OFF,
+    DEPTH_WRITE, // pass if nearer than what is there, and write
+    DEPTH_TEST, // pass if not farther than what is there, don't write
+};
+
+// Whether the framebuffer of the current pass has a depth buffer.
+bool
+render_api_has_depth(void);
+
+// Clears the current pass' depth buffer to the far plane.
+void
+render_api_clear_depth(void);
+
+// Applies to the following draws until the next render_api_draw_start, which
+// turns depth testing off. Their depth comes from shader_handles.depth.
+void
+render_api_set_depth(enum render_api_depth);
+
+// Called once all targets and the main viewport have been drawn. Backends
+// that queue work must have finished it when this returns.
+void
+render_api_draw_end(void);
+
 enum shader_type {
     SHADER_DEFAULT,
     SHADER_PREMULT,
@@ -109,6 +200,10 @@ render_api_load_shader(enum shader_type);
 struct material*
 render_api_material_new(struct shader*, struct l2d_effect_stage*);
 
+// Sequential id, handy for sort keys.
+int
+render_api_material_get_id(struct material*);
+
 /*
 void
 material_set_image(struct material* material,
@@ -134,4 +229,30 @@ render_api_clear(uint32_t color);
 void
 render_api_clear_f(float*);
 
+// Running totals of the work handed to the backend. Every backend keeps
+// these so CPU-side profiling can see what a frame would have cost the GPU.
+struct render_api_counters {
+    unsigned long draw_calls;
+    unsigned long vertices;
+    unsigned long indices;
+    unsigned long vertex_bytes;
+    unsigned long index_bytes;
+    unsigned long texture_uploads;
+    unsigned long texture_bytes;
+    unsigned long programs_compiled;
+    // Program, texture, uniform, blend, buffer and vertex attribute state
+    // calls made, and the ones skipped because the state was already set.
+    unsigned long state_calls;
+    unsigned long state_calls_elided;
+    // Pixels the depth test kept from being shaded, on backends that can
+    // tell. GL can't without reading results back, it leaves this at 0.
+    unsigned long depth_rejected_pixels;
+};
+
+void
+render_api_get_counters(struct render_api_counters*);
+
+void
+render_api_reset_counters(void);
+
 #endif
@@ -6,12 +6,20 @@
 #include "render_api.h"
 #include "effect.h"
 #include "target.h"
+#include "job.h"
+#include "grid.h"
+#include "profile.h"
 
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #ifndef WIN32
 #include <alloca.h>
@@ -21,9 +29,16 @@
 #endif
 #endif
 
-// TODO don't hard code something here.
-#define MAX_VERTICIES 1024
-
+#if defined(__SANITIZE_ADDRESS__)
+#define ASAN_ENABLED
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define ASAN_ENABLED
+#endif
+#endif
+#ifdef ASAN_ENABLED
+#include <sanitizer/asan_interface.h>
+#endif
 
 struct l2d_drawer_attribute {
     l2d_ident name;
@@ -78,33 +93,188 @@ premult_site_to_matrix(struct matrix* m, struct site const* site) {
     matrix_translate_inplace(m, site->rect.l, site->rect.t, 0.f);
 }
 
+// What premult_site_to_matrix and transform() boil down to when the site
+// only rotates about z and w doesn't depend on x or y: a 2x3 affine per
+// output axis, already divided by w.
+struct affine {
+    float x[3]; // x' = x[0]*x + x[1]*y + x[2]
+    float y[3];
+    float z[3];
+};
+
+// Fills in `a` for drawing `site` under `projection`, or returns false if
+// the generic 4x4 path is needed.
+static
+bool
+site_to_affine(struct affine* a, struct matrix const* projection,
+        struct site const* site) {
+    struct quaternion const* q = &site->quaternion;
+    float const* p = projection->m;
+#define P(COLUMN, ROW) p[COLUMN*4+ROW]
+    if (q->x != 0.f || q->y != 0.f || P(0,3) != 0.f || P(1,3) != 0.f)
+        return false;
+
+    float tx = site_wrap(site->x, site->wrap);
+    float ty = site_wrap(site->y, site->wrap+2);
+    float tz = site->z;
+    float cos_z = 1.f, sin_z = 0.f;
+    if (q->w != 1.f) {
+        cos_z = 1.f - 2.f*q->z*q->z;
+        sin_z = 2.f*q->w*q->z;
+    }
+    float w = P(3,3) + P(2,3)*tz;
+    if (w == 0.f)
+        return false;
+
+    // Same steps as premult_site_to_matrix, for rows x, y and z only.
+    float scale[3] = {site->scale_x, site->scale_y, 1.f};
+    float* rows[3] = {a->x, a->y, a->z};
+    for (int r=0; r<3; r++) {
+        float c0 = P(0,r)*cos_z + P(1,r)*sin_z;
+        float c1 = P(1,r)*cos_z - P(0,r)*sin_z;
+        float c3 = P(3,r) + P(0,r)*tx + P(1,r)*ty + P(2,r)*tz;
+        c0 *= scale[r];
+        c1 *= scale[r];
+        c3 += c0*site->rect.l + c1*site->rect.t;
+        rows[r][0] = c0/w;
+        rows[r][1] = c1/w;
+        rows[r][2] = c3/w;
+    }
+#undef P
+    return true;
+}
+
 struct l2d_drawer {
     struct ir* ir;
-    struct l2d_drawer* next;
-    struct l2d_drawer** prev;
-    struct site site;
+    int listIndex; // in the screen's or its target's drawers
+    int slot; // in its slab, see drawer_slab
+    bool live; // false once deleted, see DRAWER_CHECK
     struct l2d_image* image[2];
     struct l2d_effect* effect;
-    float alpha;
-    float desaturate;
-    float color[4];
     struct material* material;
     struct l2d_target* target;
     int order;
     enum l2d_blend blend;
 
     struct geo_vert* geoVerticies; // stretchy buffer
-    unsigned short* geoIndicies;
+    vertex_index* geoIndicies;
+    // What the geometry was built from if it is a nine patch's, NULL
+    // ninePatch otherwise. See drawer_prepare.
+    struct l2d_image* ninePatchImage;
+    struct l2d_nine_patch* ninePatch;
+    float ninePatchWidth, ninePatchHeight;
 
     struct l2d_drawer_attribute* attributes; // stretchy buffer
+    // Index in attributes of each of attributeMaterial's attributes, or -1.
+    // See drawer_attribute_slots.
+    struct material* attributeMaterial;
+    int* attributeSlots; // stretchy
 
     struct l2d_drawer_mask* mask;
 
     struct site clip_site;
     bool clip_site_set;
+
+    // Output of the last batch_add, replayed until one of its inputs
+    // changes. The indicies are relative to the first cached vertex.
+    struct vertex* cachedVerticies; // stretchy buffer
+    vertex_index* cachedIndicies; // stretchy buffer
+    struct instance cachedInstance;
+    struct matrix cachedProjection;
+    struct rect cachedTextureRegion;
+    int cachedTextureLayer;
+    int cachedBatchTexture;
+    bool cacheInstanced;
+    bool cacheDirty;
+
+    // Everything drawDrawerList sorts by except the texture, which can
+    // change under the drawer when its image loads. See drawer_sort_key.
+    uint64_t sort_key;
+    uint32_t sort_seq; // creation order, breaks ties
+    bool sort_changed; // queued in its sort cache's changed list
+
+    bool hidden;
+    // Bounds in the z = 0 plane before projection, for culling. Recomputed
+    // lazily after the site or geometry change. Not valid for drawers that
+    // leave that plane.
+    struct rect bounds;
+    bool boundsValid;
+    bool boundsDirty;
+    struct grid_item gridItem;
+    int gridMovedIndex; // in ir->gridMoved, or -1
+
+    // Index of image[0] in the texture table of the batch the drawer is
+    // being added to. See batch_state.
+    int batchTexture;
+    // Runs of opaque drawers before it in this frame's draw order, which
+    // decides its depth. See drawDrawerList.
+    int depthLevel;
 };
 
+// Drawers are allocated this many at a time.
+#define DRAWER_SLAB_SIZE 128
+
+// The transform and color of drawers[i] are kept apart from it in the
+// parallel arrays, so culling and vertex generation read them one after the
+// other instead of pulling whole drawers through the cache. Slabs hand out
+// their drawers in order, so drawers that sort by creation order are read
+// front to back.
+struct drawer_slab {
+    struct l2d_drawer drawers[DRAWER_SLAB_SIZE];
+    struct site site[DRAWER_SLAB_SIZE];
+    float color[DRAWER_SLAB_SIZE][4];
+    float alpha[DRAWER_SLAB_SIZE];
+    float desaturate[DRAWER_SLAB_SIZE];
+};
+
+// Slots of deleted drawers are reused, so a stale pointer would quietly
+// change whichever drawer took its place. The public l2d_drawer_* functions
+// assert that they got a live one; slots are reused oldest first to keep
+// that working for as long as possible. With AddressSanitizer the free
+// slots are poisoned too, so any use of a stale pointer is reported.
+#define DRAWER_CHECK(d) assert((d)->live)
+#ifdef ASAN_ENABLED
+#define DRAWER_POISON(d) \
+    ASAN_POISON_MEMORY_REGION((d), sizeof(struct l2d_drawer))
+#define DRAWER_UNPOISON(d) \
+    ASAN_UNPOISON_MEMORY_REGION((d), sizeof(struct l2d_drawer))
+#else
+#define DRAWER_POISON(d) ((void)(d))
+#define DRAWER_UNPOISON(d) ((void)(d))
+#endif
+
+static inline
+struct drawer_slab*
+drawer_slab(struct l2d_drawer const* d) {
+    return (struct drawer_slab*)(d - d->slot);
+}
+
+static inline
+struct site*
+drawer_site(struct l2d_drawer const* d) {
+    return &drawer_slab(d)->site[d->slot];
+}
+
+static inline
+float*
+drawer_color(struct l2d_drawer const* d) {
+    return drawer_slab(d)->color[d->slot];
+}
+
+static inline
+float*
+drawer_alpha(struct l2d_drawer const* d) {
+    return &drawer_slab(d)->alpha[d->slot];
+}
+
+static inline
+float*
+drawer_desaturate(struct l2d_drawer const* d) {
+    return &drawer_slab(d)->desaturate[d->slot];
+}
+
 struct l2d_drawer_mask {
+    int id;
     struct ir* ir;
     struct l2d_drawer_mask* next;
     struct l2d_drawer_mask** prev;
@@ -119,24 +289,146 @@ struct mat_cache_entry {
     struct material* material;
 };
 
+static
+void
+i_drawer_invalidate(struct l2d_drawer* drawer) {
+    drawer->cacheDirty = true;
+    drawer->ir->changed = true;
+}
+
+// Queues the drawer to be moved in the spatial index before the next frame.
+static
+void
+i_drawer_grid_moved(struct l2d_drawer* drawer) {
+    struct ir* ir = drawer->ir;
+    if (!ir->grid || drawer->target || drawer->gridMovedIndex >= 0)
+        return;
+    drawer->gridMovedIndex = sbcount(ir->gridMoved);
+    sbpush(ir->gridMoved, drawer);
+}
+
+static
+void
+i_drawer_grid_remove(struct l2d_drawer* drawer) {
+    struct ir* ir = drawer->ir;
+    if (drawer->gridMovedIndex >= 0) {
+        struct l2d_drawer* last = sblast(ir->gridMoved);
+        ir->gridMoved[drawer->gridMovedIndex] = last;
+        last->gridMovedIndex = drawer->gridMovedIndex;
+        sbremovelast(ir->gridMoved);
+        drawer->gridMovedIndex = -1;
+    }
+    if (ir->grid)
+        grid_remove(ir->grid, &drawer->gridItem);
+}
+
+static
+void
+i_drawer_bounds_changed(struct l2d_drawer* drawer) {
+    drawer->ir->changed = true;
+    drawer->boundsDirty = true;
+    i_drawer_grid_moved(drawer);
+}
+
+// Sort key layout, most significant first: order (32 bits, biased so
+// negative orders sort first), texture (14), material (10), mask (6) and
+// blend (2). Ids that collide only cost an extra batch; the draw loop
+// compares the real values.
+#define SORT_KEY_TEXTURE_SHIFT 18
+#define SORT_KEY_TEXTURE_MASK 0x3fff
+
+// Past this fraction of changed drawers a full sort is cheaper than
+// merging them back in.
+#define SORT_CHANGED_MAX_FRACTION 8
+
+static
+struct sort_cache*
+drawer_sort_cache(struct l2d_drawer* drawer) {
+    return drawer->target ? &drawer->target->sort_cache
+        : &drawer->ir->sort_cache;
+}
+
+static
+struct l2d_drawer***
+drawer_list(struct l2d_drawer* drawer) {
+    return drawer->target ? &drawer->target->drawers : &drawer->ir->drawers;
+}
+
+static
+void
+drawer_list_add(struct l2d_drawer* drawer) {
+    struct l2d_drawer*** list = drawer_list(drawer);
+    drawer->listIndex = sbcount(*list);
+    sbpush(*list, drawer);
+}
+
+// Moves the last drawer into the drawer's place, lists aren't in any order.
+static
+void
+drawer_list_remove(struct l2d_drawer* drawer) {
+    struct l2d_drawer** list = *drawer_list(drawer);
+    struct l2d_drawer* last = sblast(list);
+    list[drawer->listIndex] = last;
+    last->listIndex = drawer->listIndex;
+    sbremovelast(list);
+}
+
+// Queues the drawer to be moved to its new place in the sorted order.
+static
+void
+i_drawer_sort_changed(struct l2d_drawer* drawer) {
+    drawer->ir->changed = true;
+    struct sort_cache* c = drawer_sort_cache(drawer);
+    if (c->sort_buffer_dirty || c->sort_order_dirty || drawer->sort_changed)
+        return;
+    if ((sbcount(c->changed)+1)*SORT_CHANGED_MAX_FRACTION > c->drawer_count) {
+        c->sort_order_dirty = true;
+        return;
+    }
+    drawer->sort_changed = true;
+    sbpush(c->changed, drawer);
+}
+
+static
+void
+i_drawer_update_sort_key(struct l2d_drawer* drawer) {
+    uint64_t order = (uint32_t)drawer->order ^ 0x80000000u;
+    uint64_t material = render_api_material_get_id(drawer->material) & 0x3ff;
+    uint64_t mask = drawer->mask ? (drawer->mask->id & 0x3f) : 0;
+    drawer->sort_key = order << 32 | material << 8 | mask << 2
+        | ((uint64_t)drawer->blend & 0x3);
+    i_drawer_sort_changed(drawer);
+}
+
+static
+uint64_t
+drawer_sort_key(struct l2d_drawer* drawer) {
+    uint64_t texture = ib_image_texture_id(drawer->image[0])
+        & SORT_KEY_TEXTURE_MASK;
+    return drawer->sort_key | texture << SORT_KEY_TEXTURE_SHIFT;
+}
+
 static
 void
 i_drawer_set_image(struct l2d_drawer* drawer, struct l2d_image* image, int k) {
     if (image == drawer->image[k]) return;
+    i_drawer_invalidate(drawer);
+    i_drawer_bounds_changed(drawer); // might have gained or lost a nine patch
     if (drawer->image[k])
         ib_image_decref(drawer->image[k]);
     drawer->image[k] = image;
     if (drawer->image[k])
         ib_image_incref(drawer->image[k]);
 
-    if (!drawer->image[k] || !ib_image_same_texture(image, drawer->image[k]))
-        drawer->ir->sort_cache.sort_order_dirty = true;
+    if (k == 0)
+        i_drawer_sort_changed(drawer);
 }
 
 
 static void l2d_drawer_update_material(struct l2d_drawer*);
 void
 l2d_drawer_set_image(struct l2d_drawer* drawer, struct l2d_image* image) {
+    DRAWER_CHECK(drawer);
     if (image == drawer->image[0]) return;
     i_drawer_set_image(drawer, image, 0);
     // TODO second image? clear effect?
@@ -151,6 +443,7 @@ l2d_drawer_resolve_stage_dep(struct l2d_drawer* drawer, struct ir* ir,
         struct l2d_effect_stage* for_stage,
         struct l2d_image* source_im,
         struct l2d_image** built_stages) {
+    DRAWER_CHECK(drawer);
 
     int w = ib_image_get_width(source_im);
     int h = ib_image_get_height(source_im);
@@ -170,11 +463,11 @@ l2d_drawer_resolve_stage_dep(struct l2d_drawer* drawer, struct ir* ir,
                 // TODO save targets so they can be cleaned up!!
                 struct l2d_target* t = l2d_target_new(ir, w, h, 0);
                 struct l2d_drawer* d = l2d_drawer_new(ir);
-                d->site.rect.r = w;
-                d->site.rect.t = h;
+                drawer_site(d)->rect.r = w;
+                drawer_site(d)->rect.t = h;
                 l2d_drawer_set_target(d, t);
-                d->material = render_api_material_new(
-                    render_api_load_shader(SHADER_DEFAULT), s);
+                l2d_drawer_setMaterial(d, render_api_material_new(
+                    render_api_load_shader(SHADER_DEFAULT), s));
                 // Need t->image to have it's texture created as a render target.
                 i_prepair_targets_before_texture(ir);
                 im = t->image;
@@ -189,7 +482,7 @@ l2d_drawer_resolve_stage_dep(struct l2d_drawer* drawer, struct ir* ir,
 
 static
 void
-l2d_drawer_update_material(struct l2d_drawer* d) {
+i_drawer_pick_material(struct l2d_drawer* d) {
     struct l2d_image* im = d->image[0];
     if (d->effect == NULL) {
         if (ib_image_format(im) == l2d_IMAGE_FORMAT_A_8) {
@@ -236,14 +529,31 @@ l2d_drawer_update_material(struct l2d_drawer* d) {
     }
 }
 
+static
+void
+l2d_drawer_update_material(struct l2d_drawer* d) {
+    DRAWER_CHECK(d);
+    i_drawer_pick_material(d);
+    i_drawer_update_sort_key(d);
+}
+
 struct ir*
 ir_new(struct l2d_image_bank* ib) {
     struct ir* ir = (struct ir*)malloc(sizeof(struct ir));
 
     ir->ib = ib;
     ir->targetList = NULL;
-    ir->drawerList = NULL;
+    ir->drawers = NULL;
+    ir->drawerSlabs = NULL;
+    ir->freeDrawers = NULL;
+    ir->freeDrawersHead = 0;
     init_sort_cache(&ir->sort_cache);
+    ir->grid = NULL;
+    ir->gridMoved = NULL;
+    ir->gridQuery = NULL;
+    ir->changed = true;
+    memset(&ir->retained, 0, sizeof(ir->retained));
+    memset(&ir->stats, 0, sizeof(ir->stats));
     ir->viewportWidth = 1;
     ir->viewportHeight = 1;
     ir->translate[0] = 0;
@@ -260,7 +570,10 @@ ir_new(struct l2d_image_bank* ib) {
 
     ir->scratchVerticies = NULL;
     ir->scratchIndicies = NULL;
+    ir->scratchInstances = NULL;
     ir->scratchAttributes = NULL;
+    ir->scratchAttributeData = NULL;
+    ir->scratchSlots = NULL;
 
     ir->maskList = NULL;
 
@@ -276,88 +589,202 @@ void
 init_sort_cache(struct sort_cache* c){ 
     c->sort_buffer_dirty = false;
     c->sort_order_dirty = false;
-    c->buffer = NULL;
+    c->entries = NULL;
+    c->changed = NULL;
+    c->changed_entries = NULL;
+    c->opaque = NULL;
+    c->scratch = NULL;
     c->alloc_size = 0;
     c->drawer_count = 0;
 }
 
+static
+void
+drawer_free_buffers(struct l2d_drawer* drawer) {
+    sbfree(drawer->geoVerticies);
+    sbfree(drawer->geoIndicies);
+    sbfree(drawer->attributes);
+    sbfree(drawer->attributeSlots);
+    sbfree(drawer->cachedVerticies);
+    sbfree(drawer->cachedIndicies);
+}
+
 void
 ir_delete(struct ir* ir) {
-    while (ir->drawerList != NULL) {
-        l2d_drawer_delete(ir->drawerList);
+    while (sbcount(ir->drawers)) {
+        l2d_drawer_delete(sblast(ir->drawers));
     }
-
-    if (ir->sort_cache.buffer)
-        free(ir->sort_cache.buffer);
+    sbfree(ir->drawers);
+    // Deleted drawers keep their buffers for the next one in their place.
+    for (int i=0; i<sbcount(ir->drawerSlabs); i++) {
+        struct drawer_slab* slab = ir->drawerSlabs[i];
+        for (int j=0; j<DRAWER_SLAB_SIZE; j++) {
+            DRAWER_UNPOISON(&slab->drawers[j]);
+            drawer_free_buffers(&slab->drawers[j]);
+        }
+        free(slab);
+    }
+    sbfree(ir->drawerSlabs);
+    sbfree(ir->freeDrawers);
+
+    free(ir->sort_cache.entries);
+    free(ir->sort_cache.scratch);
+    sbfree(ir->sort_cache.changed);
+    sbfree(ir->sort_cache.changed_entries);
+    sbfree(ir->sort_cache.opaque);
+    if (ir->grid)
+        grid_delete(ir->grid);
+    sbfree(ir->gridMoved);
+    sbfree(ir->gridQuery);
+    sbfree(ir->retained.commands);
+    sbfree(ir->retained.verticies);
+    sbfree(ir->retained.indicies);
+    sbfree(ir->retained.instances);
 
     // TODO delete all created shaders.
     // TODO delete all cached materials.
 
     sbfree(ir->scratchVerticies);
     sbfree(ir->scratchIndicies);
-    // TODO clean up scratchAttributes
+    sbfree(ir->scratchInstances);
+    sbfree(ir->scratchSlots);
+    sbfree(ir->scratchAttributes);
+    sbfree(ir->scratchAttributeData);
 
     free(ir);
 }
 
+void
+ir_set_spatial_index(struct ir* ir, float cell_size) {
+    for (int i=0; i<sbcount(ir->gridMoved); i++) {
+        ir->gridMoved[i]->gridMovedIndex = -1;
+    }
+    sbempty(ir->gridMoved);
+    if (ir->grid) {
+        grid_delete(ir->grid);
+        ir->grid = NULL;
+    }
+    // The grid path sorts the visible set from scratch, the incremental
+    // state has to be rebuilt either way.
+    ir->sort_cache.sort_buffer_dirty = true;
+
+    for (int i=0; i<sbcount(ir->drawers); i++) {
+        grid_item_init(&ir->drawers[i]->gridItem, ir->drawers[i]);
+    }
+    if (cell_size <= 0.f)
+        return;
+    ir->grid = grid_new(cell_size);
+    for (int i=0; i<sbcount(ir->drawers); i++) {
+        i_drawer_grid_moved(ir->drawers[i]);
+    }
+}
+
+// Takes the drawer that has been free the longest, a new slab refills the
+// free queue once it runs out. Drawers never move, and creating one doesn't
+// allocate once there are enough slabs.
+static
+struct l2d_drawer*
+drawer_alloc(struct ir* ir) {
+    if (ir->freeDrawersHead == sbcount(ir->freeDrawers)) {
+        sbempty(ir->freeDrawers);
+        ir->freeDrawersHead = 0;
+        struct drawer_slab* slab = calloc(1, sizeof(struct drawer_slab));
+        sbpush(ir->drawerSlabs, slab);
+        for (int i=0; i<DRAWER_SLAB_SIZE; i++) {
+            slab->drawers[i].slot = i;
+            DRAWER_POISON(&slab->drawers[i]);
+            sbpush(ir->freeDrawers, &slab->drawers[i]);
+        }
+    }
+    struct l2d_drawer* drawer = ir->freeDrawers[ir->freeDrawersHead++];
+    // Drop the taken part of the queue once it is most of it.
+    if (ir->freeDrawersHead >= DRAWER_SLAB_SIZE
+            && ir->freeDrawersHead*2 >= sbcount(ir->freeDrawers)) {
+        sbremove(ir->freeDrawers, 0, ir->freeDrawersHead);
+        ir->freeDrawersHead = 0;
+    }
+    DRAWER_UNPOISON(drawer);
+    drawer->live = true;
+    return drawer;
+}
+
 struct l2d_drawer*
 l2d_drawer_new(struct ir* ir) {
+    static uint32_t next_seq = 0;
     ir->sort_cache.sort_buffer_dirty = true;
-    struct l2d_drawer* drawer =
-        (struct l2d_drawer*)malloc(sizeof(struct l2d_drawer));
+    struct l2d_drawer* drawer = drawer_alloc(ir);
     drawer->ir = ir;
-    drawer->next = ir->drawerList;
-    if (ir->drawerList) {
-        ir->drawerList->prev = &drawer->next;
-    }
-    ir->drawerList = drawer;
-    drawer->prev = & ir->drawerList;
 
     drawer->image[0] = NULL;
     drawer->image[1] = NULL;
     drawer->effect = NULL;
 
-    site_init(&drawer->site);
+    site_init(drawer_site(drawer));
 
-    drawer->alpha = 1.f;
-    drawer->desaturate = 0.f;
-    drawer->color[0] = 1;
-    drawer->color[1] = 1;
-    drawer->color[2] = 1;
-    drawer->color[3] = 1;
+    *drawer_alpha(drawer) = 1.f;
+    *drawer_desaturate(drawer) = 0.f;
+    float* color = drawer_color(drawer);
+    color[0] = 1;
+    color[1] = 1;
+    color[2] = 1;
+    color[3] = 1;
 
     drawer->material = ir->defaultMaterial;
     drawer->target = NULL;
+    drawer_list_add(drawer);
 
     drawer->order = 0;
 
     drawer->blend = l2d_BLEND_DEFAULT;
 
-    drawer->geoVerticies = NULL;
-    drawer->geoIndicies = NULL;
-    drawer->attributes = NULL;
+    sbempty(drawer->geoVerticies);
+    sbempty(drawer->geoIndicies);
+    drawer->ninePatch = NULL;
+    sbempty(drawer->attributes);
+    drawer->attributeMaterial = NULL;
 
     drawer->mask = NULL;
 
     drawer->clip_site_set = false;
 
+    sbempty(drawer->cachedVerticies);
+    sbempty(drawer->cachedIndicies);
+    drawer->cacheInstanced = false;
+    drawer->cacheDirty = true;
+    drawer->batchTexture = 0;
+    drawer->depthLevel = 0;
+
+    drawer->hidden = false;
+    drawer->boundsDirty = true;
+    grid_item_init(&drawer->gridItem, drawer);
+    drawer->gridMovedIndex = -1;
+    i_drawer_grid_moved(drawer);
+
+    drawer->sort_seq = next_seq++;
+    drawer->sort_changed = false;
+    i_drawer_update_sort_key(drawer);
+
     return drawer;
 }
 
 void
 l2d_drawer_delete(struct l2d_drawer* drawer) {
-    drawer->ir->sort_cache.sort_buffer_dirty = true;
-    *drawer->prev = drawer->next;
-    if (drawer->next) {
-        drawer->next->prev = drawer->prev;
-    }
+    DRAWER_CHECK(drawer);
+    drawer->ir->changed = true;
+    drawer_sort_cache(drawer)->sort_buffer_dirty = true;
+    i_drawer_grid_remove(drawer);
+    drawer_list_remove(drawer);
     for (int k=0; k<2; k++) {
         if (drawer->image[k]) {
             ib_image_decref(drawer->image[k]);
         }
     }
-    free(drawer);
-    // TODO cleanup vertex data.
+    for (int i=0; i<sbcount(drawer->attributes); i++) {
+        sbfree(drawer->attributes[i].data);
+    }
+    drawer->live = false;
+    sbpush(drawer->ir->freeDrawers, drawer);
+    DRAWER_POISON(drawer);
 }
 
 struct geo_vert {
@@ -366,19 +793,24 @@ struct geo_vert {
 
 void
 l2d_drawer_copy(struct l2d_drawer* dst, struct l2d_drawer const* src) {
-    dst->ir->sort_cache.sort_order_dirty = true;
-    site_copy(&dst->site, &src->site);
+    DRAWER_CHECK(dst);
+    DRAWER_CHECK(src);
+    i_drawer_invalidate(dst);
+    i_drawer_bounds_changed(dst);
+    dst->hidden = src->hidden;
+    site_copy(drawer_site(dst), drawer_site(src));
     for (int k=0; k<2; k++) {
         dst->image[k] = src->image[k];
         if (dst->image[k])
             ib_image_incref(dst->image[k]);
     }
     dst->material = src->material;
-    dst->alpha = src->alpha;
-    dst->desaturate = src->desaturate;
-    dst->target = src->target;
+    *drawer_alpha(dst) = *drawer_alpha(src);
+    *drawer_desaturate(dst) = *drawer_desaturate(src);
+    l2d_drawer_set_target(dst, src->target);
     dst->order = src->order;
     dst->mask = src->mask;
+    i_drawer_update_sort_key(dst);
 
     l2d_drawer_clear_geo(dst);
 
@@ -399,8 +831,8 @@ l2d_drawer_copy(struct l2d_drawer* dst, struct l2d_drawer const* src) {
 
 void
 l2d_drawer_set_effect(struct l2d_drawer* d, struct l2d_effect* e) {
+    DRAWER_CHECK(d);
     if (e == d->effect) return;
-    d->ir->sort_cache.sort_order_dirty = true;
     l2d_effect_update_stages(e);
     d->effect = e;
     l2d_drawer_update_material(d);
@@ -409,8 +841,12 @@ l2d_drawer_set_effect(struct l2d_drawer* d, struct l2d_effect* e) {
 void
 l2d_drawer_add_geo_rect(struct l2d_drawer* d,
         struct rect pos, struct rect tex) {
+    DRAWER_CHECK(d);
+    i_drawer_invalidate(d);
+    i_drawer_bounds_changed(d);
+    d->ninePatch = NULL;
     int start = sbcount(d->geoVerticies);
-    if (start+4 > MAX_VERTICIES) {
+    if (start+4 > MAX_BATCH_VERTICIES) {
         assert(false);
         return;
     }
@@ -422,7 +858,7 @@ l2d_drawer_add_geo_rect(struct l2d_drawer* d,
     CORNER(r, b);
     CORNER(l, b);
 #undef CORNER
-    unsigned short* ind = sbadd(d->geoIndicies, 6);
+    vertex_index* ind = sbadd(d->geoIndicies, 6);
     int i = 0;
     ind[i++] = start+0;
     ind[i++] = start+1;
@@ -436,7 +872,15 @@ void
 l2d_drawer_add_geo_2d(struct l2d_drawer* d,
         struct vert_2d* verticies, unsigned int vert_count,
         unsigned int* indicies, unsigned int index_count) {
+    DRAWER_CHECK(d);
+    i_drawer_invalidate(d);
+    i_drawer_bounds_changed(d);
+    d->ninePatch = NULL;
     int start = sbcount(d->geoVerticies);
+    if (start+vert_count > MAX_BATCH_VERTICIES) {
+        assert(false);
+        return;
+    }
     struct geo_vert* v = sbadd(d->geoVerticies, vert_count);
     for (int i=0; i<vert_count; i++) {
         v[i].x = verticies[i].x;
@@ -444,9 +888,9 @@ l2d_drawer_add_geo_2d(struct l2d_drawer* d,
         v[i].u = verticies[i].u;
         v[i].v = verticies[i].v;
     }
-    unsigned short* ind = sbadd(d->geoIndicies, index_count);
+    vertex_index* ind = sbadd(d->geoIndicies, index_count);
     for (int i=0; i<index_count; i++) {
-        ind[i] = (unsigned short)(start + indicies[i]);
+        ind[i] = (vertex_index)(start + indicies[i]);
     }
 }
 
@@ -454,6 +898,8 @@ void
 l2d_drawer_add_geo_attribute(struct l2d_drawer* d,
         l2d_ident attribute,
         unsigned int size, float* verticies, unsigned int vert_count) {
+    DRAWER_CHECK(d);
+    d->ir->changed = true;
     struct l2d_drawer_attribute* a=NULL;
     // first, find an existing attribute with that name:
     for (int i=0; i<sbcount(d->attributes); i++) {
@@ -468,6 +914,7 @@ l2d_drawer_add_geo_attribute(struct l2d_drawer* d,
         a->name = attribute;
         a->size = size;
         a->data = NULL;
+        d->attributeMaterial = NULL;
     }
 
     int float_count = size*vert_count;
@@ -477,6 +924,10 @@ l2d_drawer_add_geo_attribute(struct l2d_drawer* d,
 
 void
 l2d_drawer_clear_geo(struct l2d_drawer* d) {
+    DRAWER_CHECK(d);
+    i_drawer_invalidate(d);
+    i_drawer_bounds_changed(d);
+    d->ninePatch = NULL;
     if (d->geoVerticies)
         sbremove(d->geoVerticies, 0, sbcount(d->geoVerticies));
     if (d->geoIndicies)
@@ -488,74 +939,82 @@ l2d_drawer_clear_geo(struct l2d_drawer* d) {
 
 void
 l2d_drawer_set_site(struct l2d_drawer* drawer, struct site const* site) {
-    site_copy(&drawer->site, site);
+    DRAWER_CHECK(drawer);
+    i_drawer_invalidate(drawer);
+    i_drawer_bounds_changed(drawer);
+    site_copy(drawer_site(drawer), site);
 }
 const struct site*
 l2d_drawer_get_site(struct l2d_drawer* drawer) {
-    return &drawer->site;
+    DRAWER_CHECK(drawer);
+    return drawer_site(drawer);
 }
 
 void
 l2d_drawer_set_desaturate(struct l2d_drawer* drawer, float desaturate) {
-    drawer->desaturate = desaturate;
+    DRAWER_CHECK(drawer);
+    i_drawer_invalidate(drawer);
+    *drawer_desaturate(drawer) = desaturate;
 }
 
 void
 l2d_drawer_set_color(struct l2d_drawer* drawer, float color[4]) {
-    drawer->color[0] = color[0];
-    drawer->color[1] = color[1];
-    drawer->color[2] = color[2];
-    drawer->color[3] = color[3];
+    DRAWER_CHECK(drawer);
+    i_drawer_invalidate(drawer);
+    memcpy(drawer_color(drawer), color, 4*sizeof(float));
 }
 
 
 void
 l2d_drawer_setMaterial(struct l2d_drawer* drawer,
         struct material* material) {
-    drawer->ir->sort_cache.sort_order_dirty = true;
+    DRAWER_CHECK(drawer);
+    i_drawer_invalidate(drawer);
     if (material == NULL) {
         material = drawer->ir->defaultMaterial;
     }
     drawer->material = material;
+    i_drawer_update_sort_key(drawer);
 }
 
 void
 l2d_drawer_set_target(struct l2d_drawer* drawer, struct l2d_target* target) {
+    DRAWER_CHECK(drawer);
     if (target == drawer->target) return;
+    drawer->ir->changed = true;
+    drawer_sort_cache(drawer)->sort_buffer_dirty = true;
+    drawer_list_remove(drawer);
     drawer->target = target;
+    drawer_sort_cache(drawer)->sort_buffer_dirty = true;
+    drawer_list_add(drawer);
 
-    drawer->ir->sort_cache.sort_buffer_dirty = true;
+    // Only the screen's drawers are indexed.
     if (target)
-        target->sort_cache.sort_buffer_dirty = true;
-
-    // unlink from old list:
-    if (drawer->next) {
-        drawer->next->prev = drawer->prev;
-    }
-    *drawer->prev = drawer->next;
-
-    struct l2d_drawer** drawerListP =
-        target ? &target->drawerList : &drawer->ir->drawerList;
+        i_drawer_grid_remove(drawer);
+    else
+        i_drawer_grid_moved(drawer);
+}
 
-    // add to new target:
-    drawer->next = *drawerListP;
-    if (drawer->next) {
-        drawer->next->prev = &drawer->next;
-    }
-    drawer->prev = drawerListP;
-    *drawerListP = drawer;
+void
+l2d_drawer_set_visible(struct l2d_drawer* drawer, bool visible) {
+    DRAWER_CHECK(drawer);
+    if (drawer->hidden != visible) return;
+    drawer->ir->changed = true;
+    drawer->hidden = !visible;
 }
 
 void
 l2d_drawer_setOrder(struct l2d_drawer* drawer, int order) {
-    drawer->ir->sort_cache.sort_order_dirty = true;
+    DRAWER_CHECK(drawer);
     drawer->order = order;
+    i_drawer_update_sort_key(drawer);
 }
 
 void
 l2d_drawer_set_clip_site(struct l2d_drawer* drawer,
         struct site const* site) {
-    drawer->ir->sort_cache.sort_order_dirty = true;
+    DRAWER_CHECK(drawer);
+    i_drawer_invalidate(drawer);
     if (site) {
         drawer->clip_site_set = true;
         site_copy(&drawer->clip_site, site);
@@ -566,21 +1025,24 @@ l2d_drawer_set_clip_site(struct l2d_drawer* drawer,
 
 void
 l2d_drawer_blend(struct l2d_drawer* drawer, enum l2d_blend blend) {
+    DRAWER_CHECK(drawer);
     if (blend == drawer->blend) return;
-    drawer->ir->sort_cache.sort_order_dirty = true;
     drawer->blend = blend;
     l2d_drawer_update_material(drawer);
 }
 
 void
 l2d_drawer_set_mask(struct l2d_drawer* drawer, struct l2d_drawer_mask* mask) {
-    drawer->ir->sort_cache.sort_order_dirty = true;
+    DRAWER_CHECK(drawer);
     drawer->mask = mask;
+    i_drawer_update_sort_key(drawer);
 }
 
 struct l2d_drawer_mask*
 l2d_drawer_mask_new(struct ir* ir) {
+    static int next_id = 1;
     struct l2d_drawer_mask* mask = malloc(sizeof(struct l2d_drawer_mask));
+    mask->id = next_id++;
     mask->ir = ir;
 
     mask->next = ir->maskList;
@@ -611,6 +1073,7 @@ void
 l2d_drawer_mask_set_image(struct l2d_drawer_mask* mask,
         struct l2d_image* image) {
     if (image == mask->image) return;
+    mask->ir->changed = true;
     if (mask->image)
         ib_image_decref(mask->image);
     mask->image = image;
@@ -621,11 +1084,13 @@ l2d_drawer_mask_set_image(struct l2d_drawer_mask* mask,
 void
 l2d_drawer_mask_set_site(struct l2d_drawer_mask* mask,
         struct site const* site) {
+    mask->ir->changed = true;
     site_copy(&mask->site, site);
 }
 
 void
 l2d_drawer_mask_set_alpha(struct l2d_drawer_mask* mask, float a) {
+    mask->ir->changed = true;
     mask->alpha = a;
 }
 
@@ -633,14 +1098,18 @@ struct data_output {
     struct vertex* verticies;
     int posIndex;
     int texIndex;
-    unsigned short* indicies;
+    vertex_index* indicies;
     int indexIndex;
     int indexStart;
     struct site* site;
     struct matrix matrix;
+    bool affine; // use the fast path, .matrix is not set
+    struct affine a;
     float alpha;
     float desaturate;
     struct rect texture_region;
+    int layer;
+    int batch_texture;
     bool clip;
     struct rect outer_clip;
     float color[4];
@@ -658,33 +1127,121 @@ transform(struct matrix* m, float x, float y, float* out) {
     out[1] = y/w;
 }
 
+#ifdef PACKED_VERTICES
+static
+uint8_t
+unorm8(float f) {
+    f = f < 0.f ? 0.f : (f > 1.f ? 1.f : f);
+    return (uint8_t)(f*255.f + .5f);
+}
+
+static
+uint16_t
+unorm16(float f) {
+    f = f < 0.f ? 0.f : (f > 1.f ? 1.f : f);
+    return (uint16_t)(f*65535.f + .5f);
+}
+#endif
+
+void
+vertex_unpack(struct vertex const* v, float position[2], float texCoord[2],
+        float color[4], float* desaturate, int* layer, int* batch_texture) {
+#ifdef PACKED_VERTICES
+    if (position) {
+        position[0] = v->position[0];
+        position[1] = v->position[1];
+    }
+    if (texCoord) {
+        texCoord[0] = v->texCoord[0]/65535.f;
+        texCoord[1] = v->texCoord[1]/65535.f;
+    }
+    if (color) {
+        for (int i=0; i<4; i++) color[i] = v->color[i]/255.f;
+    }
+    if (desaturate) *desaturate = v->misc[1]/255.f;
+    if (layer) *layer = v->misc[2];
+    if (batch_texture) *batch_texture = v->misc[3];
+#else
+    if (position) {
+        position[0] = v->position[0]/v->position[3];
+        position[1] = v->position[1]/v->position[3];
+    }
+    if (texCoord) {
+        texCoord[0] = v->texCoord[0];
+        texCoord[1] = v->texCoord[1];
+    }
+    if (color) {
+        for (int i=0; i<4; i++) color[i] = v->color[i];
+    }
+    if (desaturate) *desaturate = v->misc[1];
+    if (layer) *layer = (int)(v->misc[2]*255.f + .5f);
+    if (batch_texture) *batch_texture = (int)(v->misc[3]*255.f + .5f);
+#endif
+}
+
+// Writes the next vertex given its already transformed position.
 static
 void
-pos(struct data_output* d, float x, float y) {
+pos_transformed(struct data_output* d, float x, float y) {
     struct vertex* v = &d->verticies[d->posIndex];
 
-    transform(&d->matrix, x, y, v->position);
+    v->position[0] = x;
+    v->position[1] = y;
+
+#ifdef PACKED_VERTICES
+    v->misc[0] = 0;
+    v->misc[1] = unorm8(d->desaturate);
+    v->misc[2] = (uint8_t)d->layer;
+    v->misc[3] = (uint8_t)d->batch_texture;
 
+    v->color[0] = unorm8(d->color[0]);
+    v->color[1] = unorm8(d->color[1]);
+    v->color[2] = unorm8(d->color[2]);
+    v->color[3] = unorm8(d->color[3]*d->alpha);
+#else
     v->position[2] = 0.f;
     v->position[3] = 1.f;
 
     v->misc[0] = d->alpha;
     v->misc[1] = d->desaturate;
+    v->misc[2] = d->layer/255.f;
+    v->misc[3] = d->batch_texture/255.f;
 
     v->color[0] = d->color[0];
     v->color[1] = d->color[1];
     v->color[2] = d->color[2];
     v->color[3] = d->color[3];
+#endif
 
     d->posIndex ++;
 }
 
+static
+void
+pos(struct data_output* d, float x, float y) {
+    float out[2];
+    if (d->affine) {
+        out[0] = d->a.x[0]*x + d->a.x[1]*y + d->a.x[2];
+        out[1] = d->a.y[0]*x + d->a.y[1]*y + d->a.y[2];
+    } else {
+        transform(&d->matrix, x, y, out);
+    }
+    pos_transformed(d, out[0], out[1]);
+}
+
 static
 void
 tex(struct data_output* d, float x, float y) {
     struct vertex* v = &d->verticies[d->texIndex];
-    v->texCoord[0] = (1-x) * d->texture_region.l + x * d->texture_region.r;
-    v->texCoord[1] = (1-y) * d->texture_region.t + y * d->texture_region.b;
+    float u = (1-x) * d->texture_region.l + x * d->texture_region.r;
+    float w = (1-y) * d->texture_region.t + y * d->texture_region.b;
+#ifdef PACKED_VERTICES
+    v->texCoord[0] = unorm16(u);
+    v->texCoord[1] = unorm16(w);
+#else
+    v->texCoord[0] = u;
+    v->texCoord[1] = w;
+#endif
     d->texIndex ++;
 }
 
@@ -705,18 +1262,53 @@ face(struct data_output* d, unsigned int a, unsigned int b, unsigned int c) {
             return;
         }
     }
-    d->indicies[d->indexIndex++] = (unsigned short)(d->indexStart + a);
-    d->indicies[d->indexIndex++] = (unsigned short)(d->indexStart + b);
-    d->indicies[d->indexIndex++] = (unsigned short)(d->indexStart + c);
+    d->indicies[d->indexIndex++] = (vertex_index)(d->indexStart + a);
+    d->indicies[d->indexIndex++] = (vertex_index)(d->indexStart + b);
+    d->indicies[d->indexIndex++] = (vertex_index)(d->indexStart + c);
 }
 
 static
 void
 generateRect(struct data_output* d, int width, int height) {
-    pos(d, 0.f, 0.f);
-    pos(d, width, 0.f);
-    pos(d, width, height);
-    pos(d, 0.f, height);
+    if (d->affine) {
+        // All four corners at once.
+        float w = width, h = height;
+        float x[4], y[4];
+#if defined(__SSE2__)
+        __m128 cx = _mm_setr_ps(0.f, w, w, 0.f);
+        __m128 cy = _mm_setr_ps(0.f, 0.f, h, h);
+        _mm_storeu_ps(x, _mm_add_ps(_mm_set1_ps(d->a.x[2]),
+                    _mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(d->a.x[0])),
+                        _mm_mul_ps(cy, _mm_set1_ps(d->a.x[1])))));
+        _mm_storeu_ps(y, _mm_add_ps(_mm_set1_ps(d->a.y[2]),
+                    _mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(d->a.y[0])),
+                        _mm_mul_ps(cy, _mm_set1_ps(d->a.y[1])))));
+#elif defined(__ARM_NEON)
+        const float corners_x[4] = {0.f, w, w, 0.f};
+        const float corners_y[4] = {0.f, 0.f, h, h};
+        float32x4_t cx = vld1q_f32(corners_x);
+        float32x4_t cy = vld1q_f32(corners_y);
+        vst1q_f32(x, vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(d->a.x[2]),
+                        cx, d->a.x[0]), cy, d->a.x[1]));
+        vst1q_f32(y, vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(d->a.y[2]),
+                        cx, d->a.y[0]), cy, d->a.y[1]));
+#else
+        const float cx[4] = {0.f, w, w, 0.f};
+        const float cy[4] = {0.f, 0.f, h, h};
+        for (int i=0; i<4; i++) {
+            x[i] = d->a.x[0]*cx[i] + d->a.x[1]*cy[i] + d->a.x[2];
+            y[i] = d->a.y[0]*cx[i] + d->a.y[1]*cy[i] + d->a.y[2];
+        }
+#endif
+        for (int i=0; i<4; i++) {
+            pos_transformed(d, x[i], y[i]);
+        }
+    } else {
+        pos(d, 0.f, 0.f);
+        pos(d, width, 0.f);
+        pos(d, width, height);
+        pos(d, 0.f, height);
+    }
     tex(d, 0.f, 0.f);
     tex(d, 1.f, 0.f);
     tex(d, 1.f, 1.f);
@@ -725,124 +1317,428 @@ generateRect(struct data_output* d, int width, int height) {
     face(d, 0,2,3);
 }
 
-static
 int
-drawerSortCompare(const void* aVoidP, const void* bVoidP) {
-    const struct l2d_drawer* a = *(const struct l2d_drawer**)aVoidP;
-    const struct l2d_drawer* b = *(const struct l2d_drawer**)bVoidP;
+renderer_generate_rects(struct site* sites, int count,
+        struct matrix const* projection, bool affine,
+        struct vertex* verticies, vertex_index* indicies) {
+    int affine_count = 0;
+    for (int i=0; i<count; i++) {
+        struct data_output d = {
+            .verticies = verticies + i*4,
+            .indicies = indicies + i*6,
+            .site = &sites[i],
+            .alpha = 1.f,
+            .matrix = *projection,
+            .color = {1.f, 1.f, 1.f, 1.f},
+            .texture_region = {0.f, 0.f, 1.f, 1.f},
+        };
+        d.affine = affine && site_to_affine(&d.a, projection, &sites[i]);
+        if (d.affine) {
+            affine_count++;
+        } else {
+            premult_site_to_matrix(&d.matrix, &sites[i]);
+        }
+        generateRect(&d, (int)(sites[i].rect.r - sites[i].rect.l),
+                (int)(sites[i].rect.b - sites[i].rect.t));
+    }
+    return affine_count;
+}
 
-    if (a->order != b->order) {
-        return a->order - b->order;
+static inline
+unsigned int
+sort_entry_byte(struct sort_entry const* e, int b) {
+    return b < 4 ? (e->seq >> (b*8)) & 0xff : (e->key >> ((b-4)*8)) & 0xff;
+}
+
+static inline
+bool
+sort_entry_less(struct sort_entry const* a, struct sort_entry const* b) {
+    return a->key < b->key || (a->key == b->key && a->seq < b->seq);
+}
+
+// Stable LSD radix sort on (key, seq), a byte per pass. Passes where every
+// entry has the same byte are skipped, which is most of them in a typical
+// scene.
+static
+void
+radix_sort(struct sort_entry* entries, struct sort_entry* scratch,
+        int count) {
+    int histogram[12][256];
+    memset(histogram, 0, sizeof(histogram));
+    for (int i=0; i<count; i++) {
+        for (int b=0; b<12; b++) {
+            histogram[b][sort_entry_byte(&entries[i], b)]++;
+        }
     }
 
-    int r = image_sort_compare(a->image[0], b->image[0]);
-    if (r) {
-        return r;
+    struct sort_entry* src = entries;
+    struct sort_entry* dst = scratch;
+    for (int b=0; b<12; b++) {
+        int* offsets = histogram[b];
+        if (offsets[sort_entry_byte(&src[0], b)] == count)
+            continue;
+        int sum = 0;
+        for (int i=0; i<256; i++) {
+            int c = offsets[i];
+            offsets[i] = sum;
+            sum += c;
+        }
+        for (int i=0; i<count; i++) {
+            dst[offsets[sort_entry_byte(&src[i], b)]++] = src[i];
+        }
+        struct sort_entry* t = src;
+        src = dst;
+        dst = t;
     }
+    if (src != entries) {
+        memcpy(entries, src, count*sizeof(struct sort_entry));
+    }
+}
 
-    if (a->material != b->material) {
-        return (size_t)a->material - (size_t)b->material;
+// Moves the drawers queued in c->changed to their new place in the already
+// sorted c->entries. Returns false if the cache has to be fully re-sorted.
+static
+bool
+sort_cache_merge_changed(struct sort_cache* c) {
+    const int k = sbcount(c->changed);
+    if (k == 0) return true;
+
+    sbempty(c->changed_entries);
+    struct sort_entry* fresh = sbadd(c->changed_entries, k);
+    for (int i=0; i<k; i++) {
+        struct l2d_drawer* drawer = c->changed[i];
+        fresh[i].key = drawer_sort_key(drawer);
+        fresh[i].seq = drawer->sort_seq;
+        fresh[i].drawer = drawer;
     }
+    radix_sort(fresh, c->scratch, k);
+
+    // Merge the untouched entries, still in order, with the fresh ones.
+    struct sort_entry* out = c->scratch;
+    int n = 0, j = 0, skipped = 0;
+    for (int i=0; i<c->drawer_count; i++) {
+        struct sort_entry* e = &c->entries[i];
+        if (e->drawer->sort_changed) {
+            skipped++;
+            continue;
+        }
+        while (j < k && sort_entry_less(&fresh[j], e) && n < c->drawer_count)
+            out[n++] = fresh[j++];
+        if (n == c->drawer_count) {
+            // More drawers than entries, the queue doesn't match the cache.
+            skipped = -1;
+            break;
+        }
+        out[n++] = *e;
+    }
+
+    for (int i=0; i<k; i++) {
+        c->changed[i]->sort_changed = false;
+    }
+    sbempty(c->changed);
+    if (skipped != k) return false;
+
+    while (j < k)
+        out[n++] = fresh[j++];
+    c->scratch = c->entries;
+    c->entries = out;
+    return true;
+}
+
+static
+void
+drawer_update_bounds(struct l2d_drawer* d) {
+    d->boundsDirty = false;
+
+    struct matrix identity;
+    matrix_identity(&identity);
+    struct affine a;
+    struct site const* site = drawer_site(d);
+    d->boundsValid = site->z == 0.f
+        && site_to_affine(&a, &identity, site);
+    if (!d->boundsValid)
+        return;
 
-    if (a->mask != b->mask) {
-        return a->mask - b->mask;
+    // The same local space batch_add places verticies in.
+    float width = site->rect.r - site->rect.l;
+    float height = site->rect.b - site->rect.t;
+    struct rect local = {.l=0.f, .t=0.f, .r=width, .b=height};
+    if (sbcount(d->geoVerticies) && !l2d_image_get_nine_patch(d->image[0])) {
+        local.l = local.t = INFINITY;
+        local.r = local.b = -INFINITY;
+        for (int i=0; i<sbcount(d->geoVerticies); i++) {
+            float x = d->geoVerticies[i].x*width;
+            float y = d->geoVerticies[i].y*height;
+            local.l = fminf(local.l, x);
+            local.r = fmaxf(local.r, x);
+            local.t = fminf(local.t, y);
+            local.b = fmaxf(local.b, y);
+        }
     }
 
-    if (a->blend != b->blend) {
-        return (int)a->blend - (int)b->blend;
+    float cx[4] = {local.l, local.r, local.r, local.l};
+    float cy[4] = {local.t, local.t, local.b, local.b};
+    for (int i=0; i<4; i++) {
+        float x = a.x[0]*cx[i] + a.x[1]*cy[i] + a.x[2];
+        float y = a.y[0]*cx[i] + a.y[1]*cy[i] + a.y[2];
+        if (i == 0) {
+            d->bounds.l = d->bounds.r = x;
+            d->bounds.t = d->bounds.b = y;
+        } else {
+            d->bounds.l = fminf(d->bounds.l, x);
+            d->bounds.r = fmaxf(d->bounds.r, x);
+            d->bounds.t = fminf(d->bounds.t, y);
+            d->bounds.b = fmaxf(d->bounds.b, y);
+        }
     }
+}
 
-    return a - b;
+// The part of the z = 0 plane that lands on screen. Returns false if the
+// projection is more than a scale and a translation there, in which case
+// nothing is culled by position.
+static
+bool
+projection_visible_rect(struct rect* out, struct matrix const* projection) {
+    float const* p = projection->m;
+#define P(COLUMN, ROW) p[COLUMN*4+ROW]
+    float w = P(3,3);
+    if (P(1,0) != 0.f || P(0,1) != 0.f || P(0,3) != 0.f || P(1,3) != 0.f
+            || P(0,0) == 0.f || P(1,1) == 0.f || w <= 0.f)
+        return false;
+    float x0 = (-w - P(3,0))/P(0,0), x1 = (w - P(3,0))/P(0,0);
+    float y0 = (-w - P(3,1))/P(1,1), y1 = (w - P(3,1))/P(1,1);
+#undef P
+    out->l = fminf(x0, x1);
+    out->r = fmaxf(x0, x1);
+    out->t = fminf(y0, y1);
+    out->b = fmaxf(y0, y1);
+    return true;
+}
+
+// Whether the drawer could put anything on screen. `view` is from
+// projection_visible_rect, or NULL to skip the position test.
+static
+bool
+drawer_visible(struct l2d_drawer* d, struct rect const* view) {
+    if (d->hidden)
+        return false;
+
+    // The built in shaders scale everything by alpha, so unless blending
+    // is off a transparent drawer leaves the target untouched.
+    struct ir* ir = d->ir;
+    bool builtin = d->material == ir->defaultMaterial
+        || d->material == ir->premultMaterial
+        || d->material == ir->singleChannelDefaultMaterial;
+    if (builtin && d->blend != l2d_BLEND_DISABLED
+            && drawer_color(d)[3] * *drawer_alpha(d) == 0.f)
+        return false;
+
+    if (!view)
+        return true;
+    if (d->boundsDirty)
+        drawer_update_bounds(d);
+    return !d->boundsValid || rect_intersect(&d->bounds, view);
 }
 
+// Lays the material's attributes out one after the other in each vertex of
+// the batch's attribute stream.
 static
 void
 batch_reset(struct batch* b, struct material* m) {
     int num_attrs;
     struct material_attribute* attrs = render_api_get_attributes(m, &num_attrs);
-    int needed = num_attrs;
-    int have = sbcount(b->attributes);
-    if (have < needed) {
-        for (int i=0; i<needed-have; i++) {
-            struct attribute* a = sbadd(b->attributes, 1);
-            a->name = 0;
-            a->data = NULL;
-        }
+    sbempty(b->attributes);
+    sbempty(b->attributeData);
+    b->attributeStride = 0;
+    for (int i=0; i<num_attrs; i++) {
+        struct attribute* a = sbadd(b->attributes, 1);
+        a->name = attrs[i].name;
+        a->size = attrs[i].size;
+        a->offset = b->attributeStride;
+        b->attributeStride += a->size;
     }
+}
 
-    // zero all
-    for (int i=0; i<sbcount(b->attributes); i++) {
-        struct attribute* a = &b->attributes[i];
-        a->name = 0;
-        a->size = 0;
-        sbempty(a->data);
+// Matches the batch's attributes, which are its material's, to the
+// drawer's by name. Only redone when the material changes or the drawer
+// gets a new attribute.
+static
+int const*
+drawer_attribute_slots(struct l2d_drawer* d, struct batch const* batch) {
+    if (d->attributeMaterial == d->material
+            && sbcount(d->attributeSlots) == sbcount(batch->attributes))
+        return d->attributeSlots;
+
+    sbempty(d->attributeSlots);
+    for (int i=0; i<sbcount(batch->attributes); i++) {
+        int slot = -1;
+        for (int j=0; j<sbcount(d->attributes); j++) {
+            if (d->attributes[j].name == batch->attributes[i].name) {
+                assert(d->attributes[j].size == batch->attributes[i].size);
+                slot = j;
+                break;
+            }
+        }
+        sbpush(d->attributeSlots, slot);
     }
+    d->attributeMaterial = d->material;
+    return d->attributeSlots;
+}
 
-    // fill in:
-    for (int i=0; i<num_attrs; i++) {
-        struct attribute* a = &b->attributes[i];
-        a->name = attrs[i].name;
-        a->size = attrs[i].size;
+// Appends the drawer's vertexCount verticies to the attribute stream.
+// Verticies the drawer has no data for get zeros.
+static
+void
+batch_add_attributes(struct batch* batch, struct l2d_drawer* d,
+        int vertexCount) {
+    const int stride = batch->attributeStride;
+    if (stride == 0)
+        return;
+    int const* slots = drawer_attribute_slots(d, batch);
+    float* dest = sbadd(batch->attributeData, vertexCount*stride);
+    for (int i=0; i<sbcount(batch->attributes); i++) {
+        struct attribute* a = &batch->attributes[i];
+        float const* src = NULL;
+        int have = 0;
+        if (slots[i] >= 0) {
+            src = d->attributes[slots[i]].data;
+            have = sbcount(src)/a->size;
+            if (have > vertexCount) have = vertexCount;
+        }
+        float* out = dest + a->offset;
+        for (int v=0; v<have; v++) {
+            memcpy(out + v*stride, src + v*a->size, a->size*sizeof(float));
+        }
+        for (int v=have; v<vertexCount; v++) {
+            memset(out + v*stride, 0, a->size*sizeof(float));
+        }
     }
 }
 
+static
+bool
+drawer_cache_valid(struct l2d_drawer* d, struct matrix const* projection,
+        bool instanced) {
+    if (d->cacheDirty || d->cacheInstanced != instanced)
+        return false;
+    if (memcmp(&d->cachedProjection, projection, sizeof(struct matrix)))
+        return false;
+    if (d->cachedTextureLayer != ib_image_texture_layer(d->image[0])
+            || d->cachedBatchTexture != d->batchTexture)
+        return false;
+    struct rect r = ib_image_get_texture_region(d->image[0]);
+    return memcmp(&d->cachedTextureRegion, &r, sizeof(struct rect)) == 0;
+}
+
 static
 void
-batch_add(struct batch* batch, struct l2d_drawer* d, int viewportWidth,
-        int viewportHeight, struct matrix const* projection_matrix) {
-    struct site* site = &d->site;
-    float width = site->rect.r - site->rect.l;
-    float height = site->rect.b - site->rect.t;
-    float alpha = d->alpha;
-    float desaturate = d->desaturate;
+drawer_cache_validate(struct l2d_drawer* d, struct matrix const* projection,
+        bool instanced) {
+    d->cacheDirty = false;
+    d->cacheInstanced = instanced;
+    d->cachedProjection = *projection;
+    d->cachedTextureRegion = ib_image_get_texture_region(d->image[0]);
+    d->cachedTextureLayer = ib_image_texture_layer(d->image[0]);
+    d->cachedBatchTexture = d->batchTexture;
+}
 
-    int vertexCount;
-    int indexCount;
+// Works out how many verticies and (at most) indicies the drawer will emit.
+// Builds the nine patch geometry if needed, so it must run on the calling
+// thread. Returns whether the drawer's cache can be replayed.
+static
+bool
+drawer_prepare(struct l2d_drawer* d, struct matrix const* projection_matrix,
+        int* vertexCount, int* indexCount) {
+    if (drawer_cache_valid(d, projection_matrix, false)) {
+        *vertexCount = sbcount(d->cachedVerticies);
+        *indexCount = sbcount(d->cachedIndicies);
+        return true;
+    }
 
+    // The nine patch's geometry only depends on the size of the drawer, a
+    // moving or turning drawer keeps it.
     struct l2d_nine_patch* nine_patch = l2d_image_get_nine_patch(d->image[0]);
-    if (nine_patch) {
+    struct site* site = drawer_site(d);
+    float width = site->rect.r - site->rect.l;
+    float height = site->rect.b - site->rect.t;
+    if (nine_patch && (nine_patch != d->ninePatch
+                || d->image[0] != d->ninePatchImage
+                || width != d->ninePatchWidth
+                || height != d->ninePatchHeight)) {
         l2d_drawer_clear_geo(d);
         struct build_params params = {.image=d->image[0], .geoVerticies=d->geoVerticies,
-            .geoIndicies=d->geoIndicies, .bounds_width=width, .bounds_height=height};
-        // TODO cache built nine patch
+            .geoIndicies=d->geoIndicies,
+            .bounds_width=width,
+            .bounds_height=height};
         l2d_nine_patch_build_geo(&params);
         d->geoVerticies = params.geoVerticies;
         d->geoIndicies = params.geoIndicies;
+        d->ninePatchImage = d->image[0];
+        d->ninePatch = nine_patch;
+        d->ninePatchWidth = width;
+        d->ninePatchHeight = height;
+    } else if (!nine_patch && d->ninePatch) {
+        // The image is no longer a nine patch, its geometry goes with it.
+        l2d_drawer_clear_geo(d);
     }
 
     if (sbcount(d->geoVerticies) == 0) {
-        vertexCount = 4;
-        indexCount = 6;
+        *vertexCount = 4;
+        *indexCount = 6;
     } else {
-        vertexCount = sbcount(d->geoVerticies);
-        indexCount = sbcount(d->geoIndicies);
+        *vertexCount = sbcount(d->geoVerticies);
+        *indexCount = sbcount(d->geoIndicies);
     }
+    return false;
+}
 
-    if (batch->vertexCount + vertexCount > sbcount(batch->verticies)) {
-        // Empty if statement to suppress warning of unused value
-        if (sbadd(batch->verticies, vertexCount)) {}
-    }
-    if (batch->indexCount + indexCount > sbcount(batch->indicies)) {
-        if (sbadd(batch->indicies, indexCount)) {}
+// Writes the drawer's verticies and indicies, which are rebased onto
+// indexStart. Touches nothing but the drawer and the given output, so
+// distinct drawers can be built concurrently. Returns the number of
+// indicies written, which clipping may have made fewer than prepared for.
+static
+int
+drawer_build(struct l2d_drawer* d, bool cached,
+        struct vertex* verticies, vertex_index* indicies, int indexStart,
+        struct matrix const* projection_matrix) {
+    if (cached) {
+        int vertexCount = sbcount(d->cachedVerticies);
+        int indexCount = sbcount(d->cachedIndicies);
+        memcpy(verticies, d->cachedVerticies,
+                vertexCount*sizeof(struct vertex));
+        for (int i=0; i<indexCount; i++) {
+            indicies[i] = (vertex_index)(indexStart + d->cachedIndicies[i]);
+        }
+        return indexCount;
     }
 
+    struct site* site = drawer_site(d);
+    float width = site->rect.r - site->rect.l;
+    float height = site->rect.b - site->rect.t;
+    float alpha = *drawer_alpha(d);
+    float desaturate = *drawer_desaturate(d);
+    bool nine_patch = l2d_image_get_nine_patch(d->image[0]) != NULL;
+
     struct data_output data_output = {
-        .verticies = batch->verticies+batch->vertexCount,
-        .indicies = batch->indicies+batch->indexCount,
-        .indexStart = batch->vertexCount,
+        .verticies = verticies,
+        .indicies = indicies,
+        .indexStart = indexStart,
         .site = site,
         .alpha = alpha,
         .desaturate = desaturate,
         .texture_region = ib_image_get_texture_region(d->image[0]),
+        .layer = ib_image_texture_layer(d->image[0]),
+        .batch_texture = d->batchTexture,
         .matrix = *projection_matrix,
         .clip = false,
     };
-    data_output.color[0] = d->color[0];
-    data_output.color[1] = d->color[1];
-    data_output.color[2] = d->color[2];
-    data_output.color[3] = d->color[3];
+    memcpy(data_output.color, drawer_color(d), sizeof(data_output.color));
 
-    premult_site_to_matrix(&data_output.matrix, site);
+    data_output.affine = site_to_affine(&data_output.a, projection_matrix,
+            site);
+    if (!data_output.affine) {
+        premult_site_to_matrix(&data_output.matrix, site);
+    }
 
     if (d->clip_site_set) {
         data_output.clip = true;
@@ -884,79 +1780,469 @@ batch_add(struct batch* batch, struct l2d_drawer* d, int viewportWidth,
             }
             tex(&data_output, v->u, v->v);
         }
-        unsigned short* ind = d->geoIndicies;
+        vertex_index* ind = d->geoIndicies;
         for (int i=0; i<sbcount(d->geoIndicies); i+=3) {
             face(&data_output, ind[i+0], ind[i+1], ind[i+2]);
         }
+    }
 
-        // for each attribute in material
-        for (int i=0; i<sbcount(batch->attributes); i++) {
-            struct attribute* a = &batch->attributes[i];
-            if (a->name == 0) break;
-            // find attribute in drawer
-            struct l2d_drawer_attribute* da = NULL;
-            for (int j=0; j<sbcount(d->attributes); j++) {
-                if (d->attributes[i].name == a->name) {
-                    da = &d->attributes[i];
-                    if (!sbcount(da->data)) {
-                        da = NULL; // treat it as missing if it is empty
-                    }
-                    break;
-                }
-            }
-            int float_count = a->size * sbcount(d->geoVerticies);
-            int byte_count = float_count * sizeof(float);
-            float* dest = sbadd(a->data, float_count);
-            if (da) {
-                assert(a->size == da->size);
-                // TODO validate that there is enough data for the verticies,
-                // instead of potentially reading junk data?
-                memcpy(dest, da->data, byte_count);
-            } else {
-                memset(dest, 0, byte_count);
+    sbempty(d->cachedVerticies);
+    sbempty(d->cachedIndicies);
+    if (data_output.posIndex) {
+        memcpy(sbadd(d->cachedVerticies, data_output.posIndex),
+                data_output.verticies,
+                data_output.posIndex*sizeof(struct vertex));
+    }
+    if (data_output.indexIndex) {
+        vertex_index* ind = sbadd(d->cachedIndicies, data_output.indexIndex);
+        for (int i=0; i<data_output.indexIndex; i++) {
+            ind[i] = data_output.indicies[i] - data_output.indexStart;
+        }
+    }
+    drawer_cache_validate(d, projection_matrix, false);
+
+    return data_output.indexIndex;
+}
+
+static
+void
+batch_reserve(struct batch* batch, int vertexCount, int indexCount) {
+    if (batch->vertexCount + vertexCount > sbcount(batch->verticies)) {
+        // Empty if statement to suppress warning of unused value
+        if (sbadd(batch->verticies, vertexCount)) {}
+    }
+    if (batch->indexCount + indexCount > sbcount(batch->indicies)) {
+        if (sbadd(batch->indicies, indexCount)) {}
+    }
+}
+
+// Everything the drawers in a batch share. Drawers that can be drawn with
+// SHADER_MULTI_TEXTURE may also differ in image[0], as long as its texture
+// is in `images`; the rest all share images[0].
+struct batch_state {
+    struct material* material;
+    struct l2d_image* images[MAX_BATCH_TEXTURES];
+    int imageCount;
+    bool multiTexture;
+    struct l2d_image* image2;
+    enum l2d_blend blend;
+    struct l2d_drawer_mask* mask;
+    bool desaturate;
+    bool instanced;
+    enum render_api_depth depthMode;
+    float depth;
+};
+
+static void batch_flush(struct batch*, struct batch_state const*, int, int);
+
+// Draws what the batch holds if another vertexCount verticies wouldn't fit
+// in its index range.
+static
+void
+batch_make_room(struct batch* batch, int vertexCount,
+        struct batch_state const* state,
+        int viewportWidth, int viewportHeight) {
+    assert(vertexCount <= MAX_BATCH_VERTICIES);
+    if (batch->vertexCount + vertexCount <= MAX_BATCH_VERTICIES)
+        return;
+    if (batch->stats)
+        batch->stats->flushes[l2d_FLUSH_FULL]++;
+    batch_flush(batch, state, viewportWidth, viewportHeight);
+    batch_reset(batch, state->material);
+}
+
+static
+void
+batch_add(struct batch* batch, struct l2d_drawer* d,
+        struct batch_state const* state, int viewportWidth,
+        int viewportHeight, struct matrix const* projection_matrix) {
+    int vertexCount;
+    int indexCount;
+    bool cached = drawer_prepare(d, projection_matrix,
+            &vertexCount, &indexCount);
+    batch_make_room(batch, vertexCount, state, viewportWidth, viewportHeight);
+    batch_reserve(batch, vertexCount, indexCount);
+
+    indexCount = drawer_build(d, cached,
+            batch->verticies + batch->vertexCount,
+            batch->indicies + batch->indexCount,
+            batch->vertexCount, projection_matrix);
+    batch->vertexCount += vertexCount;
+    batch->indexCount += indexCount;
+
+    batch_add_attributes(batch, d, vertexCount);
+}
+
+// Plain textured quads can skip vertex generation and be expanded by the
+// instanced vertex shader instead.
+static
+bool
+drawer_is_instanceable(struct l2d_drawer* d) {
+    int num_attrs;
+    render_api_get_attributes(d->material, &num_attrs);
+    return sbcount(d->geoVerticies) == 0
+        && !d->clip_site_set
+        && num_attrs == 0
+        && !l2d_image_get_nine_patch(d->image[0]);
+}
+
+static
+void
+drawer_build_instance(struct l2d_drawer* d, struct instance* in,
+        struct matrix const* projection_matrix) {
+    if (drawer_cache_valid(d, projection_matrix, true)) {
+        *in = d->cachedInstance;
+        return;
+    }
+
+    struct site* site = drawer_site(d);
+    float width = site->rect.r - site->rect.l;
+    float height = site->rect.b - site->rect.t;
+
+    struct affine a;
+    if (site_to_affine(&a, projection_matrix, site)) {
+        // Already divided by w, so w is 1.
+        float const* rows[3] = {a.x, a.y, a.z};
+        for (int i=0; i<3; i++) {
+            in->matrix[0][i] = rows[i][0]*width;
+            in->matrix[1][i] = rows[i][1]*height;
+            in->matrix[2][i] = rows[i][2];
+        }
+        in->matrix[0][3] = 0.f;
+        in->matrix[1][3] = 0.f;
+        in->matrix[2][3] = 1.f;
+    } else {
+        struct matrix m = *projection_matrix;
+        premult_site_to_matrix(&m, site);
+        for (int i=0; i<4; i++) {
+            in->matrix[0][i] = m.m[0*4+i]*width;
+            in->matrix[1][i] = m.m[1*4+i]*height;
+            in->matrix[2][i] = m.m[3*4+i];
+        }
+    }
+
+    struct rect r = ib_image_get_texture_region(d->image[0]);
+    in->texRegion[0] = r.l;
+    in->texRegion[1] = r.t;
+    in->texRegion[2] = r.r;
+    in->texRegion[3] = r.b;
+
+    memcpy(in->color, drawer_color(d), sizeof(in->color));
+
+    in->misc[0] = *drawer_alpha(d);
+    in->misc[1] = *drawer_desaturate(d);
+    in->misc[2] = ib_image_texture_layer(d->image[0])/255.f;
+    in->misc[3] = d->batchTexture/255.f;
+
+    d->cachedInstance = *in;
+    drawer_cache_validate(d, projection_matrix, true);
+}
+
+// Below this many drawers in a batch, handing them to the worker threads
+// costs more than it saves.
+#define PARALLEL_BUILD_MIN 512
+// Drawers per job, so threads don't fight over the job counter.
+#define PARALLEL_BUILD_CHUNK 128
+
+struct batch_slot {
+    struct l2d_drawer* drawer;
+    bool cached;
+    int vertexCount;
+    int vertexStart;
+    int indexStart;
+    int indexCount; // prepared for, then written
+};
+
+struct build_job {
+    struct batch* batch;
+    struct sort_entry const* entries;
+    struct batch_slot* slots;
+    int count;
+    struct matrix const* projection_matrix;
+};
+
+static
+void
+build_verticies_job(void* userdata, int chunk) {
+    struct build_job* job = userdata;
+    struct batch* batch = job->batch;
+    int end = (chunk+1)*PARALLEL_BUILD_CHUNK;
+    if (end > job->count) end = job->count;
+    for (int i=chunk*PARALLEL_BUILD_CHUNK; i<end; i++) {
+        struct batch_slot* slot = &job->slots[i];
+        slot->indexCount = drawer_build(slot->drawer, slot->cached,
+                batch->verticies + slot->vertexStart,
+                batch->indicies + slot->indexStart,
+                slot->vertexStart, job->projection_matrix);
+    }
+}
+
+static
+void
+build_instances_job(void* userdata, int chunk) {
+    struct build_job* job = userdata;
+    struct batch* batch = job->batch;
+    int end = (chunk+1)*PARALLEL_BUILD_CHUNK;
+    if (end > job->count) end = job->count;
+    for (int i=chunk*PARALLEL_BUILD_CHUNK; i<end; i++) {
+        drawer_build_instance(job->entries[i].drawer,
+                &batch->instances[batch->instanceCount + i],
+                job->projection_matrix);
+    }
+}
+
+static
+int
+build_chunks(int count) {
+    return (count + PARALLEL_BUILD_CHUNK-1)/PARALLEL_BUILD_CHUNK;
+}
+
+// Builds the prepared slots, which must fit in the batch, across the job
+// threads.
+static
+void
+batch_build_slots(struct batch* batch, struct batch_slot* slots, int count,
+        struct matrix const* projection_matrix) {
+    int vertexCount = 0;
+    int indexCount = 0;
+    for (int i=0; i<count; i++) {
+        struct batch_slot* slot = &slots[i];
+        slot->vertexStart = batch->vertexCount + vertexCount;
+        slot->indexStart = batch->indexCount + indexCount;
+        vertexCount += slot->vertexCount;
+        indexCount += slot->indexCount;
+    }
+    batch_reserve(batch, vertexCount, indexCount);
+
+    struct build_job job = {
+        .batch = batch,
+        .slots = slots,
+        .count = count,
+        .projection_matrix = projection_matrix,
+    };
+    job_parallel_for(build_chunks(count), build_verticies_job, &job);
+
+    // Close the gaps left by faces that were clipped away, and append the
+    // material attributes, which are laid out in drawer order.
+    vertex_index* ind = batch->indicies + batch->indexCount;
+    for (int i=0; i<count; i++) {
+        struct batch_slot* slot = &slots[i];
+        vertex_index* src = batch->indicies + slot->indexStart;
+        if (src != ind) {
+            memmove(ind, src, slot->indexCount*sizeof(vertex_index));
+        }
+        ind += slot->indexCount;
+        batch_add_attributes(batch, slot->drawer, slot->vertexCount);
+    }
+    batch->vertexCount += vertexCount;
+    batch->indexCount = ind - batch->indicies;
+}
+
+// Adds a run of drawers that share all their batch state, drawing the
+// batch whenever its index range fills up. Large runs are built across the
+// job threads: each drawer's slice of the vertex and index buffers is laid
+// out up front, then filled in independently.
+static
+void
+batch_add_range(struct batch* batch, struct sort_entry const* entries,
+        int count, struct batch_state const* state,
+        int viewportWidth, int viewportHeight,
+        struct matrix const* projection_matrix) {
+    const bool parallel = count >= PARALLEL_BUILD_MIN
+        && job_thread_count() > 1;
+
+    if (state->instanced) {
+        if (batch->instanceCount + count > sbcount(batch->instances)) {
+            if (sbadd(batch->instances, count)) {}
+        }
+        if (parallel) {
+            struct build_job job = {
+                .batch = batch,
+                .entries = entries,
+                .count = count,
+                .projection_matrix = projection_matrix,
+            };
+            job_parallel_for(build_chunks(count), build_instances_job, &job);
+        } else {
+            for (int i=0; i<count; i++) {
+                drawer_build_instance(entries[i].drawer,
+                        &batch->instances[batch->instanceCount + i],
+                        projection_matrix);
             }
         }
+        batch->instanceCount += count;
+        return;
     }
 
-    assert(data_output.posIndex <= vertexCount);
-    assert(data_output.indexIndex <= indexCount);
+    if (!parallel) {
+        for (int i=0; i<count; i++) {
+            batch_add(batch, entries[i].drawer, state, viewportWidth,
+                    viewportHeight, projection_matrix);
+        }
+        return;
+    }
+
+    sbempty(batch->slots);
+    struct batch_slot* slots = sbadd(batch->slots, count);
+    for (int i=0; i<count; i++) {
+        struct batch_slot* slot = &slots[i];
+        slot->drawer = entries[i].drawer;
+        slot->cached = drawer_prepare(slot->drawer, projection_matrix,
+                &slot->vertexCount, &slot->indexCount);
+    }
+
+    int start = 0;
+    int vertexCount = batch->vertexCount;
+    for (int i=0; i<count; i++) {
+        if (vertexCount + slots[i].vertexCount <= MAX_BATCH_VERTICIES) {
+            vertexCount += slots[i].vertexCount;
+            continue;
+        }
+        batch_build_slots(batch, slots + start, i - start, projection_matrix);
+        batch_make_room(batch, slots[i].vertexCount, state,
+                viewportWidth, viewportHeight);
+        start = i;
+        vertexCount = batch->vertexCount + slots[i].vertexCount;
+    }
+    batch_build_slots(batch, slots + start, count - start, projection_matrix);
+}
+
+enum retained_command_type {
+    RETAINED_PASS, // render_api_draw_start for target, the screen if NULL
+    RETAINED_BATCH,
+    RETAINED_CLEAR_DEPTH,
+};
+
+struct retained_command {
+    enum retained_command_type type;
+    struct l2d_target* target;
+    struct batch_state state;
+    int viewportWidth, viewportHeight;
+    int vertexStart, vertexCount;
+    int indexStart, indexCount;
+    int instanceStart, instanceCount;
+};
+
+static
+void
+retained_reset(struct retained_frame* r) {
+    r->valid = false;
+    sbempty(r->commands);
+    sbempty(r->verticies);
+    sbempty(r->indicies);
+    sbempty(r->instances);
+}
 
-    batch->vertexCount += data_output.posIndex;
-    batch->indexCount += data_output.indexIndex;
+static
+void
+retained_add_pass(struct retained_frame* r, struct l2d_target* target) {
+    struct retained_command* c = sbadd(r->commands, 1);
+    memset(c, 0, sizeof(*c));
+    c->type = RETAINED_PASS;
+    c->target = target;
 }
 
 static
 void
-batch_flush(struct batch* batch,
-        struct material* material,
-        struct l2d_image* image,
-        struct l2d_image* image2,
-        enum l2d_blend blend,
-        struct l2d_drawer_mask* mask,
-        bool desaturate,
+retained_add_clear_depth(struct retained_frame* r) {
+    struct retained_command* c = sbadd(r->commands, 1);
+    memset(c, 0, sizeof(*c));
+    c->type = RETAINED_CLEAR_DEPTH;
+}
+
+// Copies the batch into the frame. Returns false if it can't be replayed.
+static
+bool
+retained_add_batch(struct retained_frame* r, struct batch const* batch,
+        struct batch_state const* state,
         int viewportWidth, int viewportHeight) {
-    if (batch->indexCount == 0) {
-        //assert(batch->vertexCount == 0);
+    // Per material attributes would have to be copied too, and scenes using
+    // them rarely sit still.
+    int num_attrs;
+    render_api_get_attributes(state->material, &num_attrs);
+    if (num_attrs)
+        return false;
+
+    struct retained_command* c = sbadd(r->commands, 1);
+    c->type = RETAINED_BATCH;
+    c->target = NULL;
+    c->state = *state;
+    c->viewportWidth = viewportWidth;
+    c->viewportHeight = viewportHeight;
+    c->vertexStart = sbcount(r->verticies);
+    c->vertexCount = batch->vertexCount;
+    c->indexStart = sbcount(r->indicies);
+    c->indexCount = batch->indexCount;
+    c->instanceStart = sbcount(r->instances);
+    c->instanceCount = batch->instanceCount;
+    if (batch->vertexCount) {
+        memcpy(sbadd(r->verticies, batch->vertexCount), batch->verticies,
+                batch->vertexCount*sizeof(struct vertex));
+    }
+    if (batch->indexCount) {
+        memcpy(sbadd(r->indicies, batch->indexCount), batch->indicies,
+                batch->indexCount*sizeof(vertex_index));
+    }
+    if (batch->instanceCount) {
+        memcpy(sbadd(r->instances, batch->instanceCount), batch->instances,
+                batch->instanceCount*sizeof(struct instance));
+    }
+    return true;
+}
+
+static
+void
+batch_flush(struct batch* batch, struct batch_state const* state,
+        int viewportWidth, int viewportHeight) {
+    if (batch->indexCount == 0 && batch->instanceCount == 0) {
+        // Everything was clipped away.
+        batch->vertexCount = 0;
         return;
     }
 
+    PROFILE_BEGIN(batch_flush);
+    struct material* material = state->material;
+    struct l2d_image* image = state->images[0];
+    struct l2d_image* image2 = state->image2;
+    struct l2d_drawer_mask* mask = state->mask;
+
     unsigned int shader_variant = 0;
+    if (batch->instanceCount) {
+        shader_variant |= SHADER_INSTANCED;
+    }
     if (mask) {
         shader_variant |= SHADER_MASK;
     }
-    if (desaturate) {
+    if (state->desaturate) {
         shader_variant |= SHADER_DESATURATE;
     }
+    if (ib_image_is_layered(image)) {
+        shader_variant |= SHADER_TEXTURE_ARRAY;
+    }
+    if (mask && ib_image_is_layered(mask->image)) {
+        shader_variant |= SHADER_MASK_ARRAY;
+    }
+    if (state->imageCount > 1) {
+        shader_variant |= SHADER_MULTI_TEXTURE;
+    }
 
     struct shader_handles* shader;
     struct material_handles* h;
     int texture_slot=0;
 
     render_api_material_use(material, shader_variant, &shader, &h, &texture_slot);
+    render_api_set_depth(state->depthMode);
+    render_api_set_float(shader->depth, state->depth);
 
     ib_image_bind(image, shader->texturePixelSizeHandle, shader->textureHandle, texture_slot);
     texture_slot++;
 
+    for (int i=1; i<state->imageCount; i++) {
+        ib_image_bind(state->images[i], -1, shader->batchTextures[i],
+                texture_slot);
+        texture_slot++;
+    }
+
     if (image2) {
         ib_image_bind(image2, -1, shader->texture2Handle, texture_slot);
         texture_slot++;
@@ -966,6 +2252,8 @@ batch_flush(struct batch* batch,
         if (shader->maskTexture != -1) {
             ib_image_bind(mask->image, -1, shader->maskTexture, texture_slot);
             texture_slot++;
+            render_api_set_float(shader->maskLayer,
+                    ib_image_texture_layer(mask->image));
 
             struct site* site = &mask->site;
 
@@ -1012,7 +2300,7 @@ batch_flush(struct batch* batch,
             struct matrix final;
             matrix_multiply_matrix(&final, &m2, &m3);
 
-            //TODO glUniformMatrix4fv(shader->maskTextureCoordMat, 1, 0, final.m);
+            render_api_set_matrix(shader->maskTextureCoordMat, final.m);
         }
     }
 
@@ -1023,17 +2311,245 @@ batch_flush(struct batch* batch,
         render_api_set_vec(shader->eyePos, 0.f, 0.f, -4.f*viewportHeight, 1.f);
     }
 
-    render_api_draw_batch(batch, shader, material, h, blend);
+    if (batch->record && !retained_add_batch(batch->record, batch, state,
+                viewportWidth, viewportHeight)) {
+        batch->record = NULL;
+    }
+
+    render_api_draw_batch(batch, shader, material, h, state->blend);
+    if (batch->stats)
+        batch->stats->batches++;
 
     batch->indexCount = 0;
     batch->vertexCount = 0;
+    batch->instanceCount = 0;
+    PROFILE_END(batch_flush);
+}
+
+// Brings the sorted entries up to date with every drawer in the stretchy
+// `drawers`. Returns whether any of them had to be sorted.
+static
+bool
+sort_cache_update(struct sort_cache* c, struct l2d_drawer** drawers) {
+    if (c->sort_buffer_dirty) {
+        c->sort_buffer_dirty = false;
+        c->sort_order_dirty = true;
+        // Drawers queued here may since have been deleted, don't touch them.
+        sbempty(c->changed);
+        c->drawer_count = 0;
+        for (int i=0; i<sbcount(drawers); i++) {
+            struct l2d_drawer* drawer = drawers[i];
+            if (c->drawer_count == c->alloc_size) {
+                c->alloc_size += 128;
+                c->entries = realloc(c->entries,
+                        c->alloc_size*sizeof(struct sort_entry));
+                c->scratch = realloc(c->scratch,
+                        c->alloc_size*sizeof(struct sort_entry));
+            }
+            drawer->sort_changed = false;
+            c->entries[c->drawer_count++].drawer = drawer;
+        }
+    }
+
+    if (c->drawer_count == 0)
+        return false;
+
+    const bool changed = sbcount(c->changed) > 0;
+    if (!c->sort_order_dirty && !sort_cache_merge_changed(c)) {
+        c->sort_order_dirty = true;
+    }
+
+    if (c->sort_order_dirty) {
+        c->sort_order_dirty = false;
+        for (int i=0; i<sbcount(c->changed); i++) {
+            c->changed[i]->sort_changed = false;
+        }
+        sbempty(c->changed);
+        struct sort_entry* entries = c->entries;
+        for (int i=0; i<c->drawer_count; i++) {
+            struct l2d_drawer* drawer = entries[i].drawer;
+            entries[i].key = drawer_sort_key(drawer);
+            entries[i].seq = drawer->sort_seq;
+        }
+        radix_sort(entries, c->scratch, c->drawer_count);
+        return true;
+    }
+    return changed;
+}
+
+// Fills the sort cache with the drawers the grid has near `view`, sorted.
+// Returns false if the grid can't narrow them down.
+static
+bool
+sort_cache_gather(struct sort_cache* c, struct grid* grid,
+        struct rect const* view, void*** query) {
+    sbempty(*query);
+    if (!grid_query(grid, view, query))
+        return false;
+
+    const int count = sbcount(*query);
+    if (count > c->alloc_size) {
+        c->alloc_size = count + 128;
+        c->entries = realloc(c->entries,
+                c->alloc_size*sizeof(struct sort_entry));
+        c->scratch = realloc(c->scratch,
+                c->alloc_size*sizeof(struct sort_entry));
+    }
+    for (int i=0; i<count; i++) {
+        struct l2d_drawer* drawer = (*query)[i];
+        c->entries[i].key = drawer_sort_key(drawer);
+        c->entries[i].seq = drawer->sort_seq;
+        c->entries[i].drawer = drawer;
+    }
+    if (count)
+        radix_sort(c->entries, c->scratch, count);
+    c->drawer_count = count;
+    // The entries no longer cover every drawer, rebuild them if the grid
+    // can't be used next frame.
+    c->sort_buffer_dirty = true;
+    return true;
+}
+
+// Drawers with an effect sample `texture` from their own shader code, so
+// only the plain ones can take their texture from the batch's table.
+static
+bool
+drawer_can_multi_texture(struct l2d_drawer* d) {
+    return d->effect == NULL
+        && d->image[0] != NULL
+        && d->image[1] == NULL
+        && !ib_image_is_layered(d->image[0]);
+}
+
+// Returns the index of the image's texture in the batch's table, adding it
+// if the batch is multi textured and there is room. -1 if it needs a batch
+// of its own.
+static
+int
+batch_state_add_texture(struct batch_state* state, struct l2d_image* image,
+        int max_textures) {
+    for (int i=0; i<state->imageCount; i++) {
+        if (ib_image_same_texture(image, state->images[i]))
+            return i;
+    }
+    if (!state->multiTexture || state->imageCount == max_textures)
+        return -1;
+    state->images[state->imageCount] = image;
+    return state->imageCount++;
+}
+
+// Why the drawer can't join the batch, or -1 if it can as long as its
+// texture does.
+static
+int
+batch_state_break(struct batch_state const* state, struct l2d_drawer* d,
+        bool instanced, bool multi_texture, float depth) {
+    if (!ib_image_same_texture(d->image[1], state->image2))
+        return l2d_FLUSH_TEXTURE;
+    if (d->material != state->material)
+        return l2d_FLUSH_MATERIAL;
+    if (d->blend != state->blend)
+        return l2d_FLUSH_BLEND;
+    if (d->mask != state->mask)
+        return l2d_FLUSH_MASK;
+    if ((*drawer_desaturate(d)!=0) != state->desaturate)
+        return l2d_FLUSH_DESATURATE;
+    if (instanced != state->instanced || multi_texture != state->multiTexture)
+        return l2d_FLUSH_INSTANCING;
+    if (depth != state->depth)
+        return l2d_FLUSH_DEPTH;
+    return -1;
+}
+
+// Clip space z of a depth level out of `levels`, level 0 on the far plane.
+static
+float
+level_depth(int level, int levels) {
+    return 1.f - 2.f*level/(levels+1);
+}
+
+// Batches up and draws sorted entries.
+static
+void
+draw_entries(struct batch* batch, struct sort_entry const* entries, int count,
+        enum render_api_depth depth_mode, int levels,
+        int viewportWidth, int viewportHeight,
+        struct matrix const* projection_matrix) {
+    if (count == 0)
+        return;
+
+    const bool can_instance = render_api_supports_instancing();
+    const int max_textures = render_api_max_batch_textures();
+    struct batch_state state;
+    int run_start = 0;
+    for (int i = 0; i < count; i++) {
+        struct l2d_drawer* drawer = entries[i].drawer;
+        bool drawer_instanced = can_instance
+            && drawer_is_instanceable(drawer);
+        bool multi_texture = max_textures > 1
+            && drawer_can_multi_texture(drawer);
+        float depth = depth_mode == DEPTH_OFF ? 0.f
+            : level_depth(drawer->depthLevel, levels);
+        int batch_texture = -1;
+        int reason = -1;
+        if (i > 0) {
+            reason = batch_state_break(&state, drawer, drawer_instanced,
+                    multi_texture, depth);
+        }
+        if (i > 0 && reason == -1) {
+            batch_texture = batch_state_add_texture(&state, drawer->image[0],
+                    max_textures);
+            if (batch_texture == -1)
+                reason = l2d_FLUSH_TEXTURE;
+        }
+        if (batch_texture == -1) {
+            if (i > 0) {
+                if (batch->stats)
+                    batch->stats->flushes[reason]++;
+                PROFILE_BEGIN(batch_add);
+                const uint64_t batch_start = profile_now_ns();
+                batch_add_range(batch, entries + run_start, i - run_start,
+                        &state, viewportWidth, viewportHeight,
+                        projection_matrix);
+                if (batch->stats)
+                    batch->stats->batch_ns += profile_now_ns() - batch_start;
+                PROFILE_END(batch_add);
+                batch_flush(batch, &state, viewportWidth, viewportHeight);
+            }
+            state.material = drawer->material;
+            state.images[0] = drawer->image[0];
+            state.imageCount = 1;
+            state.multiTexture = multi_texture;
+            state.image2 = drawer->image[1];
+            state.blend = drawer->blend;
+            state.mask = drawer->mask;
+            state.desaturate = *drawer_desaturate(drawer);
+            state.instanced = drawer_instanced;
+            state.depthMode = depth_mode;
+            state.depth = depth;
+            batch_reset(batch, state.material);
+            run_start = i;
+            batch_texture = 0;
+        }
+        drawer->batchTexture = batch_texture;
+    }
+    PROFILE_BEGIN(batch_add);
+    const uint64_t batch_start = profile_now_ns();
+    batch_add_range(batch, entries + run_start, count - run_start, &state,
+            viewportWidth, viewportHeight, projection_matrix);
+    if (batch->stats)
+        batch->stats->batch_ns += profile_now_ns() - batch_start;
+    PROFILE_END(batch_add);
+    if (batch->stats)
+        batch->stats->flushes[l2d_FLUSH_END]++;
+    batch_flush(batch, &state, viewportWidth, viewportHeight);
 }
 
 static
 void
-drawDrawerList(struct batch* batch, struct l2d_drawer* drawerList,
+drawDrawerList(struct batch* batch, struct l2d_drawer** drawers,
         int viewportWidth, int viewportHeight, float* translate,
-        struct sort_cache* sort_cache) {
+        struct sort_cache* sort_cache, struct grid* grid, void*** gridQuery) {
     struct matrix projection_matrix;
     matrix_identity(&projection_matrix);
     projection_matrix.m[2*4+3] = .5f/viewportWidth; // must match eyePos calc
@@ -1045,90 +2561,206 @@ drawDrawerList(struct batch* batch, struct l2d_drawer* drawerList,
                 translate[1], translate[2]);
     }
 
-    if (sort_cache->sort_buffer_dirty) {
-        sort_cache->sort_buffer_dirty = false;
-        sort_cache->sort_order_dirty = true;
-        sort_cache->drawer_count = 0;
-        for (struct l2d_drawer* drawer = drawerList;
-                drawer != NULL; drawer = drawer->next) {
-            if (sort_cache->drawer_count == sort_cache->alloc_size) {
-                sort_cache->alloc_size += 128;
-                sort_cache->buffer = realloc(sort_cache->buffer, sort_cache->alloc_size*sizeof(void*));
+    struct rect view;
+    bool cull_position = projection_visible_rect(&view, &projection_matrix);
+    PROFILE_BEGIN(sort);
+    const uint64_t sort_start = profile_now_ns();
+    bool sorted = true;
+    if (!grid || !cull_position
+            || !sort_cache_gather(sort_cache, grid, &view, gridQuery))
+        sorted = sort_cache_update(sort_cache, drawers);
+    PROFILE_END(sort);
+    if (batch->stats) {
+        batch->stats->sorted |= sorted && sort_cache->drawer_count > 0;
+        batch->stats->sort_ns += profile_now_ns() - sort_start;
+    }
+
+    // Cull into scratch, which is free until the next sort.
+    struct sort_entry* entries = sort_cache->scratch;
+    int count = 0;
+    for (int i=0; i<sort_cache->drawer_count; i++) {
+        struct sort_entry* e = &sort_cache->entries[i];
+        if (drawer_visible(e->drawer, cull_position ? &view : NULL))
+            entries[count++] = *e;
+    }
+    if (batch->stats) {
+        batch->stats->drawers_visited += sort_cache->drawer_count;
+        batch->stats->drawers_culled += sort_cache->drawer_count - count;
+    }
+    if (count == 0)
+        return;
+
+    // Opaque drawers hide everything drawn before them. Given a depth buffer
+    // they go first, front to back, so the depth test skips the pixels they
+    // cover instead of shading them again and again. Each run of them in
+    // draw order is a level nearer than the ones before it.
+    int levels = 0;
+    if (render_api_has_depth()) {
+        sbempty(sort_cache->opaque);
+        int blended = 0;
+        bool in_run = false;
+        for (int i=0; i<count; i++) {
+            struct l2d_drawer* drawer = entries[i].drawer;
+            bool opaque = drawer->blend == l2d_BLEND_DISABLED;
+            if (opaque && !in_run)
+                levels++;
+            in_run = opaque;
+            drawer->depthLevel = levels;
+            if (opaque) {
+                sbpush(sort_cache->opaque, entries[i]);
+            } else {
+                entries[blended++] = entries[i];
             }
-            sort_cache->buffer[sort_cache->drawer_count++] = drawer;
         }
+        count = blended;
     }
 
-    if (sort_cache->drawer_count == 0)
-        return;
+    if (levels) {
+        struct sort_entry* opaque = sort_cache->opaque;
+        const int opaque_count = sbcount(opaque);
+        for (int i=0; i<opaque_count/2; i++) {
+            struct sort_entry t = opaque[i];
+            opaque[i] = opaque[opaque_count-1-i];
+            opaque[opaque_count-1-i] = t;
+        }
+        render_api_clear_depth();
+        if (batch->record)
+            retained_add_clear_depth(batch->record);
+        draw_entries(batch, opaque, opaque_count, DEPTH_WRITE, levels,
+                viewportWidth, viewportHeight, &projection_matrix);
+    }
+    draw_entries(batch, entries, count, levels ? DEPTH_TEST : DEPTH_OFF,
+            levels, viewportWidth, viewportHeight, &projection_matrix);
+}
 
-    if (sort_cache->sort_order_dirty) {
-        sort_cache->sort_order_dirty = false;
-        qsort(sort_cache->buffer, sort_cache->drawer_count, sizeof(struct l2d_drawer*),
-            drawerSortCompare);
-    }
-
-    struct material* material = sort_cache->buffer[0]->material;
-    batch_reset(batch, material);
-    struct l2d_image* image = sort_cache->buffer[0]->image[0];
-    struct l2d_image* image2 = sort_cache->buffer[0]->image[1];
-    enum l2d_blend blend = sort_cache->buffer[0]->blend;
-    struct l2d_drawer_mask* mask = sort_cache->buffer[0]->mask;
-    bool desaturate = sort_cache->buffer[0]->desaturate;
-    for (int i = 0; i < sort_cache->drawer_count; i++) {
-        struct l2d_drawer* drawer = sort_cache->buffer[i];
-        if (!ib_image_same_texture(drawer->image[0], image)
-                || !ib_image_same_texture(drawer->image[1], image2)
-                || drawer->material != material
-                || drawer->blend != blend
-                || drawer->mask != mask
-                || (drawer->desaturate!=0) != desaturate) {
-            batch_flush(batch, material, image, image2, blend, mask, desaturate,
-                    viewportWidth, viewportHeight);
-            desaturate = drawer->desaturate;
-            material = drawer->material;
-            image = drawer->image[0];
-            image2 = drawer->image[1];
-            blend = drawer->blend;
-            mask = drawer->mask;
-            batch_reset(batch, material);
+// Brings the spatial index up to date with the drawers that moved.
+static
+void
+ir_update_grid(struct ir* ir) {
+    for (int i=0; i<sbcount(ir->gridMoved); i++) {
+        struct l2d_drawer* d = ir->gridMoved[i];
+        d->gridMovedIndex = -1;
+        if (d->boundsDirty)
+            drawer_update_bounds(d);
+        grid_update(ir->grid, &d->gridItem, d->boundsValid ? &d->bounds : NULL);
+    }
+    sbempty(ir->gridMoved);
+}
+
+bool
+ir_needs_render(struct ir* ir) {
+    return ir->changed
+        || ir->renderedViewport[0] != ir->viewportWidth
+        || ir->renderedViewport[1] != ir->viewportHeight
+        || memcmp(ir->renderedTranslate, ir->translate,
+                sizeof(ir->translate)) != 0
+        || ir->renderedImageGeneration != ib_generation(ir->ib);
+}
+
+static
+void
+retained_replay(struct ir* ir) {
+    struct retained_frame* r = &ir->retained;
+    for (int i=0; i<sbcount(r->commands); i++) {
+        struct retained_command* c = &r->commands[i];
+        if (c->type == RETAINED_PASS) {
+            struct l2d_target* t = c->target;
+            if (t) {
+                render_api_draw_start(t->fbo, i_target_scaled_width(t),
+                        i_target_scaled_height(t));
+                render_api_clear_f(t->color);
+            } else {
+                render_api_draw_start(0, ir->viewportWidth,
+                        ir->viewportHeight);
+            }
+            continue;
+        }
+        if (c->type == RETAINED_CLEAR_DEPTH) {
+            render_api_clear_depth();
+            continue;
         }
-        batch_add(batch, drawer, viewportWidth, viewportHeight,
-                &projection_matrix);
+        struct batch batch = {
+            .verticies = r->verticies + c->vertexStart,
+            .vertexCount = c->vertexCount,
+            .indicies = r->indicies + c->indexStart,
+            .indexCount = c->indexCount,
+            .instances = r->instances + c->instanceStart,
+            .instanceCount = c->instanceCount,
+            .stats = &ir->stats,
+        };
+        batch_flush(&batch, &c->state, c->viewportWidth, c->viewportHeight);
     }
-    batch_flush(batch, material, image, image2, blend, mask, desaturate,
-            viewportWidth, viewportHeight);
 }
 
 void
 ir_render(struct ir* ir) {
+    PROFILE_BEGIN(ir_render);
     i_prepair_targets_before_texture(ir);
 
+    // Once nothing changes between two frames, the second one is recorded
+    // and replayed until something does. A scene that changes every frame
+    // never pays for the copy.
+    const bool changed = ir_needs_render(ir);
+    memset(&ir->stats, 0, sizeof(ir->stats));
+    ir->changed = false;
+    ir->renderedViewport[0] = ir->viewportWidth;
+    ir->renderedViewport[1] = ir->viewportHeight;
+    memcpy(ir->renderedTranslate, ir->translate, sizeof(ir->translate));
+    ir->renderedImageGeneration = ib_generation(ir->ib);
+    if (!changed && ir->retained.valid) {
+        ir->stats.replayed = true;
+        retained_replay(ir);
+        render_api_draw_end();
+        i_prepair_targets_after_texture(ir);
+        PROFILE_END(ir_render);
+        return;
+    }
+    retained_reset(&ir->retained);
+
     struct batch batch = {
         .verticies = ir->scratchVerticies,
         .indicies = ir->scratchIndicies,
+        .instances = ir->scratchInstances,
         .attributes = ir->scratchAttributes,
+        .attributeData = ir->scratchAttributeData,
+        .slots = ir->scratchSlots,
+        .record = changed ? NULL : &ir->retained,
+        .stats = &ir->stats,
     };
     for (struct l2d_target* itr = ir->targetList; itr != NULL; itr=itr->next) {
         render_api_draw_start(itr->fbo,
                 i_target_scaled_width(itr),
                 i_target_scaled_height(itr));
         render_api_clear_f(itr->color);
+        if (batch.record)
+            retained_add_pass(batch.record, itr);
 
-        drawDrawerList(&batch, itr->drawerList, itr->width, itr->height, NULL,
-                &itr->sort_cache);
+        drawDrawerList(&batch, itr->drawers, itr->width, itr->height, NULL,
+                &itr->sort_cache, NULL, NULL);
     }
     render_api_draw_start(0, ir->viewportWidth, ir->viewportHeight);
-    drawDrawerList(&batch, ir->drawerList,
+    if (batch.record)
+        retained_add_pass(batch.record, NULL);
+    if (ir->grid)
+        ir_update_grid(ir);
+    drawDrawerList(&batch, ir->drawers,
             ir->viewportWidth, ir->viewportHeight, ir->translate,
-            &ir->sort_cache);
+            &ir->sort_cache, ir->grid, &ir->gridQuery);
+    render_api_draw_end();
+    ir->retained.valid = batch.record != NULL;
+    // Building the frame can touch drawers, nine patches rebuild their
+    // geometry for instance, that isn't a change to the scene.
+    ir->changed = false;
 
     // write back the scratch buffer pointers, as they might have been
     // reallocated:
     ir->scratchVerticies = batch.verticies;
     ir->scratchIndicies = batch.indicies;
+    ir->scratchInstances = batch.instances;
     ir->scratchAttributes = batch.attributes;
+    ir->scratchAttributeData = batch.attributeData;
+    ir->scratchSlots = batch.slots;
 
     i_prepair_targets_after_texture(ir);
+    PROFILE_END(ir_render);
 }
-
@@ -4,29 +4,109 @@
 #include "primitives.h"
 #include "lib2d.h"
 
+#ifdef WIDE_INDICES
+typedef uint32_t vertex_index;
+#define MAX_BATCH_VERTICIES (1 << 30)
+#else
+typedef uint16_t vertex_index;
+#define MAX_BATCH_VERTICIES (1 << 16)
+#endif
+
+#ifdef PACKED_VERTICES
+// 20 bytes instead of 56. Texture coordinates are unorm16, so they must stay
+// within [0, 1], and the drawer alpha is folded into color[3].
+struct vertex {
+    float position[2];
+    uint16_t texCoord[2];
+    uint8_t color[4];
+    uint8_t misc[4]; // unused, desaturate, texture layer, batch texture
+};
+#else
 struct vertex {
     float position[4];
     float texCoord[2];
-    float misc[4]; // alpha, desaturate, unused, unused
+    // alpha, desaturate, texture layer/255 and batch texture/255 (as packed
+    // verticies decode them)
+    float misc[4];
+    float color[4];
+};
+#endif
+
+// One plain quad drawn by the instanced path. The quad's corners are
+// x*matrix[0] + y*matrix[1] + matrix[2] for x, y in {0, 1}, before the
+// divide by w.
+struct instance {
+    float matrix[3][4]; // columns 0, 1 and 3 of the transform, size folded in
+    float texRegion[4]; // l, t, r, b
     float color[4];
+    float misc[4]; // same as struct vertex
 };
 
+/**
+ * Expands a vertex to floats regardless of the layout in use, for backends
+ * that read verticies on the CPU. Any output may be NULL.
+ */
+void
+vertex_unpack(struct vertex const*, float position[2], float texCoord[2],
+        float color[4], float* desaturate, int* layer, int* batch_texture);
+
+/**
+ * Builds the quad of each of `count` sites as drawer_prepare does, through
+ * site_to_affine where it applies if `affine` and the 4x4 matrix otherwise.
+ * Writes 4 verticies and 6 indicies per site and returns how many went
+ * through the affine path. For bench/bench.c.
+ */
+int
+renderer_generate_rects(struct site* sites, int count,
+        struct matrix const* projection, bool affine,
+        struct vertex* verticies, vertex_index* indicies);
+
 struct attribute {
     l2d_ident name;
     int size;
-    float* data;
+    int offset; // in floats, from the start of a vertex in attributeData
 };
 
 struct batch {
     struct vertex* verticies;
-    int vertexCount;
-    unsigned short* indicies;
+    int vertexCount; // never more than MAX_BATCH_VERTICIES
+    vertex_index* indicies;
     int indexCount;
-    struct attribute* attributes; //stretchy buffer
+    struct instance* instances;
+    int instanceCount;
+    struct attribute* attributes; // stretchy, the material's
+    // The material's attributes of every vertex, interleaved.
+    float* attributeData; // stretchy
+    int attributeStride; // floats per vertex in attributeData
+    struct batch_slot* slots; // stretchy, renderer.c's parallel build scratch
+    struct retained_frame* record; // draws are copied here if set
+    struct l2d_frame_stats* stats; // counted into if set
+};
+
+struct retained_command;
+
+// A frame's draws, kept so they can be issued again without rebuilding
+// them while the scene doesn't change. See ir_render.
+struct retained_frame {
+    struct retained_command* commands; // stretchy
+    struct vertex* verticies; // stretchy
+    vertex_index* indicies; // stretchy
+    struct instance* instances; // stretchy
+    bool valid;
+};
+
+struct sort_entry {
+    uint64_t key;
+    uint32_t seq;
+    struct l2d_drawer* drawer;
 };
 
 struct sort_cache {
-    struct l2d_drawer** buffer;
+    struct sort_entry* entries; // in draw order once sorted
+    struct sort_entry* scratch;
+    struct l2d_drawer** changed; // stretchy, drawers whose key changed
+    struct sort_entry* changed_entries; // stretchy
+    struct sort_entry* opaque; // stretchy, drawDrawerList's opaque pass
     int alloc_size;
     int drawer_count;
     bool sort_buffer_dirty;
@@ -38,11 +118,21 @@ init_sort_cache(struct sort_cache*);
 
 struct l2d_target;
 struct mat_cache_entry;
+struct grid;
+struct drawer_slab;
 struct ir {
     struct l2d_image_bank* ib;
     struct l2d_target* targetList;
-    struct l2d_drawer* drawerList;
+    struct l2d_drawer** drawers; // stretchy, drawn to the screen, any order
+    // Every drawer is carved out of these, see drawer_alloc.
+    struct drawer_slab** drawerSlabs; // stretchy
+    struct l2d_drawer** freeDrawers; // stretchy, a queue from freeDrawersHead
+    int freeDrawersHead;
     struct sort_cache sort_cache;
+    // Optional index of drawers by bounds, see ir_set_spatial_index.
+    struct grid* grid;
+    struct l2d_drawer** gridMoved; // stretchy, waiting to be re-indexed
+    void** gridQuery; // stretchy, scratch for the visible set
     struct l2d_drawer_mask* maskList;
     int viewportWidth, viewportHeight;
     float translate[3];
@@ -54,8 +144,20 @@ struct ir {
     struct shader** shaderRegistery; // stretchy buffer
 
     struct vertex* scratchVerticies;
-    unsigned short* scratchIndicies;
+    vertex_index* scratchIndicies;
+    struct instance* scratchInstances;
     struct attribute* scratchAttributes;
+    float* scratchAttributeData;
+    struct batch_slot* scratchSlots;
+
+    // Set by anything that might change the next frame.
+    bool changed;
+    int renderedViewport[2];
+    float renderedTranslate[3];
+    uint32_t renderedImageGeneration;
+    struct retained_frame retained;
+    // The last ir_render's share of l2d_scene_get_frame_stats.
+    struct l2d_frame_stats stats;
 };
 struct l2d_image;
 struct material;
@@ -69,6 +171,20 @@ ir_delete(struct ir*);
 void
 ir_render(struct ir*);
 
+/**
+ * Whether ir_render would draw anything different from the last frame.
+ */
+bool
+ir_needs_render(struct ir*);
+
+/**
+ * Indexes the drawers drawn to the screen in a grid of `cell_size` cells, so
+ * each frame only looks at the drawers near the view instead of all of
+ * them. 0 removes the index.
+ */
+void
+ir_set_spatial_index(struct ir*, float cell_size);
+
 struct l2d_drawer;
 struct l2d_drawer_mask;
 
@@ -105,6 +221,9 @@ l2d_drawer_set_color(struct l2d_drawer*, float color[4]);
 void
 l2d_drawer_setMaterial(struct l2d_drawer*, struct material*);
 
+void
+l2d_drawer_set_visible(struct l2d_drawer*, bool);
+
 void
 l2d_drawer_set_target(struct l2d_drawer*, struct l2d_target*);
 
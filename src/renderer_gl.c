@@ -4,13 +4,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stddef.h>
 #include "stretchy_buffer.h"
 #include "image_bank.h"
 #include "effect.h"
 #include "template.h"
+#include "profile.h"
 
 #define MAX_MATERIAL_IMAGE_UNIFORMS 7
 struct material {
+    int id;
     struct shader* shader;
     struct l2d_effect_stage* effect;
 
@@ -21,9 +24,33 @@ struct material {
 
     struct material_attribute* attributes; // stretchy buffer
 
-    struct material_handles handles[SHADER_VARIANT_COUNT];
+    struct material_handles** handles; // stretchy buffer
 };
 
+static struct render_api_counters counters;
+
+void
+render_api_get_counters(struct render_api_counters* out) {
+    *out = counters;
+}
+
+void
+render_api_reset_counters(void) {
+    memset(&counters, 0, sizeof(counters));
+}
+
+static
+int
+bytes_per_pixel(enum l2d_image_format format) {
+    switch (format) {
+    case l2d_IMAGE_FORMAT_RGBA_8888: return 4;
+    case l2d_IMAGE_FORMAT_RGB_888: return 3;
+    case l2d_IMAGE_FORMAT_RGB_565: return 2;
+    case l2d_IMAGE_FORMAT_A_8: return 1;
+    default: assert(false); return 0;
+    }
+}
+
 static
 GLuint
 to_gl_type(enum texture_type texture_type) {
@@ -36,9 +63,274 @@ to_gl_type(enum texture_type texture_type) {
         return GL_TEXTURE_EXTERNAL_OES;
 #endif
 #endif
+#ifndef GLES
+    case TEXTURE_2D_ARRAY:
+        return GL_TEXTURE_2D_ARRAY;
+#endif
+    default:
+        assert(false);
+    }
+}
+
+
+//
+// State cache
+//
+// Shadows the GL state set while drawing so calls that would not change
+// anything are skipped. The application is free to touch GL between frames,
+// so the shadow is only trusted from the first render_api_draw_start of a
+// frame to render_api_draw_end. Uniform values are remembered per program
+// for good, no one else uses lib2d's programs.
+//
+
+#define CACHED_TEXTURE_UNITS 8
+#define CACHED_ATTRIBS 32
+
+struct cached_uniform {
+    GLint location;
+    size_t bytes;
+    float data[16];
+};
+
+struct uniform_cache {
+    struct cached_uniform* entries; // stretchy buffer
+};
+
+struct gl_state {
+    bool active;
+    GLint program; // -1 when unknown
+    struct uniform_cache* uniforms; // of `program`, NULL when not cached
+    int activeUnit;
+    GLenum textureTypes[CACHED_TEXTURE_UNITS];
+    GLint textures[CACHED_TEXTURE_UNITS];
+    int blend;
+    int depth; // enum render_api_depth, -1 when unknown
+    bool vertexArrayBound;
+    GLint arrayBuffer;
+    GLint elementBuffer;
+    // Attribute arrays are tracked as bitmasks of locations. `wanted` collects
+    // the ones the next draw uses until state_apply_attribs.
+    uint32_t enabledAttribs;
+    uint32_t instancedAttribs;
+    uint32_t wantedAttribs;
+    uint32_t wantedInstanced;
+};
+
+static struct gl_state state;
+
+static
+void
+state_begin_frame(void) {
+    if (state.active)
+        return;
+    state.active = true;
+    state.program = -1;
+    state.uniforms = NULL;
+    state.activeUnit = -1;
+    for (int i=0; i<CACHED_TEXTURE_UNITS; i++) {
+        state.textures[i] = -1;
+    }
+    state.blend = -1;
+    state.depth = -1;
+    state.vertexArrayBound = false;
+    state.arrayBuffer = -1;
+    state.elementBuffer = -1;
+}
+
+// Counts the call as made or elided. Returns true if it can be skipped.
+static
+bool
+state_elide(bool same) {
+    if (same) {
+        counters.state_calls_elided++;
+    } else {
+        counters.state_calls++;
+    }
+    return same;
+}
+
+static
+void
+state_use_program(GLuint program, struct uniform_cache* uniforms) {
+    state.uniforms = state.active ? uniforms : NULL;
+    if (state_elide(state.active && state.program == (GLint)program))
+        return;
+    glUseProgram(program);
+    if (state.active)
+        state.program = program;
+}
+
+// Whether the uniform of the current program already holds `data`.
+// Remembers it if not, so the caller must then set it.
+static
+bool
+state_uniform_same(GLint location, void const* data, size_t bytes) {
+    if (location == -1)
+        return true;
+    if (!state.uniforms)
+        return state_elide(false);
+    assert(bytes <= sizeof(((struct cached_uniform*)0)->data));
+
+    struct cached_uniform* u = NULL;
+    for (size_t i=0; i<sbcount(state.uniforms->entries); i++) {
+        if (state.uniforms->entries[i].location == location) {
+            u = &state.uniforms->entries[i];
+            break;
+        }
+    }
+    if (u && u->bytes == bytes && memcmp(u->data, data, bytes) == 0)
+        return state_elide(true);
+    if (!u) {
+        u = sbadd(state.uniforms->entries, 1);
+        u->location = location;
+    }
+    u->bytes = bytes;
+    memcpy(u->data, data, bytes);
+    return state_elide(false);
+}
+
+static
+void
+state_active_texture(int unit) {
+    if (state_elide(state.active && state.activeUnit == unit))
+        return;
+    glActiveTexture(GL_TEXTURE0+unit);
+    if (state.active)
+        state.activeUnit = unit;
+}
+
+static
+void
+state_bind_texture(int unit, GLenum type, GLuint texture) {
+    const bool cached = state.active && unit < CACHED_TEXTURE_UNITS;
+    if (state_elide(cached && state.textures[unit] == (GLint)texture
+                && state.textureTypes[unit] == type))
+        return;
+    state_active_texture(unit);
+    glBindTexture(type, texture);
+    if (cached) {
+        state.textures[unit] = texture;
+        state.textureTypes[unit] = type;
+    }
+}
+
+// For glBindTexture calls made on whatever unit happens to be active.
+static
+void
+state_texture_bound(GLenum type, GLuint texture) {
+    if (!state.active)
+        return;
+    if (state.activeUnit >= 0 && state.activeUnit < CACHED_TEXTURE_UNITS) {
+        state.textures[state.activeUnit] = texture;
+        state.textureTypes[state.activeUnit] = type;
+    } else {
+        for (int i=0; i<CACHED_TEXTURE_UNITS; i++) {
+            state.textures[i] = -1;
+        }
+    }
+}
+
+static
+void
+state_blend(enum l2d_blend blend) {
+    if (state_elide(state.active && state.blend == (int)blend))
+        return;
+    switch (blend) {
+    case l2d_BLEND_DISABLED:
+        glDisable(GL_BLEND);
+        break;
+    case l2d_BLEND_DEFAULT:
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glEnable(GL_BLEND);
+        break;
+    case l2d_BLEND_PREMULT:
+        glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        glEnable(GL_BLEND);
+        break;
     default:
         assert(false);
     }
+    if (state.active)
+        state.blend = blend;
+}
+
+static
+void
+state_depth(enum render_api_depth depth) {
+    if (state_elide(state.active && state.depth == (int)depth))
+        return;
+    switch (depth) {
+    case DEPTH_OFF:
+        glDisable(GL_DEPTH_TEST);
+        glDepthMask(GL_TRUE);
+        break;
+    case DEPTH_WRITE:
+        glEnable(GL_DEPTH_TEST);
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+        break;
+    case DEPTH_TEST:
+        glEnable(GL_DEPTH_TEST);
+        glDepthFunc(GL_LEQUAL);
+        glDepthMask(GL_FALSE);
+        break;
+    default:
+        assert(false);
+    }
+    if (state.active)
+        state.depth = depth;
+}
+
+static
+void
+state_bind_buffer(GLenum target, GLuint buffer) {
+    GLint* bound = target == GL_ARRAY_BUFFER
+        ? &state.arrayBuffer : &state.elementBuffer;
+    if (state_elide(state.active && *bound == (GLint)buffer))
+        return;
+    glBindBuffer(target, buffer);
+    if (state.active)
+        *bound = buffer;
+}
+
+static
+void
+state_want_attrib(GLint handle, bool instanced) {
+    if (handle == -1)
+        return;
+    assert(handle < CACHED_ATTRIBS);
+    state.wantedAttribs |= 1u << handle;
+    if (instanced)
+        state.wantedInstanced |= 1u << handle;
+}
+
+// Enables the wanted attribute arrays and disables the rest.
+static
+void
+state_apply_attribs(void) {
+    for (int i=0; i<CACHED_ATTRIBS; i++) {
+        const uint32_t bit = 1u << i;
+        const bool wanted = state.wantedAttribs & bit;
+        const bool enabled = state.enabledAttribs & bit;
+        if (wanted && !state_elide(enabled)) {
+            glEnableVertexAttribArray(i);
+        } else if (!wanted && enabled) {
+            counters.state_calls++;
+            glDisableVertexAttribArray(i);
+        }
+#ifndef GLES
+        const bool instanced = state.wantedInstanced & bit;
+        if (wanted && instanced != !!(state.instancedAttribs & bit)) {
+            counters.state_calls++;
+            glVertexAttribDivisor(i, instanced ? 1 : 0);
+        }
+#endif
+    }
+    state.instancedAttribs = (state.instancedAttribs & ~state.wantedAttribs)
+        | state.wantedInstanced;
+    state.enabledAttribs = state.wantedAttribs;
+    state.wantedAttribs = 0;
+    state.wantedInstanced = 0;
 }
 
 
@@ -52,19 +344,25 @@ render_api_texture_new(enum texture_type type) {
 void
 render_api_texture_delete(uint32_t native_ptr) {
     glDeleteTextures(1, &native_ptr);
+    for (int i=0; i<CACHED_TEXTURE_UNITS; i++) {
+        if (state.textures[i] == (GLint)native_ptr)
+            state.textures[i] = -1;
+    }
 }
 
 void
 render_api_texture_bind(enum texture_type texture_type,
         uint32_t native_ptr, int32_t handle, int texture_slot,
         int pixel_size_shader_handle, int w, int h) {
-    glUniform1i(handle, texture_slot);
-    glActiveTexture(GL_TEXTURE0+texture_slot);
-    glBindTexture(to_gl_type(texture_type), native_ptr);
+    if (!state_uniform_same(handle, &texture_slot, sizeof(texture_slot)))
+        glUniform1i(handle, texture_slot);
+    state_bind_texture(texture_slot, to_gl_type(texture_type), native_ptr);
 
     // TODO This could be done in a better place
-    if (pixel_size_shader_handle != -1) {
-        glUniform2f(pixel_size_shader_handle, 1.f/w, 1.f/h);
+    float pixel_size[2] = {1.f/w, 1.f/h};
+    if (!state_uniform_same(pixel_size_shader_handle, pixel_size,
+                sizeof(pixel_size))) {
+        glUniform2f(pixel_size_shader_handle, pixel_size[0], pixel_size[1]);
     }
 }
 
@@ -72,6 +370,7 @@ void
 render_api_texture_upload(struct render_api_upload_info* u) {
     GLuint type = to_gl_type(u->texture_type);
     glBindTexture(type, u->native_ptr);
+    state_texture_bound(type, u->native_ptr);
     if (u->clamp) {
         glTexParameteri(type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         glTexParameteri(type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
@@ -104,8 +403,22 @@ render_api_texture_upload(struct render_api_upload_info* u) {
     }
 
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+#ifndef GLES
+    if (u->update_layer) {
+        glTexSubImage3D(type, 0, 0, 0, u->layer, u->width, u->height, 1,
+                glformat, gltype, u->data);
+    } else if (u->layers) {
+        glTexImage3D(type, 0, glformat, u->width, u->height, u->layers, 0,
+                glformat, gltype, u->data);
+    } else
+#endif
     glTexImage2D(type, 0, glformat, u->width, u->height, 0, glformat, gltype,
             u->data);
+
+    counters.texture_uploads++;
+    if (u->data)
+        counters.texture_bytes += u->width*u->height*bytes_per_pixel(u->format)
+            *(u->layers && !u->update_layer ? u->layers : 1);
 }
 
 
@@ -114,87 +427,453 @@ render_api_get_viewport(int res[4]) {
     glGetIntegerv(GL_VIEWPORT, res);
 }
 
+uint32_t
+render_api_framebuffer_new(void) {
+    GLuint fbo = 0;
+    glGenFramebuffers(1, &fbo);
+    return fbo;
+}
+
+bool
+render_api_framebuffer_attach(uint32_t fbo, uint32_t texture_native_ptr) {
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    if (!texture_native_ptr)
+        return false;
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_TEXTURE_2D, texture_native_ptr, 0);
+    return true;
+}
+
+static int current_fbo;
+
 void
 render_api_draw_start(int fbo_target, int viewport_w, int viewport_h) {
+    state_begin_frame();
     glBindFramebuffer(GL_FRAMEBUFFER, fbo_target);
     glViewport(0,0, viewport_w, viewport_h);
     glDisable(GL_CULL_FACE);
+    state_depth(DEPTH_OFF);
+    current_fbo = fbo_target;
+}
+
+bool
+render_api_has_depth(void) {
+    // Targets are color only. Whether the application's framebuffer has
+    // depth doesn't change, so it is only asked once.
+    if (current_fbo != 0)
+        return false;
+    static int depth_bits = -1;
+    if (depth_bits == -1) {
+        GLint bits = 0;
+#ifdef GLES
+        glGetIntegerv(GL_DEPTH_BITS, &bits);
+#else
+        glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, GL_DEPTH,
+                GL_FRAMEBUFFER_ATTACHMENT_DEPTH_SIZE, &bits);
+        if (glGetError() != GL_NO_ERROR)
+            bits = 0;
+#endif
+        depth_bits = bits;
+    }
+    return depth_bits > 0;
+}
+
+void
+render_api_clear_depth(void) {
+    // Clearing ignores the depth test but not the write mask.
+    state_depth(DEPTH_OFF);
+    glClear(GL_DEPTH_BUFFER_BIT);
+}
+
+void
+render_api_set_depth(enum render_api_depth depth) {
+    state_depth(depth);
+}
+
+//
+// Streaming vertex and index buffers
+//
+// Batches are copied into a pair of ring buffers instead of being drawn from
+// client memory. Each ring is split into STREAM_REGIONS regions; a fence is
+// dropped when writing moves out of a region and waited on before the region
+// is written again, so mapping can skip the driver's own synchronization.
+// GLES 2 has neither mapping nor fences and orphans the buffer on wrap.
+//
+
+#define STREAM_REGIONS 4
+#define STREAM_ALIGN 16
+
+struct stream_buffer {
+    GLenum target;
+    GLuint buffer;
+    size_t size;
+    size_t head;
+    int region;
+#ifndef GLES
+    GLsync fences[STREAM_REGIONS];
+#endif
+};
+
+static struct stream_buffer vertex_stream = {GL_ARRAY_BUFFER, 0, 1<<20};
+static struct stream_buffer index_stream = {GL_ELEMENT_ARRAY_BUFFER, 0, 1<<18};
+#ifndef GLES
+static GLuint stream_vao;
+#endif
+
+static
+void
+stream_allocate(struct stream_buffer* s, size_t size) {
+#ifndef GLES
+    for (int i=0; i<STREAM_REGIONS; i++) {
+        if (s->fences[i]) {
+            glDeleteSync(s->fences[i]);
+            s->fences[i] = 0;
+        }
+    }
+#endif
+    if (!s->buffer) {
+        glGenBuffers(1, &s->buffer);
+    }
+    state_bind_buffer(s->target, s->buffer);
+    glBufferData(s->target, size, NULL, GL_STREAM_DRAW);
+    s->size = size;
+    s->head = 0;
+    s->region = 0;
+}
+
+// Makes sure `bytes` of writes can go in without wrapping onto data that
+// hasn't been drawn yet, growing the ring if it is too small.
+static
+void
+stream_reserve(struct stream_buffer* s, size_t bytes) {
+    if (!s->buffer) {
+        stream_allocate(s, s->size);
+    }
+    if (bytes > s->size/STREAM_REGIONS) {
+        size_t size = s->size;
+        while (bytes > size/STREAM_REGIONS) size *= 2;
+        stream_allocate(s, size);
+    }
 }
 
+#ifndef GLES
+static
+void
+stream_enter_region(struct stream_buffer* s, int region) {
+    s->fences[s->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    s->region = region;
+    if (s->fences[region]) {
+        glClientWaitSync(s->fences[region], GL_SYNC_FLUSH_COMMANDS_BIT,
+                (GLuint64)1000000000);
+        glDeleteSync(s->fences[region]);
+        s->fences[region] = 0;
+    }
+}
+#endif
+
+// Copies data into the ring and returns its offset in the buffer.
+static
+size_t
+stream_write(struct stream_buffer* s, void const* data, size_t bytes) {
+    const size_t region_size = s->size/STREAM_REGIONS;
+    const size_t aligned = (bytes + STREAM_ALIGN-1) & ~(size_t)(STREAM_ALIGN-1);
+    state_bind_buffer(s->target, s->buffer);
+
+    if (s->head + aligned > s->size) {
+        s->head = 0;
+#ifdef GLES
+        glBufferData(s->target, s->size, NULL, GL_STREAM_DRAW);
+#else
+        stream_enter_region(s, 0);
+#endif
+    }
+#ifndef GLES
+    const int last_region = (int)((s->head + aligned - 1)/region_size);
+    while (s->region < last_region) {
+        stream_enter_region(s, s->region+1);
+    }
+#endif
+
+    size_t offset = s->head;
+    s->head += aligned;
+#ifdef GLES
+    glBufferSubData(s->target, offset, bytes, data);
+#else
+    void* dest = glMapBufferRange(s->target, offset, bytes,
+            GL_MAP_WRITE_BIT
+            | GL_MAP_INVALIDATE_RANGE_BIT
+            | GL_MAP_UNSYNCHRONIZED_BIT);
+    if (dest) {
+        memcpy(dest, data, bytes);
+        glUnmapBuffer(s->target);
+    } else {
+        glBufferSubData(s->target, offset, bytes, data);
+    }
+#endif
+    return offset;
+}
+
+bool
+render_api_supports_instancing(void) {
+#ifdef GLES
+    return false;
+#else
+    static int supported = -1;
+    if (supported == -1) {
+        int major = 0, minor = 0;
+        const char* version = (const char*)glGetString(GL_VERSION);
+        if (version) sscanf(version, "%d.%d", &major, &minor);
+        supported = major > 3 || (major == 3 && minor >= 3);
+    }
+    return supported;
+#endif
+}
+
+bool
+render_api_supports_texture_arrays(void) {
+#ifdef GLES
+    return false;
+#else
+    // The shaders sample them through GL_EXT_texture_array, core in 3.0.
+    static int supported = -1;
+    if (supported == -1) {
+        int major = 0;
+        const char* version = (const char*)glGetString(GL_VERSION);
+        if (version) sscanf(version, "%d", &major);
+        supported = major >= 3;
+    }
+    return supported;
+#endif
+}
+
+int
+render_api_max_texture_layers(void) {
+#ifdef GLES
+    return 1;
+#else
+    static GLint max_layers = 0;
+    if (max_layers == 0) {
+        glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+        if (max_layers < 1) max_layers = 1;
+    }
+    return max_layers;
+#endif
+}
+
+int
+render_api_max_batch_textures(void) {
+    // Leave units for texture2, the mask and material images.
+    static int max = -1;
+    if (max == -1) {
+        GLint units = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS, &units);
+        max = units - 2 - MAX_MATERIAL_IMAGE_UNIFORMS;
+        if (max > MAX_BATCH_TEXTURES) max = MAX_BATCH_TEXTURES;
+        if (max < 1) max = 1;
+    }
+    return max;
+}
+
+#ifndef GLES
+static GLuint quad_corners;
+static GLuint quad_indicies;
+
+static
+void
+instance_attrib(GLint handle, size_t offset) {
+    if (handle == -1) return;
+    glVertexAttribPointer(handle, 4, GL_FLOAT, GL_FALSE,
+            sizeof(struct instance), (void*)offset);
+    state_want_attrib(handle, true);
+}
+
+static
+void
+draw_instances(struct batch* batch, struct shader_handles* shader) {
+    if (!quad_corners) {
+        static const float corners[] = {0.f,0.f, 1.f,0.f, 1.f,1.f, 0.f,1.f};
+        static const unsigned short indicies[] = {0,1,2, 0,2,3};
+        glGenBuffers(1, &quad_corners);
+        state_bind_buffer(GL_ARRAY_BUFFER, quad_corners);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners,
+                GL_STATIC_DRAW);
+        glGenBuffers(1, &quad_indicies);
+        state_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, quad_indicies);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indicies), indicies,
+                GL_STATIC_DRAW);
+    }
+
+    size_t bytes = batch->instanceCount*sizeof(struct instance);
+    stream_reserve(&vertex_stream, bytes + STREAM_ALIGN);
+    uintptr_t offset = stream_write(&vertex_stream, batch->instances, bytes);
+
+    instance_attrib(shader->instanceXAttrib,
+            offset + offsetof(struct instance, matrix[0]));
+    instance_attrib(shader->instanceYAttrib,
+            offset + offsetof(struct instance, matrix[1]));
+    instance_attrib(shader->instanceWAttrib,
+            offset + offsetof(struct instance, matrix[2]));
+    instance_attrib(shader->texRegionAttrib,
+            offset + offsetof(struct instance, texRegion));
+    instance_attrib(shader->colorAttrib,
+            offset + offsetof(struct instance, color));
+    instance_attrib(shader->miscAttrib,
+            offset + offsetof(struct instance, misc));
+
+    state_bind_buffer(GL_ARRAY_BUFFER, quad_corners);
+    glVertexAttribPointer(shader->cornerAttrib, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    state_want_attrib(shader->cornerAttrib, false);
+    state_apply_attribs();
+
+    state_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, quad_indicies);
+    glDrawElementsInstanced(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0,
+            batch->instanceCount);
+
+    counters.draw_calls++;
+    counters.vertices += batch->instanceCount*4;
+    counters.indices += batch->instanceCount*6;
+    counters.vertex_bytes += bytes;
+}
+#endif
+
 void
 render_api_draw_batch(struct batch* batch,
         struct shader_handles* shader,
         struct material* material, struct material_handles* h,
         enum l2d_blend blend) {
-    switch (blend) {
-    case l2d_BLEND_DISABLED:
-        glDisable(GL_BLEND);
-        break;
-    case l2d_BLEND_DEFAULT:
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glEnable(GL_BLEND);
-        break;
-    case l2d_BLEND_PREMULT:
-        glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-        glEnable(GL_BLEND);
-        break;
-    default:
-        assert(false);
+    state_blend(blend);
+
+#ifndef GLES
+    if (!stream_vao) {
+        glGenVertexArrays(1, &stream_vao);
     }
+    if (!state_elide(state.active && state.vertexArrayBound)) {
+        glBindVertexArray(stream_vao);
+        // The element buffer binding belongs to the vertex array.
+        state.elementBuffer = -1;
+        state.vertexArrayBound = state.active;
+    }
+
+    if (batch->instanceCount) {
+        draw_instances(batch, shader);
+        return;
+    }
+#endif
+
+    size_t vertex_bytes = batch->vertexCount*sizeof(struct vertex);
+    size_t index_bytes = batch->indexCount*sizeof(vertex_index);
+    size_t attribute_stride = batch->attributeStride*sizeof(float);
+    size_t attribute_bytes = batch->vertexCount*attribute_stride;
 
-    struct vertex* v = batch->verticies;
+    stream_reserve(&vertex_stream,
+            vertex_bytes + attribute_bytes + 2*STREAM_ALIGN);
+    stream_reserve(&index_stream, index_bytes + STREAM_ALIGN);
 
+    uintptr_t vertex_offset = stream_write(&vertex_stream,
+            batch->verticies, vertex_bytes);
+
+#ifdef PACKED_VERTICES
+    // Normalized attributes decode back to the same [0, 1] floats the
+    // shaders see with the float layout; position.zw default to 0, 1.
+    glVertexAttribPointer(shader->positionHandle,
+            2, GL_FLOAT, GL_FALSE, sizeof(struct vertex),
+            (void*)(vertex_offset + offsetof(struct vertex, position)));
+    glVertexAttribPointer(shader->texCoordHandle,
+            2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(struct vertex),
+            (void*)(vertex_offset + offsetof(struct vertex, texCoord)));
+    glVertexAttribPointer(shader->colorAttrib,
+            4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(struct vertex),
+            (void*)(vertex_offset + offsetof(struct vertex, color)));
+#else
     glVertexAttribPointer(shader->positionHandle,
             4, GL_FLOAT, GL_FALSE, sizeof(struct vertex),
-            &v[0].position[0]);
+            (void*)(vertex_offset + offsetof(struct vertex, position)));
     glVertexAttribPointer(shader->texCoordHandle,
             2, GL_FLOAT, GL_FALSE, sizeof(struct vertex),
-            &v[0].texCoord[0]);
+            (void*)(vertex_offset + offsetof(struct vertex, texCoord)));
     glVertexAttribPointer(shader->colorAttrib,
             4, GL_FLOAT, GL_FALSE, sizeof(struct vertex),
-            &v[0].color[0]);
-    glEnableVertexAttribArray(shader->positionHandle);
-    glEnableVertexAttribArray(shader->texCoordHandle);
-    glEnableVertexAttribArray(shader->colorAttrib);
+            (void*)(vertex_offset + offsetof(struct vertex, color)));
+#endif
+    state_want_attrib(shader->positionHandle, false);
+    state_want_attrib(shader->texCoordHandle, false);
+    state_want_attrib(shader->colorAttrib, false);
 
     if (shader->miscAttrib != -1) {
+#ifdef PACKED_VERTICES
+        glVertexAttribPointer(shader->miscAttrib,
+                4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(struct vertex),
+                (void*)(vertex_offset + offsetof(struct vertex, misc)));
+#else
         glVertexAttribPointer(shader->miscAttrib,
                 4, GL_FLOAT, GL_FALSE, sizeof(struct vertex),
-                &v[0].misc[0]);
-        glEnableVertexAttribArray(shader->miscAttrib);
+                (void*)(vertex_offset + offsetof(struct vertex, misc)));
+#endif
+        state_want_attrib(shader->miscAttrib, false);
     }
 
+    // The material's attributes share one interleaved stream.
+    uintptr_t attribute_offset = 0;
+    if (attribute_bytes) {
+        attribute_offset = stream_write(&vertex_stream,
+                batch->attributeData, attribute_bytes);
+    }
     for (size_t i=0; i<sbcount(material->attributes); i++) {
         GLint handle = h->attributes[i];
         if (handle == -1)
             continue;
-        size_t size = batch->attributes[i].size;
-        float* data = batch->attributes[i].data;
-        glVertexAttribPointer(handle, size, GL_FLOAT, GL_FALSE,
-                sizeof(float)*size, data);
-        glEnableVertexAttribArray(handle);
+        struct attribute const* a = &batch->attributes[i];
+        glVertexAttribPointer(handle, a->size, GL_FLOAT, GL_FALSE,
+                attribute_stride,
+                (void*)(attribute_offset + a->offset*sizeof(float)));
+        state_want_attrib(handle, false);
     }
+    state_apply_attribs();
 
+    size_t index_offset = stream_write(&index_stream, batch->indicies,
+            index_bytes);
     glDrawElements(GL_TRIANGLES, batch->indexCount,
-            GL_UNSIGNED_SHORT, batch->indicies);
-
-    glDisableVertexAttribArray(shader->positionHandle);
-    glDisableVertexAttribArray(shader->texCoordHandle);
-    if (shader->miscAttrib != -1)
-        glDisableVertexAttribArray(shader->miscAttrib);
-    glDisableVertexAttribArray(shader->colorAttrib);
+            sizeof(vertex_index) == 4 ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT,
+            (void*)(uintptr_t)index_offset);
+
+    counters.draw_calls++;
+    counters.vertices += batch->vertexCount;
+    counters.indices += batch->indexCount;
+    counters.vertex_bytes += vertex_bytes + attribute_bytes;
+    counters.index_bytes += index_bytes;
+}
 
-    for (size_t i=0; i<sbcount(material->attributes); i++) {
-        GLint handle = h->attributes[i];
-        if (handle == -1)
-            continue;
-        glDisableVertexAttribArray(handle);
-    }
+void
+render_api_set_float(int32_t handle, float x) {
+    if (!state_uniform_same(handle, &x, sizeof(x)))
+        glUniform1f(handle, x);
 }
 
 void
 render_api_set_vec(int32_t handle, float x, float y, float z, float w) {
-    glUniform4f(handle, x, y, z, w);
+    float v[4] = {x, y, z, w};
+    if (!state_uniform_same(handle, v, sizeof(v)))
+        glUniform4f(handle, x, y, z, w);
+}
+
+void
+render_api_set_matrix(int32_t handle, float const m[16]) {
+    if (!state_uniform_same(handle, m, 16*sizeof(float)))
+        glUniformMatrix4fv(handle, 1, GL_FALSE, m);
+}
+
+void
+render_api_draw_end(void) {
+    // Leave the client array state as the application had it.
+    state_apply_attribs();
+    state_depth(DEPTH_OFF);
+#ifndef GLES
+    glBindVertexArray(0);
+#endif
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    state.active = false;
+    state.uniforms = NULL;
 }
 
 
@@ -235,15 +914,50 @@ static const char* defaultVertexSource =
         "varying vec2 texCoord_v;\n"
         "varying float alpha_v;\n"
         "varying vec4 color_v;\n"
+        "uniform float depth;\n"
         "MASK_VERTEX_HEAD"
         "DESATURATE_VERTEX_HEAD"
+        "LAYER_VERTEX_HEAD"
+        "MULTI_TEXTURE_VERTEX_HEAD"
         "void main() {\n"
         "    texCoord_v = texCoord;\n"
         "    color_v = vec4(colorAttrib.rgb, 1.0);\n"
         "    alpha_v = colorAttrib.a;\n"
-        "    gl_Position = position;\n"
+        "    gl_Position = vec4(position.xy, depth, position.w);\n"
+        "MASK_VERTEX_BODY"
+        "DESATURATE_VERTEX_BODY"
+        "LAYER_VERTEX_BODY"
+        "MULTI_TEXTURE_VERTEX_BODY"
+        "}\n";
+// Used for SHADER_INSTANCED variants in place of the shader's own vertex
+// source. Declares `position` so the mask body works unchanged.
+static const char* instancedVertexSource =
+        "attribute vec2 corner;\n"
+        "attribute vec4 instanceX;\n"
+        "attribute vec4 instanceY;\n"
+        "attribute vec4 instanceW;\n"
+        "attribute vec4 texRegion;\n"
+        "attribute vec4 miscAttrib;\n"
+        "attribute vec4 colorAttrib;\n"
+        "varying vec2 texCoord_v;\n"
+        "varying float alpha_v;\n"
+        "varying vec4 color_v;\n"
+        "uniform float depth;\n"
+        "MASK_VERTEX_HEAD"
+        "DESATURATE_VERTEX_HEAD"
+        "LAYER_VERTEX_HEAD"
+        "MULTI_TEXTURE_VERTEX_HEAD"
+        "void main() {\n"
+        "    vec4 p = instanceX*corner.x + instanceY*corner.y + instanceW;\n"
+        "    vec4 position = vec4(p.xy/p.w, 0.0, 1.0);\n"
+        "    texCoord_v = mix(texRegion.xy, texRegion.zw, corner);\n"
+        "    color_v = vec4(colorAttrib.rgb, 1.0);\n"
+        "    alpha_v = colorAttrib.a;\n"
+        "    gl_Position = vec4(position.xy, depth, position.w);\n"
         "MASK_VERTEX_BODY"
         "DESATURATE_VERTEX_BODY"
+        "LAYER_VERTEX_BODY"
+        "MULTI_TEXTURE_VERTEX_BODY"
         "}\n";
 static const char* defaultFragmentSource =
 #ifdef GLES
@@ -257,8 +971,9 @@ static const char* defaultFragmentSource =
         "uniform vec2 texturePixelSize;\n"
         "MASK_FRAGMENT_HEAD"
         "DESATURATE_FRAGMENT_HEAD"
+        "MULTI_TEXTURE_FRAGMENT_HEAD"
         "void main() {\n"
-        "    vec4 tex = texture2D(texture, texCoord_v);\n"
+        "    vec4 tex = SAMPLE_TEXTURE;\n"
         "EFFECT_FRAGMENT_BODY"
         "    gl_FragColor = gl_FragColor*color_v*vec4(1.0, 1.0, 1.0, alpha_v);\n"
         "MASK_FRAGMENT_BODY"
@@ -276,8 +991,9 @@ static const char* premultFragmentSource =
         "uniform vec2 texturePixelSize;\n"
         "MASK_FRAGMENT_HEAD"
         "DESATURATE_FRAGMENT_HEAD"
+        "MULTI_TEXTURE_FRAGMENT_HEAD"
         "void main() {\n"
-        "    vec4 tex = texture2D(texture, texCoord_v);\n"
+        "    vec4 tex = SAMPLE_TEXTURE;\n"
         "EFFECT_FRAGMENT_BODY"
         "    gl_FragColor = gl_FragColor*color_v*alpha_v;\n"
         "MASK_FRAGMENT_BODY"
@@ -295,8 +1011,9 @@ static const char* singleChannelFragmentSource =
         "uniform vec2 texturePixelSize;\n"
         "MASK_FRAGMENT_HEAD"
         "DESATURATE_FRAGMENT_HEAD"
+        "MULTI_TEXTURE_FRAGMENT_HEAD"
         "void main() {\n"
-        "    vec4 tex = vec4(1.0, 1.0, 1.0, texture2D(texture, texCoord_v).a);\n"
+        "    vec4 tex = vec4(1.0, 1.0, 1.0, SAMPLE_TEXTURE.a);\n"
         "EFFECT_FRAGMENT_BODY"
         "    gl_FragColor = gl_FragColor*color_v*alpha_v;\n"
         "MASK_FRAGMENT_BODY"
@@ -329,7 +1046,7 @@ static struct template_var desaturate_vars[] = {
         "varying float desaturate_v;\n"
     },
     {"DESATURATE_VERTEX_BODY",
-        "desaturate_v=miscAttrib[0];\n"
+        "desaturate_v=miscAttrib[1];\n"
     },
     {"DESATURATE_FRAGMENT_HEAD",
         "varying float desaturate_v;\n"
@@ -342,9 +1059,90 @@ static struct template_var desaturate_vars[] = {
     {0,0}
 };
 
+// The layer of SHADER_TEXTURE_ARRAY variants comes in as miscAttrib[2]*255.
+// texture2D is redirected to an overload that also takes array samplers, so
+// effect stages sampling `texture` keep working unchanged.
+static struct template_var layer_vars[] = {
+    {"LAYER_VERTEX_HEAD",
+        "varying float layer_v;\n"
+    },
+    {"LAYER_VERTEX_BODY",
+        "layer_v = floor(miscAttrib[2]*255.0 + 0.5);\n"
+    },
+    {"SAMPLER0", "sampler2DArray"},
+    {0,0}
+};
+
+static const char* textureArrayPrefix =
+        "#extension GL_EXT_texture_array : require\n";
+
+static const char* layerFragmentPrefix =
+        "#extension GL_EXT_texture_array : require\n"
+        "varying float layer_v;\n"
+        "vec4 l2d_texture2D(sampler2D s, vec2 c) {\n"
+        "    return texture2D(s, c);\n"
+        "}\n"
+        "vec4 l2d_texture2D(sampler2DArray s, vec2 c) {\n"
+        "    return texture2DArray(s, vec3(c, layer_v));\n"
+        "}\n"
+        "#define texture2D l2d_texture2D\n";
+
+static struct template_var mask_array_vars[] = {
+    {"MASK_FRAGMENT_HEAD",
+        "varying vec2 maskTextureCoord;\n"
+        "uniform sampler2DArray maskTexture;\n"
+        "uniform float maskLayer;\n"},
+    {"MASK_FRAGMENT_BODY",
+        "gl_FragColor *= texture2DArray(maskTexture, "
+            "vec3(maskTextureCoord, maskLayer)).a;\n"
+    },
+    {0,0}
+};
+
+// Samplers can't be indexed by a varying, so SHADER_MULTI_TEXTURE variants
+// branch on the vertex's batch texture, which comes in as miscAttrib[3]*255.
+// Only drawers without effects use them, nothing else samples `texture`.
+static struct template_var multi_texture_vars[] = {
+    {"MULTI_TEXTURE_VERTEX_HEAD",
+        "varying float batchTexture_v;\n"
+    },
+    {"MULTI_TEXTURE_VERTEX_BODY",
+        "batchTexture_v = floor(miscAttrib[3]*255.0 + 0.5);\n"
+    },
+    {"MULTI_TEXTURE_FRAGMENT_HEAD",
+        "varying float batchTexture_v;\n"
+        "uniform sampler2D batchTexture1;\n"
+        "uniform sampler2D batchTexture2;\n"
+        "uniform sampler2D batchTexture3;\n"
+        "uniform sampler2D batchTexture4;\n"
+        "uniform sampler2D batchTexture5;\n"
+        "uniform sampler2D batchTexture6;\n"
+        "uniform sampler2D batchTexture7;\n"
+        "vec4 sampleBatchTexture(vec2 c) {\n"
+        "    if (batchTexture_v < 0.5) return texture2D(texture, c);\n"
+        "    if (batchTexture_v < 1.5) return texture2D(batchTexture1, c);\n"
+        "    if (batchTexture_v < 2.5) return texture2D(batchTexture2, c);\n"
+        "    if (batchTexture_v < 3.5) return texture2D(batchTexture3, c);\n"
+        "    if (batchTexture_v < 4.5) return texture2D(batchTexture4, c);\n"
+        "    if (batchTexture_v < 5.5) return texture2D(batchTexture5, c);\n"
+        "    if (batchTexture_v < 6.5) return texture2D(batchTexture6, c);\n"
+        "    return texture2D(batchTexture7, c);\n"
+        "}\n"
+    },
+    {"SAMPLE_TEXTURE", "sampleBatchTexture(texCoord_v)"},
+    {0,0}
+};
+
+// A program made from a shader for one variant, the first time it's used.
+struct shader_variant {
+    unsigned int variant;
+    struct shader_handles handles;
+    struct uniform_cache uniforms;
+};
+
 struct shader {
     l2d_ident name;
-    struct shader_handles handles[SHADER_VARIANT_COUNT];
+    struct shader_variant** variants; // stretchy buffer
     const char* vertexSource;
     const char* fragmentSource;
 };
@@ -370,9 +1168,26 @@ update_vars(struct template_var* dest, struct template_var const* src) {
     }
 }
 
+static
+struct shader_variant*
+shader_get_variant(struct shader* shader, unsigned int variant) {
+    assert(variant < SHADER_VARIANT_COUNT);
+    for (int i=0; i<sbcount(shader->variants); i++) {
+        if (shader->variants[i]->variant == variant) {
+            return shader->variants[i];
+        }
+    }
+    struct shader_variant* v = calloc(1, sizeof(struct shader_variant));
+    v->variant = variant;
+    sbpush(shader->variants, v);
+    return v;
+}
+
 static
 void
-loadProgram(struct shader* program, unsigned int variant, struct l2d_effect_stage* stage) {
+loadProgram(struct shader* program, unsigned int variant,
+        struct shader_handles* h, struct l2d_effect_stage* stage) {
+    PROFILE_BEGIN(loadProgram);
     const char* fragmentPrefix = "";
 
     struct template_var vars[] = {
@@ -386,6 +1201,12 @@ loadProgram(struct shader* program, unsigned int variant, struct l2d_effect_stag
         {"DESATURATE_VERTEX_BODY",""},
         {"DESATURATE_FRAGMENT_HEAD",""},
         {"DESATURATE_FRAGMENT_BODY",""},
+        {"LAYER_VERTEX_HEAD",""},
+        {"LAYER_VERTEX_BODY",""},
+        {"MULTI_TEXTURE_VERTEX_HEAD",""},
+        {"MULTI_TEXTURE_VERTEX_BODY",""},
+        {"MULTI_TEXTURE_FRAGMENT_HEAD",""},
+        {"SAMPLE_TEXTURE","texture2D(texture, texCoord_v)"},
         {"EFFECT_FRAGMENT_BODY",  "gl_FragColor = tex;\n"},
         {0,0}};
 
@@ -429,12 +1250,26 @@ loadProgram(struct shader* program, unsigned int variant, struct l2d_effect_stag
         update_vars(vars, desaturate_vars);
     }
 
+    // Never combined with SHADER_EXTERNAL_IMAGE, GLES has no arrays.
+    if (variant & SHADER_MASK_ARRAY) {
+        fragmentPrefix = textureArrayPrefix;
+        update_vars(vars, mask_array_vars);
+    }
+
+    if (variant & SHADER_TEXTURE_ARRAY) {
+        fragmentPrefix = layerFragmentPrefix;
+        update_vars(vars, layer_vars);
+    }
+
+    if (variant & SHADER_MULTI_TEXTURE) {
+        update_vars(vars, multi_texture_vars);
+    }
+
     char* fragSource = replace_vars(vars, program->fragmentSource,
             fragmentPrefix);
 
-    char* vertSource = replace_vars(vars, program->vertexSource, "");
-
-    struct shader_handles* h = &program->handles[variant];
+    char* vertSource = replace_vars(vars, (variant & SHADER_INSTANCED)
+            ? instancedVertexSource : program->vertexSource, "");
 
     h->id = glCreateProgram();
     glAttachShader(h->id,
@@ -442,7 +1277,8 @@ loadProgram(struct shader* program, unsigned int variant, struct l2d_effect_stag
     glAttachShader(h->id,
             compileShader(GL_FRAGMENT_SHADER, fragSource));
     glLinkProgram(h->id);
-    glUseProgram(h->id);
+    state_use_program(h->id, NULL);
+    counters.programs_compiled++;
 
     GLint logLength;
     glGetProgramiv(h->id, GL_INFO_LOG_LENGTH, &logLength);
@@ -467,26 +1303,46 @@ loadProgram(struct shader* program, unsigned int variant, struct l2d_effect_stag
     h->maskTextureCoordMat = glGetUniformLocation(h->id,
             "maskTextureCoordMat");
     h->eyePos = glGetUniformLocation(h->id, "eyePos");
+    h->maskLayer = glGetUniformLocation(h->id, "maskLayer");
+    h->depth = glGetUniformLocation(h->id, "depth");
+    h->cornerAttrib = glGetAttribLocation(h->id, "corner");
+    h->instanceXAttrib = glGetAttribLocation(h->id, "instanceX");
+    h->instanceYAttrib = glGetAttribLocation(h->id, "instanceY");
+    h->instanceWAttrib = glGetAttribLocation(h->id, "instanceW");
+    h->texRegionAttrib = glGetAttribLocation(h->id, "texRegion");
+    h->batchTextures[0] = h->textureHandle;
+    for (int i=1; i<MAX_BATCH_TEXTURES; i++) {
+        char name[32];
+        sprintf(name, "batchTexture%i", i);
+        h->batchTextures[i] = glGetUniformLocation(h->id, name);
+    }
 
     free(vertSource);
     free(fragSource);
     if (effect_body) free(effect_body);
+    PROFILE_END(loadProgram);
 }
 
 static
-void
-material_handles_init(struct material_handles* h) {
+struct material_handles*
+material_variant_handles(struct material* m, unsigned int variant) {
+    for (int i=0; i<sbcount(m->handles); i++) {
+        if (m->handles[i]->variant == variant) {
+            return m->handles[i];
+        }
+    }
+    struct material_handles* h = calloc(1, sizeof(struct material_handles));
+    h->variant = variant;
     h->invalid = true;
-    h->imageUniforms = NULL;
-    h->podUniforms = NULL;
-    h->attributes = NULL;
+    sbpush(m->handles, h);
+    return h;
 }
 
 static
 void
 material_invalidate_handles(struct material* m) {
-    for (unsigned int i=0; i<SHADER_VARIANT_COUNT; i++) {
-        m->handles[i].invalid = true;
+    for (int i=0; i<sbcount(m->handles); i++) {
+        m->handles[i]->invalid = true;
     }
 }
 
@@ -519,9 +1375,8 @@ materialRefreshShaderHandlesVariant(struct material* m,
 
 static
 void
-materialSetUpUniforms(struct material* m, unsigned int shader_variant,
+materialSetUpUniforms(struct material* m, struct material_handles* h,
         int* next_texture_slot) {
-    struct material_handles* h = &m->handles[shader_variant];
 
     for (int i=0; i<m->imageUniformCount; i++) {
         struct material_image_uniform* entry = &m->imageUniforms[i];
@@ -534,6 +1389,9 @@ materialSetUpUniforms(struct material* m, unsigned int shader_variant,
             glUniform1fv, glUniform2fv, glUniform3fv, glUniform4fv};
     for (int i=0; i<sbcount(m->podUniforms); i++) {
         struct material_pod_uniform* entry = &m->podUniforms[i];
+        if (state_uniform_same(h->podUniforms[i], entry->floats,
+                    entry->size*sizeof(float)))
+            continue;
         uniformAPICalls[entry->size - 1](h->podUniforms[i], 1, entry->floats);
     }
 }
@@ -550,18 +1408,23 @@ shader_new(const char* vertexSource, const char* fragSource) {
 
 struct material*
 render_api_material_new(struct shader* shader, struct l2d_effect_stage* effect) {
+    static int next_id = 1;
     struct material* material = malloc(sizeof(struct material));
+    material->id = next_id++;
     material->shader = shader;
     material->effect = effect;
     material->imageUniformCount = 0;
     material->podUniforms = NULL;
     material->attributes = NULL;
-    for (unsigned int i=0; i<SHADER_VARIANT_COUNT; i++) {
-        material_handles_init(&material->handles[i]);
-    }
+    material->handles = NULL;
     return material;
 }
 
+int
+render_api_material_get_id(struct material* m) {
+    return m->id;
+}
+
 struct material_attribute*
 render_api_get_attributes(struct material* m, int* count) {
     *count = sbcount(m->attributes);
@@ -640,17 +1503,18 @@ render_api_material_use(struct material* m, unsigned int shader_variant,
         struct shader_handles** sh, struct material_handles** mh,
         int* next_texture_slot) {
 
-    *sh = &m->shader->handles[shader_variant];
+    struct shader_variant* v = shader_get_variant(m->shader, shader_variant);
+    *sh = &v->handles;
     if ((*sh)->id == 0) {
-        loadProgram(m->shader, shader_variant, m->effect);
+        loadProgram(m->shader, shader_variant, *sh, m->effect);
     }
-    *mh = &m->handles[shader_variant];
+    *mh = material_variant_handles(m, shader_variant);
     if ((*mh)->invalid) {
         materialRefreshShaderHandlesVariant(m, *sh, *mh);
     }
 
-    glUseProgram((*sh)->id);
-    materialSetUpUniforms(m, shader_variant, next_texture_slot);
+    state_use_program((*sh)->id, &v->uniforms);
+    materialSetUpUniforms(m, *mh, next_texture_slot);
 }
 
 struct shader*
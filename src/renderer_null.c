@@ -0,0 +1,361 @@
+#include "render_api.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stretchy_buffer.h"
+#include "image_bank.h"
+#include "effect.h"
+#include "profile.h"
+
+// Headless backend. Every call is accepted and accounted for in the counters,
+// but nothing is ever sent to a GPU. Useful for profiling the CPU side of a
+// frame on machines without a GL context.
+
+struct material_pod_uniform {
+    float floats[4];
+    int size;
+    const char* name;
+};
+
+struct material {
+    int id;
+    struct shader* shader;
+    struct l2d_effect_stage* effect;
+
+    struct material_pod_uniform* podUniforms; // stretchy buffer
+
+    struct material_attribute* attributes; // stretchy buffer
+
+    struct material_handles** handles; // stretchy buffer
+};
+
+struct shader_variant {
+    unsigned int variant;
+    struct shader_handles handles;
+};
+
+struct shader {
+    struct shader_variant** variants; // stretchy buffer
+};
+
+static struct render_api_counters counters;
+static uint32_t next_native_ptr = 1;
+static int viewport[4] = {0, 0, 1, 1};
+
+void
+render_api_get_counters(struct render_api_counters* out) {
+    *out = counters;
+}
+
+void
+render_api_reset_counters(void) {
+    memset(&counters, 0, sizeof(counters));
+}
+
+static
+int
+bytes_per_pixel(enum l2d_image_format format) {
+    switch (format) {
+    case l2d_IMAGE_FORMAT_RGBA_8888: return 4;
+    case l2d_IMAGE_FORMAT_RGB_888: return 3;
+    case l2d_IMAGE_FORMAT_RGB_565: return 2;
+    case l2d_IMAGE_FORMAT_A_8: return 1;
+    default: assert(false); return 0;
+    }
+}
+
+uint32_t
+render_api_texture_new(enum texture_type type) {
+    return next_native_ptr++;
+}
+
+void
+render_api_texture_delete(uint32_t native_ptr) {
+}
+
+void
+render_api_texture_bind(enum texture_type texture_type,
+        uint32_t native_ptr, int32_t handle, int texture_slot,
+        int pixel_size_shader_handle, int w, int h) {
+}
+
+void
+render_api_texture_upload(struct render_api_upload_info* u) {
+    counters.texture_uploads++;
+    if (u->data)
+        counters.texture_bytes += u->width*u->height*bytes_per_pixel(u->format)
+            *(u->layers && !u->update_layer ? u->layers : 1);
+}
+
+void
+render_api_get_viewport(int res[4]) {
+    memcpy(res, viewport, sizeof(viewport));
+}
+
+uint32_t
+render_api_framebuffer_new(void) {
+    return next_native_ptr++;
+}
+
+bool
+render_api_framebuffer_attach(uint32_t fbo, uint32_t texture_native_ptr) {
+    return texture_native_ptr != 0;
+}
+
+static int current_fbo;
+
+void
+render_api_draw_start(int fbo_target, int viewport_w, int viewport_h) {
+    current_fbo = fbo_target;
+    if (fbo_target == 0) {
+        viewport[2] = viewport_w;
+        viewport[3] = viewport_h;
+    }
+}
+
+// Like GL with a depth buffer on the application's framebuffer.
+bool
+render_api_has_depth(void) {
+    return current_fbo == 0;
+}
+
+void
+render_api_clear_depth(void) {
+}
+
+void
+render_api_set_depth(enum render_api_depth depth) {
+}
+
+bool
+render_api_supports_instancing(void) {
+    return true;
+}
+
+bool
+render_api_supports_texture_arrays(void) {
+    return true;
+}
+
+// GL 3.0's minimum.
+int
+render_api_max_texture_layers(void) {
+    return 256;
+}
+
+int
+render_api_max_batch_textures(void) {
+    return MAX_BATCH_TEXTURES;
+}
+
+void
+render_api_draw_batch(struct batch* batch,
+        struct shader_handles* shader,
+        struct material* material, struct material_handles* h,
+        enum l2d_blend blend) {
+    if (batch->instanceCount) {
+        counters.draw_calls++;
+        counters.vertices += batch->instanceCount*4;
+        counters.indices += batch->instanceCount*6;
+        counters.vertex_bytes += batch->instanceCount*sizeof(struct instance);
+        return;
+    }
+
+    counters.draw_calls++;
+    counters.vertices += batch->vertexCount;
+    counters.indices += batch->indexCount;
+    counters.vertex_bytes += batch->vertexCount*sizeof(struct vertex);
+    counters.vertex_bytes +=
+        batch->vertexCount*batch->attributeStride*sizeof(float);
+    counters.index_bytes += batch->indexCount*sizeof(vertex_index);
+}
+
+void
+render_api_set_float(int32_t handle, float x) {
+}
+
+void
+render_api_set_vec(int32_t handle, float x, float y, float z, float w) {
+}
+
+void
+render_api_set_matrix(int32_t handle, float const m[16]) {
+}
+
+void
+render_api_draw_end(void) {
+}
+
+static
+struct shader_variant*
+shader_get_variant(struct shader* shader, unsigned int variant) {
+    assert(variant < SHADER_VARIANT_COUNT);
+    for (int i=0; i<sbcount(shader->variants); i++) {
+        if (shader->variants[i]->variant == variant) {
+            return shader->variants[i];
+        }
+    }
+    struct shader_variant* v = calloc(1, sizeof(struct shader_variant));
+    v->variant = variant;
+    sbpush(shader->variants, v);
+    return v;
+}
+
+static
+void
+loadProgram(struct shader_handles* h, unsigned int variant) {
+    PROFILE_BEGIN(loadProgram);
+
+    // Hand out the same handles a GL program would have, so the renderer
+    // takes the same paths it does with a real backend.
+    h->id = next_native_ptr++;
+    h->positionHandle = 0;
+    h->texCoordHandle = 1;
+    h->miscAttrib = (variant & (SHADER_DESATURATE | SHADER_TEXTURE_ARRAY
+                | SHADER_MULTI_TEXTURE)) ? 2 : -1;
+    h->colorAttrib = 3;
+    h->textureHandle = 0;
+    h->texture2Handle = 1;
+    h->texturePixelSizeHandle = -1;
+    h->miscAnimatingHandle = -1;
+    h->maskTexture = (variant & SHADER_MASK) ? 2 : -1;
+    h->maskTextureCoordMat = (variant & SHADER_MASK) ? 3 : -1;
+    h->eyePos = (variant & SHADER_MASK) ? 4 : -1;
+    h->maskLayer = (variant & SHADER_MASK_ARRAY) ? 5 : -1;
+    h->depth = 6;
+    h->cornerAttrib = (variant & SHADER_INSTANCED) ? 4 : -1;
+    h->instanceXAttrib = (variant & SHADER_INSTANCED) ? 5 : -1;
+    h->instanceYAttrib = (variant & SHADER_INSTANCED) ? 6 : -1;
+    h->instanceWAttrib = (variant & SHADER_INSTANCED) ? 7 : -1;
+    h->texRegionAttrib = (variant & SHADER_INSTANCED) ? 8 : -1;
+    h->batchTextures[0] = h->textureHandle;
+    for (int i=1; i<MAX_BATCH_TEXTURES; i++) {
+        h->batchTextures[i] = (variant & SHADER_MULTI_TEXTURE) ? 6+i : -1;
+    }
+    if (variant & SHADER_INSTANCED) {
+        h->positionHandle = -1;
+        h->texCoordHandle = -1;
+    }
+
+    counters.programs_compiled++;
+    PROFILE_END(loadProgram);
+}
+
+static
+struct material_handles*
+material_variant_handles(struct material* m, unsigned int variant) {
+    for (int i=0; i<sbcount(m->handles); i++) {
+        if (m->handles[i]->variant == variant) {
+            return m->handles[i];
+        }
+    }
+    struct material_handles* h = calloc(1, sizeof(struct material_handles));
+    h->variant = variant;
+    h->invalid = true;
+    sbpush(m->handles, h);
+    return h;
+}
+
+static
+void
+material_invalidate_handles(struct material* m) {
+    for (int i=0; i<sbcount(m->handles); i++) {
+        m->handles[i]->invalid = true;
+    }
+}
+
+struct material*
+render_api_material_new(struct shader* shader, struct l2d_effect_stage* effect) {
+    static int next_id = 1;
+    struct material* material = malloc(sizeof(struct material));
+    material->id = next_id++;
+    material->shader = shader;
+    material->effect = effect;
+    material->podUniforms = NULL;
+    material->attributes = NULL;
+    material->handles = NULL;
+    return material;
+}
+
+int
+render_api_material_get_id(struct material* m) {
+    return m->id;
+}
+
+struct material_attribute*
+render_api_get_attributes(struct material* m, int* count) {
+    *count = sbcount(m->attributes);
+    return m->attributes;
+}
+
+void
+render_api_material_set_float_v(struct material* m,
+        const char* name, int count, float* floats) {
+    assert(count > 0);
+    assert(count <= 4);
+    for (int i=0; i<sbcount(m->podUniforms); i++) {
+        struct material_pod_uniform* entry = &m->podUniforms[i];
+        if (strcmp(entry->name, name) == 0) {
+            memcpy(entry->floats, floats, sizeof(float)*count);
+            entry->size = count;
+            return;
+        }
+    }
+
+    struct material_pod_uniform* entry = sbadd(m->podUniforms, 1);
+    memcpy(entry->floats, floats, sizeof(float)*count);
+    entry->size = count;
+    char* newName = malloc(sizeof(char)*(strlen(name)+1));
+    strcpy(newName, name);
+    entry->name = newName;
+
+    material_invalidate_handles(m);
+}
+
+void
+render_api_material_enable_vertex_data(struct material* m,
+        l2d_ident attribute, int size) {
+    for (size_t i=0; i<sbcount(m->attributes); i++) {
+        if (m->attributes[i].name == attribute) {
+            m->attributes[i].size = size;
+            return;
+        }
+    }
+    struct material_attribute* ma = sbadd(m->attributes, 1);
+    ma->name = attribute;
+    ma->size = (size_t)size;
+    material_invalidate_handles(m);
+}
+
+void
+render_api_material_use(struct material* m, unsigned int shader_variant,
+        struct shader_handles** sh, struct material_handles** mh,
+        int* next_texture_slot) {
+    *sh = &shader_get_variant(m->shader, shader_variant)->handles;
+    if ((*sh)->id == 0) {
+        loadProgram(*sh, shader_variant);
+    }
+    *mh = material_variant_handles(m, shader_variant);
+    if ((*mh)->invalid) {
+        sbempty((*mh)->attributes);
+        for (int i=0; i<sbcount(m->attributes); i++) {
+            sbpush((*mh)->attributes, i);
+        }
+        (*mh)->invalid = false;
+    }
+}
+
+struct shader*
+render_api_load_shader(enum shader_type t) {
+    struct shader* shader = malloc(sizeof(struct shader));
+    memset(shader, 0, sizeof(struct shader));
+    return shader;
+}
+
+void
+render_api_clear(uint32_t color) {
+}
+
+void
+render_api_clear_f(float* c) {
+}
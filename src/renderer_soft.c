@@ -0,0 +1,1582 @@
+#include "render_api.h"
+#include "job.h"
+#include "stretchy_buffer.h"
+#include "effect.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// With GCC or Clang on x86 every raster function is also built for AVX2,
+// and those copies are used when the CPU has it. See raster_fns_avx2.
+#if defined(__SSE2__) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define AVX2_PATH
+#define AVX2_FN __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+
+// CPU rasterizer backend. Draw calls are queued per render target, their
+// triangles binned into TILE_SIZE squares, and the tiles shaded in parallel.
+// Each tile draws its triangles in submission order, so blending matches GL.
+//
+// Only the built in shaders are emulated: effect stages and custom vertex
+// attributes are ignored and those drawers render with their plain texture.
+
+#define TILE_SIZE 64
+#define MAX_TEXTURE_UNITS 16
+#define MAX_HANDLES 16
+
+enum {
+    HANDLE_TEXTURE,
+    HANDLE_TEXTURE2,
+    HANDLE_MASK_TEXTURE,
+    HANDLE_MASK_MATRIX,
+    HANDLE_EYE_POS,
+    HANDLE_MASK_LAYER,
+    HANDLE_DEPTH,
+    // HANDLE_BATCH_TEXTURE+i is batchTextures[i] for i > 0
+    HANDLE_BATCH_TEXTURE,
+};
+
+struct material {
+    int id;
+    struct shader* shader;
+    struct l2d_effect_stage* effect;
+    struct material_attribute* attributes; // stretchy buffer
+    struct material_handles** handles; // stretchy buffer
+};
+
+struct shader_variant {
+    unsigned int variant;
+    struct shader_handles handles;
+};
+
+struct shader {
+    enum shader_type type;
+    struct shader_variant** variants; // stretchy buffer
+};
+
+struct soft_texture {
+    bool in_use;
+    bool clamp;
+    int width, height;
+    int layers; // 1 unless it is a TEXTURE_2D_ARRAY
+    uint8_t* pixels; // RGBA, row 0 is t=0, layers one after another
+};
+
+struct framebuffer {
+    uint8_t* pixels;
+    int width, height, stride;
+    bool flip_y; // row 0 is the top of the viewport
+    float* depth; // width*height, 0 near to 1 far. NULL if there is none
+};
+
+struct soft_vertex {
+    float x, y;
+    float u, v;
+    float color[4];
+    float desaturate;
+    float mask_u, mask_v;
+    int layer;
+    int batch_texture;
+};
+
+struct soft_command {
+    uint32_t textures[MAX_BATCH_TEXTURES]; // [0] is the main texture
+    uint32_t mask_texture;
+    int mask_layer;
+    enum shader_type type;
+    enum l2d_blend blend;
+    bool desaturate;
+    enum render_api_depth depth_mode;
+    float depth;
+};
+
+struct soft_triangle {
+    int v[3];
+    int command;
+};
+
+static struct render_api_counters counters;
+
+static struct soft_texture* textures = NULL; // stretchy buffer, native_ptr-1
+static uint32_t* fbo_textures = NULL; // stretchy buffer, fbo-1
+
+static uint8_t* own_pixels = NULL;
+static struct framebuffer main_fb = {NULL, 1, 1, 4, true, NULL};
+static float* depth_buffer = NULL; // main_fb's
+static bool host_pixels = false;
+static int current_fbo = 0;
+
+static uint32_t unit_texture[MAX_TEXTURE_UNITS];
+static int handle_unit[MAX_HANDLES];
+static float eye_pos[4];
+static float mask_layer;
+static enum render_api_depth depth_mode;
+static float depth_z; // clip space
+static unsigned long* tile_rejected = NULL; // stretchy buffer, per tile
+static float mask_matrix[16];
+
+// Queued work for the current framebuffer.
+static struct soft_vertex* queued_verticies = NULL; // stretchy buffer
+static struct soft_triangle* queued_triangles = NULL; // stretchy buffer
+static struct soft_command* queued_commands = NULL; // stretchy buffer
+static int** tile_bins = NULL; // stretchy buffer of stretchy buffers
+
+void
+render_api_get_counters(struct render_api_counters* out) {
+    *out = counters;
+}
+
+void
+render_api_reset_counters(void) {
+    memset(&counters, 0, sizeof(counters));
+}
+
+
+//
+// Pixel math. A vec4 holds one RGBA color in the 0..1 range.
+//
+
+#ifdef __SSE2__
+typedef __m128 vec4;
+
+static inline vec4 v4(float r, float g, float b, float a) {
+    return _mm_setr_ps(r, g, b, a);
+}
+static inline vec4 v4_splat(float f) { return _mm_set1_ps(f); }
+static inline vec4 v4_add(vec4 a, vec4 b) { return _mm_add_ps(a, b); }
+static inline vec4 v4_mul(vec4 a, vec4 b) { return _mm_mul_ps(a, b); }
+static inline float v4_get(vec4 a, int i) {
+    float f[4];
+    _mm_storeu_ps(f, a);
+    return f[i];
+}
+
+static inline
+vec4
+v4_load_texel(uint8_t const* p) {
+    int32_t t;
+    memcpy(&t, p, 4);
+    __m128i zero = _mm_setzero_si128();
+    __m128i c = _mm_unpacklo_epi16(
+            _mm_unpacklo_epi8(_mm_cvtsi32_si128(t), zero), zero);
+    return _mm_mul_ps(_mm_cvtepi32_ps(c), _mm_set1_ps(1.f/255.f));
+}
+
+static inline
+void
+v4_store_pixel(uint8_t* p, vec4 c) {
+    c = _mm_min_ps(_mm_max_ps(c, _mm_setzero_ps()), _mm_set1_ps(1.f));
+    __m128i i = _mm_cvtps_epi32(_mm_mul_ps(c, _mm_set1_ps(255.f)));
+    i = _mm_packs_epi32(i, i);
+    i = _mm_packus_epi16(i, i);
+    int32_t t = _mm_cvtsi128_si32(i);
+    memcpy(p, &t, 4);
+}
+
+#else
+typedef struct { float c[4]; } vec4;
+
+static inline vec4 v4(float r, float g, float b, float a) {
+    vec4 v = {{r, g, b, a}};
+    return v;
+}
+static inline vec4 v4_splat(float f) { return v4(f, f, f, f); }
+static inline vec4 v4_add(vec4 a, vec4 b) {
+    return v4(a.c[0]+b.c[0], a.c[1]+b.c[1], a.c[2]+b.c[2], a.c[3]+b.c[3]);
+}
+static inline vec4 v4_mul(vec4 a, vec4 b) {
+    return v4(a.c[0]*b.c[0], a.c[1]*b.c[1], a.c[2]*b.c[2], a.c[3]*b.c[3]);
+}
+static inline float v4_get(vec4 a, int i) { return a.c[i]; }
+
+static inline
+vec4
+v4_load_texel(uint8_t const* p) {
+    const float f = 1.f/255.f;
+    return v4(p[0]*f, p[1]*f, p[2]*f, p[3]*f);
+}
+
+static inline
+void
+v4_store_pixel(uint8_t* p, vec4 c) {
+    for (int i=0; i<4; i++) {
+        float f = c.c[i];
+        f = f < 0.f ? 0.f : (f > 1.f ? 1.f : f);
+        p[i] = (uint8_t)(f*255.f + .5f);
+    }
+}
+
+// Weighted sum of four texels, the inner loop of bilinear filtering.
+static inline
+vec4
+v4_bilinear(uint8_t const* t00, uint8_t const* t10,
+        uint8_t const* t01, uint8_t const* t11, float fx, float fy) {
+    vec4 top = v4_add(v4_mul(v4_load_texel(t00), v4_splat(1.f-fx)),
+            v4_mul(v4_load_texel(t10), v4_splat(fx)));
+    vec4 bottom = v4_add(v4_mul(v4_load_texel(t01), v4_splat(1.f-fx)),
+            v4_mul(v4_load_texel(t11), v4_splat(fx)));
+    return v4_add(v4_mul(top, v4_splat(1.f-fy)), v4_mul(bottom, v4_splat(fy)));
+}
+#endif
+
+// Which of four pixels in a row are inside a triangle. w[k] is edge function
+// k at the first pixel and grows by step[k] a pixel, pixels exactly on edge
+// k count only if bit k of `bias` is set. Bit i of the result is set if
+// pixel i is inside, and e[k][i] is edge function k there.
+#ifdef AVX2_PATH
+static inline AVX2_FN
+int
+coverage4_avx2(double const w[3], double const step[3], int bias,
+        double e[3][4]) {
+    const __m256d lanes = _mm256_setr_pd(0., 1., 2., 3.);
+    const __m256d zero = _mm256_setzero_pd();
+    int inside = 0xf;
+    for (int k=0; k<3; k++) {
+        __m256d ek = _mm256_add_pd(_mm256_set1_pd(w[k]),
+                _mm256_mul_pd(lanes, _mm256_set1_pd(step[k])));
+        _mm256_storeu_pd(e[k], ek);
+        __m256d in = _mm256_cmp_pd(ek, zero, _CMP_GT_OQ);
+        if (bias & (1 << k)) {
+            in = _mm256_or_pd(in, _mm256_cmp_pd(ek, zero, _CMP_EQ_OQ));
+        }
+        inside &= _mm256_movemask_pd(in);
+    }
+    return inside;
+}
+#endif
+
+#ifdef __SSE2__
+static inline
+int
+coverage4(double const w[3], double const step[3], int bias,
+        double e[3][4]) {
+    const __m128d lanes01 = _mm_setr_pd(0., 1.);
+    const __m128d lanes23 = _mm_setr_pd(2., 3.);
+    const __m128d zero = _mm_setzero_pd();
+    int inside = 0xf;
+    for (int k=0; k<3; k++) {
+        __m128d wk = _mm_set1_pd(w[k]);
+        __m128d sk = _mm_set1_pd(step[k]);
+        __m128d lo = _mm_add_pd(wk, _mm_mul_pd(lanes01, sk));
+        __m128d hi = _mm_add_pd(wk, _mm_mul_pd(lanes23, sk));
+        _mm_storeu_pd(e[k], lo);
+        _mm_storeu_pd(e[k]+2, hi);
+        __m128d in_lo = _mm_cmpgt_pd(lo, zero);
+        __m128d in_hi = _mm_cmpgt_pd(hi, zero);
+        if (bias & (1 << k)) {
+            in_lo = _mm_or_pd(in_lo, _mm_cmpeq_pd(lo, zero));
+            in_hi = _mm_or_pd(in_hi, _mm_cmpeq_pd(hi, zero));
+        }
+        inside &= _mm_movemask_pd(in_lo) | _mm_movemask_pd(in_hi) << 2;
+    }
+    return inside;
+}
+#else
+static inline
+int
+coverage4(double const w[3], double const step[3], int bias,
+        double e[3][4]) {
+    int inside = 0xf;
+    for (int k=0; k<3; k++) {
+        for (int i=0; i<4; i++) {
+            e[k][i] = w[k] + i*step[k];
+            if (!(e[k][i] > 0. || (e[k][i] == 0. && (bias & (1 << k))))) {
+                inside &= ~(1 << i);
+            }
+        }
+    }
+    return inside;
+}
+#endif
+
+// Barycentric weights of four pixels, from their edge functions.
+#ifdef __SSE2__
+struct weights4 {
+    __m128 w[3];
+};
+
+static inline
+struct weights4
+weights4(double e[3][4], double inv_area) {
+    struct weights4 out;
+    const __m128d scale = _mm_set1_pd(inv_area);
+    for (int k=0; k<3; k++) {
+        __m128 lo = _mm_cvtpd_ps(_mm_mul_pd(_mm_loadu_pd(e[k]), scale));
+        __m128 hi = _mm_cvtpd_ps(_mm_mul_pd(_mm_loadu_pd(e[k]+2), scale));
+        out.w[k] = _mm_movelh_ps(lo, hi);
+    }
+    return out;
+}
+
+// One attribute interpolated at the four pixels.
+static inline
+void
+lerp4(float out[4], float a, float b, float c, struct weights4 const* w) {
+    _mm_storeu_ps(out, _mm_add_ps(_mm_add_ps(
+                    _mm_mul_ps(_mm_set1_ps(a), w->w[0]),
+                    _mm_mul_ps(_mm_set1_ps(b), w->w[1])),
+                _mm_mul_ps(_mm_set1_ps(c), w->w[2])));
+}
+#else
+struct weights4 {
+    float w[3][4];
+};
+
+static inline
+struct weights4
+weights4(double e[3][4], double inv_area) {
+    struct weights4 out;
+    for (int k=0; k<3; k++) {
+        for (int i=0; i<4; i++) {
+            out.w[k][i] = (float)(e[k][i]*inv_area);
+        }
+    }
+    return out;
+}
+
+static inline
+void
+lerp4(float out[4], float a, float b, float c, struct weights4 const* w) {
+    for (int i=0; i<4; i++) {
+        out[i] = a*w->w[0][i] + b*w->w[1][i] + c*w->w[2][i];
+    }
+}
+#endif
+
+static
+struct soft_texture*
+get_texture(uint32_t native_ptr) {
+    if (native_ptr == 0 || native_ptr > sbcount(textures))
+        return NULL;
+    struct soft_texture* t = &textures[native_ptr-1];
+    return (t->in_use && t->pixels) ? t : NULL;
+}
+
+static inline
+int
+wrap_coord(int i, int size, bool clamp) {
+    if (clamp) {
+        return i < 0 ? 0 : (i >= size ? size-1 : i);
+    }
+    i %= size;
+    return i < 0 ? i+size : i;
+}
+
+#ifndef __SSE2__
+static
+vec4
+sample(struct soft_texture* t, int layer, float u, float v, bool bilinear) {
+    if (!t) return v4(0.f, 0.f, 0.f, 1.f);
+    const int pitch = t->width*4;
+    uint8_t const* pixels = t->pixels
+        + (size_t)wrap_coord(layer, t->layers, true)*pitch*t->height;
+    if (!bilinear) {
+        int x = wrap_coord((int)floorf(u*t->width), t->width, t->clamp);
+        int y = wrap_coord((int)floorf(v*t->height), t->height, t->clamp);
+        return v4_load_texel(pixels + y*pitch + x*4);
+    }
+    float fu = u*t->width - .5f;
+    float fv = v*t->height - .5f;
+    float x0f = floorf(fu);
+    float y0f = floorf(fv);
+    int x0 = wrap_coord((int)x0f, t->width, t->clamp);
+    int x1 = wrap_coord((int)x0f+1, t->width, t->clamp);
+    int y0 = wrap_coord((int)y0f, t->height, t->clamp);
+    int y1 = wrap_coord((int)y0f+1, t->height, t->clamp);
+    uint8_t const* r0 = pixels + y0*pitch;
+    uint8_t const* r1 = pixels + y1*pitch;
+    return v4_bilinear(r0+x0*4, r0+x1*4, r1+x0*4, r1+x1*4,
+            fu-x0f, fv-y0f);
+}
+#endif
+
+// Samples a texture at four pixels, out[c][i] is channel c of pixel i. The
+// pixels needn't be inside the triangle, coordinates are always kept in the
+// texture. The SSE2 and AVX2 versions do the same math in the same order as
+// sample(), so every build gives the same colors.
+#ifdef __SSE2__
+static inline
+__m128
+floor4(__m128 x) {
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, x), _mm_set1_ps(1.f)));
+}
+
+// wrap_coord for four whole numbers. Exact below 2^24, and out of range
+// or NaN coordinates end up somewhere in the texture.
+static inline
+__m128i
+wrap4(__m128 i, __m128 size, __m128 inv_size, bool clamp) {
+    if (!clamp) {
+        i = _mm_sub_ps(i, _mm_mul_ps(floor4(_mm_mul_ps(i, inv_size)), size));
+        // The division can be off by one either way.
+        i = _mm_add_ps(i, _mm_and_ps(_mm_cmplt_ps(i, _mm_setzero_ps()), size));
+        i = _mm_sub_ps(i, _mm_and_ps(_mm_cmpge_ps(i, size), size));
+    }
+    i = _mm_min_ps(_mm_max_ps(i, _mm_setzero_ps()),
+            _mm_sub_ps(size, _mm_set1_ps(1.f)));
+    return _mm_cvttps_epi32(i);
+}
+
+// Channel c of four RGBA texels, in the 0..1 range.
+static inline
+__m128
+texel_channel4(__m128i texels, int c) {
+    __m128i i = _mm_and_si128(_mm_srli_epi32(texels, 8*c),
+            _mm_set1_epi32(0xff));
+    return _mm_mul_ps(_mm_cvtepi32_ps(i), _mm_set1_ps(1.f/255.f));
+}
+
+static inline
+__m128i
+load_texels4(uint8_t const* pixels, int pitch, int const x[4],
+        int const y[4]) {
+    int32_t t[4];
+    for (int i=0; i<4; i++) {
+        memcpy(&t[i], pixels + y[i]*pitch + x[i]*4, 4);
+    }
+    return _mm_loadu_si128((__m128i const*)t);
+}
+
+static inline
+void
+sample4(struct soft_texture* t, int layer, float const u[4],
+        float const v[4], bool bilinear, float out[4][4]) {
+    if (!t) {
+        for (int c=0; c<4; c++) {
+            _mm_storeu_ps(out[c], _mm_set1_ps(c == 3 ? 1.f : 0.f));
+        }
+        return;
+    }
+    const int pitch = t->width*4;
+    uint8_t const* pixels = t->pixels
+        + (size_t)wrap_coord(layer, t->layers, true)*pitch*t->height;
+    const __m128 w = _mm_set1_ps((float)t->width);
+    const __m128 h = _mm_set1_ps((float)t->height);
+    const __m128 inv_w = _mm_set1_ps(1.f/t->width);
+    const __m128 inv_h = _mm_set1_ps(1.f/t->height);
+    __m128 fu = _mm_mul_ps(_mm_loadu_ps(u), w);
+    __m128 fv = _mm_mul_ps(_mm_loadu_ps(v), h);
+    if (!bilinear) {
+        int x[4], y[4];
+        _mm_storeu_si128((__m128i*)x, wrap4(floor4(fu), w, inv_w, t->clamp));
+        _mm_storeu_si128((__m128i*)y, wrap4(floor4(fv), h, inv_h, t->clamp));
+        __m128i texels = load_texels4(pixels, pitch, x, y);
+        for (int c=0; c<4; c++) {
+            _mm_storeu_ps(out[c], texel_channel4(texels, c));
+        }
+        return;
+    }
+    const __m128 one = _mm_set1_ps(1.f);
+    fu = _mm_sub_ps(fu, _mm_set1_ps(.5f));
+    fv = _mm_sub_ps(fv, _mm_set1_ps(.5f));
+    __m128 x0f = floor4(fu);
+    __m128 y0f = floor4(fv);
+    int x0[4], x1[4], y0[4], y1[4];
+    _mm_storeu_si128((__m128i*)x0, wrap4(x0f, w, inv_w, t->clamp));
+    _mm_storeu_si128((__m128i*)x1,
+            wrap4(_mm_add_ps(x0f, one), w, inv_w, t->clamp));
+    _mm_storeu_si128((__m128i*)y0, wrap4(y0f, h, inv_h, t->clamp));
+    _mm_storeu_si128((__m128i*)y1,
+            wrap4(_mm_add_ps(y0f, one), h, inv_h, t->clamp));
+    __m128i t00 = load_texels4(pixels, pitch, x0, y0);
+    __m128i t10 = load_texels4(pixels, pitch, x1, y0);
+    __m128i t01 = load_texels4(pixels, pitch, x0, y1);
+    __m128i t11 = load_texels4(pixels, pitch, x1, y1);
+    __m128 fx = _mm_sub_ps(fu, x0f);
+    __m128 fy = _mm_sub_ps(fv, y0f);
+    __m128 gx = _mm_sub_ps(one, fx);
+    __m128 gy = _mm_sub_ps(one, fy);
+    for (int c=0; c<4; c++) {
+        __m128 top = _mm_add_ps(_mm_mul_ps(texel_channel4(t00, c), gx),
+                _mm_mul_ps(texel_channel4(t10, c), fx));
+        __m128 bottom = _mm_add_ps(_mm_mul_ps(texel_channel4(t01, c), gx),
+                _mm_mul_ps(texel_channel4(t11, c), fx));
+        _mm_storeu_ps(out[c], _mm_add_ps(_mm_mul_ps(top, gy),
+                    _mm_mul_ps(bottom, fy)));
+    }
+}
+#else
+static inline
+void
+sample4(struct soft_texture* t, int layer, float const u[4],
+        float const v[4], bool bilinear, float out[4][4]) {
+    for (int i=0; i<4; i++) {
+        vec4 texel = sample(t, layer, u[i], v[i], bilinear);
+        for (int c=0; c<4; c++) {
+            out[c][i] = v4_get(texel, c);
+        }
+    }
+}
+#endif
+
+// sample4 with u and v side by side in eight lanes, and AVX2 gathers
+// fetching a row's left and right texels for all four pixels at once.
+#ifdef AVX2_PATH
+static inline AVX2_FN
+__m256
+join8(__m128 lo, __m128 hi) {
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+static inline AVX2_FN
+__m256i
+join8i(__m128i lo, __m128i hi) {
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+static inline AVX2_FN
+__m256i
+wrap8(__m256 i, __m256 size, __m256 inv_size, bool clamp) {
+    if (!clamp) {
+        i = _mm256_sub_ps(i, _mm256_mul_ps(
+                    _mm256_floor_ps(_mm256_mul_ps(i, inv_size)), size));
+        i = _mm256_add_ps(i, _mm256_and_ps(
+                    _mm256_cmp_ps(i, _mm256_setzero_ps(), _CMP_LT_OQ), size));
+        i = _mm256_sub_ps(i, _mm256_and_ps(
+                    _mm256_cmp_ps(i, size, _CMP_GE_OQ), size));
+    }
+    i = _mm256_min_ps(_mm256_max_ps(i, _mm256_setzero_ps()),
+            _mm256_sub_ps(size, _mm256_set1_ps(1.f)));
+    return _mm256_cvttps_epi32(i);
+}
+
+static inline AVX2_FN
+__m256
+texel_channel8(__m256i texels, int c) {
+    __m256i i = _mm256_and_si256(_mm256_srli_epi32(texels, 8*c),
+            _mm256_set1_epi32(0xff));
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(i), _mm256_set1_ps(1.f/255.f));
+}
+
+static inline AVX2_FN
+void
+sample4_avx2(struct soft_texture* t, int layer, float const u[4],
+        float const v[4], bool bilinear, float out[4][4]) {
+    if (!t) {
+        for (int c=0; c<4; c++) {
+            _mm_storeu_ps(out[c], _mm_set1_ps(c == 3 ? 1.f : 0.f));
+        }
+        return;
+    }
+    int const* pixels = (int const*)(t->pixels
+            + (size_t)wrap_coord(layer, t->layers, true)*t->width*t->height*4);
+    const __m128i width = _mm_set1_epi32(t->width);
+    const __m256 size = join8(_mm_set1_ps((float)t->width),
+            _mm_set1_ps((float)t->height));
+    const __m256 inv_size = join8(_mm_set1_ps(1.f/t->width),
+            _mm_set1_ps(1.f/t->height));
+    __m256 f = _mm256_mul_ps(join8(_mm_loadu_ps(u), _mm_loadu_ps(v)), size);
+    if (!bilinear) {
+        __m256i xy = wrap8(_mm256_floor_ps(f), size, inv_size, t->clamp);
+        __m128i i = _mm_add_epi32(_mm256_castsi256_si128(xy),
+                _mm_mullo_epi32(_mm256_extracti128_si256(xy, 1), width));
+        __m128i texels = _mm_i32gather_epi32(pixels, i, 4);
+        for (int c=0; c<4; c++) {
+            _mm_storeu_ps(out[c], texel_channel4(texels, c));
+        }
+        return;
+    }
+    const __m256 one = _mm256_set1_ps(1.f);
+    f = _mm256_sub_ps(f, _mm256_set1_ps(.5f));
+    __m256 f0 = _mm256_floor_ps(f);
+    __m256i xy0 = wrap8(f0, size, inv_size, t->clamp);
+    __m256i xy1 = wrap8(_mm256_add_ps(f0, one), size, inv_size, t->clamp);
+    __m128i x0 = _mm256_castsi256_si128(xy0);
+    __m128i x1 = _mm256_castsi256_si128(xy1);
+    __m128i row0 = _mm_mullo_epi32(_mm256_extracti128_si256(xy0, 1), width);
+    __m128i row1 = _mm_mullo_epi32(_mm256_extracti128_si256(xy1, 1), width);
+    // Top then bottom row, left texels in one gather and right in the other.
+    __m256i left = _mm256_i32gather_epi32(pixels, join8i(
+                _mm_add_epi32(row0, x0), _mm_add_epi32(row1, x0)), 4);
+    __m256i right = _mm256_i32gather_epi32(pixels, join8i(
+                _mm_add_epi32(row0, x1), _mm_add_epi32(row1, x1)), 4);
+    __m256 frac = _mm256_sub_ps(f, f0);
+    __m128 fx = _mm256_castps256_ps128(frac);
+    __m128 fy = _mm256_extractf128_ps(frac, 1);
+    __m256 fx8 = join8(fx, fx);
+    __m256 gx8 = _mm256_sub_ps(one, fx8);
+    __m128 gy = _mm_sub_ps(_mm_set1_ps(1.f), fy);
+    for (int c=0; c<4; c++) {
+        __m256 rows = _mm256_add_ps(
+                _mm256_mul_ps(texel_channel8(left, c), gx8),
+                _mm256_mul_ps(texel_channel8(right, c), fx8));
+        _mm_storeu_ps(out[c], _mm_add_ps(
+                    _mm_mul_ps(_mm256_castps256_ps128(rows), gy),
+                    _mm_mul_ps(_mm256_extractf128_ps(rows, 1), fy)));
+    }
+}
+#endif
+
+
+//
+// Textures and framebuffers
+//
+
+uint32_t
+render_api_texture_new(enum texture_type type) {
+    for (int i=0; i<sbcount(textures); i++) {
+        if (!textures[i].in_use) {
+            textures[i].in_use = true;
+            return i+1;
+        }
+    }
+    struct soft_texture* t = sbadd(textures, 1);
+    memset(t, 0, sizeof(struct soft_texture));
+    t->in_use = true;
+    return sbcount(textures);
+}
+
+static void flush(void);
+
+void
+render_api_texture_delete(uint32_t native_ptr) {
+    flush();
+    struct soft_texture* t = &textures[native_ptr-1];
+    free(t->pixels);
+    memset(t, 0, sizeof(struct soft_texture));
+}
+
+void
+render_api_texture_bind(enum texture_type texture_type,
+        uint32_t native_ptr, int32_t handle, int texture_slot,
+        int pixel_size_shader_handle, int w, int h) {
+    if (texture_slot >= 0 && texture_slot < MAX_TEXTURE_UNITS)
+        unit_texture[texture_slot] = native_ptr;
+    if (handle >= 0 && handle < MAX_HANDLES)
+        handle_unit[handle] = texture_slot;
+}
+
+// Converts count pixels of the format to RGBA. Returns the bytes read.
+static
+size_t
+convert_pixels(uint8_t* out, uint8_t const* in, int count,
+        enum l2d_image_format format) {
+    uint8_t const* start = in;
+    for (int i=0; i<count; i++, out+=4) {
+        switch (format) {
+        case l2d_IMAGE_FORMAT_RGBA_8888:
+            memcpy(out, in, 4);
+            in += 4;
+            break;
+        case l2d_IMAGE_FORMAT_RGB_888:
+            out[0] = in[0]; out[1] = in[1]; out[2] = in[2]; out[3] = 255;
+            in += 3;
+            break;
+        case l2d_IMAGE_FORMAT_RGB_565: {
+            uint16_t p = in[0] | (in[1] << 8);
+            out[0] = ((p >> 11) & 31) * 255 / 31;
+            out[1] = ((p >> 5) & 63) * 255 / 63;
+            out[2] = (p & 31) * 255 / 31;
+            out[3] = 255;
+            in += 2;
+            break;
+        }
+        case l2d_IMAGE_FORMAT_A_8:
+            // Matches GL_ALPHA
+            out[0] = out[1] = out[2] = 0; out[3] = in[0];
+            in += 1;
+            break;
+        default:
+            assert(false);
+        }
+    }
+    return in - start;
+}
+
+void
+render_api_texture_upload(struct render_api_upload_info* u) {
+    flush();
+    struct soft_texture* t = &textures[u->native_ptr-1];
+    counters.texture_uploads++;
+
+    if (u->update_layer) {
+        assert(u->layer < t->layers && u->width <= t->width
+                && u->height <= t->height);
+        uint8_t const* in = u->data;
+        for (int y=0; y<u->height; y++) {
+            uint8_t* out = t->pixels
+                + (((size_t)u->layer*t->height + y)*t->width)*4;
+            in += convert_pixels(out, in, u->width, u->format);
+        }
+        counters.texture_bytes += in - (uint8_t const*)u->data;
+        return;
+    }
+
+    t->clamp = u->clamp;
+    t->width = u->width;
+    t->height = u->height;
+    t->layers = u->layers ? u->layers : 1;
+    t->pixels = realloc(t->pixels, (size_t)u->width*u->height*t->layers*4);
+
+    const int count = u->width*u->height*t->layers;
+    if (!u->data) {
+        memset(t->pixels, 0, (size_t)count*4);
+        return;
+    }
+    counters.texture_bytes += convert_pixels(t->pixels, u->data, count,
+            u->format);
+}
+
+void
+render_api_get_viewport(int res[4]) {
+    res[0] = 0;
+    res[1] = 0;
+    res[2] = main_fb.width;
+    res[3] = main_fb.height;
+}
+
+uint32_t
+render_api_framebuffer_new(void) {
+    sbpush(fbo_textures, 0);
+    return sbcount(fbo_textures);
+}
+
+bool
+render_api_framebuffer_attach(uint32_t fbo, uint32_t texture_native_ptr) {
+    fbo_textures[fbo-1] = texture_native_ptr;
+    return texture_native_ptr != 0;
+}
+
+static
+bool
+get_framebuffer(int fbo, struct framebuffer* out) {
+    if (fbo == 0) {
+        *out = main_fb;
+        return out->pixels != NULL;
+    }
+    struct soft_texture* t = get_texture(fbo_textures[fbo-1]);
+    if (!t) return false;
+    out->pixels = t->pixels;
+    out->width = t->width;
+    out->height = t->height;
+    out->stride = t->width*4;
+    out->flip_y = false;
+    out->depth = NULL;
+    return true;
+}
+
+L2D_EXPORTED
+void
+l2d_soft_render_set_framebuffer(uint8_t* pixels, int width, int height,
+        int stride) {
+    flush();
+    host_pixels = pixels != NULL;
+    if (host_pixels) {
+        main_fb.pixels = pixels;
+        main_fb.width = width;
+        main_fb.height = height;
+        main_fb.stride = stride ? stride : width*4;
+    } else {
+        main_fb.pixels = own_pixels;
+    }
+}
+
+L2D_EXPORTED
+uint8_t const*
+l2d_soft_render_get_pixels(int* width, int* height, int* stride) {
+    flush();
+    if (width) *width = main_fb.width;
+    if (height) *height = main_fb.height;
+    if (stride) *stride = main_fb.stride;
+    return main_fb.pixels;
+}
+
+void
+render_api_draw_start(int fbo_target, int viewport_w, int viewport_h) {
+    flush();
+    current_fbo = fbo_target;
+    if (fbo_target == 0 && !host_pixels && (!own_pixels
+                || main_fb.width != viewport_w
+                || main_fb.height != viewport_h)) {
+        main_fb.width = viewport_w > 0 ? viewport_w : 1;
+        main_fb.height = viewport_h > 0 ? viewport_h : 1;
+        main_fb.stride = main_fb.width*4;
+        own_pixels = realloc(own_pixels, main_fb.stride*main_fb.height);
+        memset(own_pixels, 0, main_fb.stride*main_fb.height);
+        main_fb.pixels = own_pixels;
+    }
+    depth_mode = DEPTH_OFF;
+}
+
+bool
+render_api_has_depth(void) {
+    return current_fbo == 0;
+}
+
+void
+render_api_clear_depth(void) {
+    flush();
+    if (current_fbo != 0)
+        return;
+    // Allocated on first use, most frames never need it.
+    static int depth_width, depth_height;
+    if (!depth_buffer || depth_width != main_fb.width
+            || depth_height != main_fb.height) {
+        depth_width = main_fb.width;
+        depth_height = main_fb.height;
+        depth_buffer = realloc(depth_buffer,
+                (size_t)depth_width*depth_height*sizeof(float));
+    }
+    main_fb.depth = depth_buffer;
+    for (int i=0; i<depth_width*depth_height; i++) {
+        depth_buffer[i] = 1.f;
+    }
+}
+
+void
+render_api_set_depth(enum render_api_depth mode) {
+    depth_mode = mode;
+}
+
+void
+render_api_draw_end(void) {
+    flush();
+}
+
+static
+void
+clear(float const* c) {
+    flush();
+    struct framebuffer fb;
+    if (!get_framebuffer(current_fbo, &fb)) return;
+    uint8_t pixel[4];
+    v4_store_pixel(pixel, v4(c[0], c[1], c[2], c[3]));
+    for (int y=0; y<fb.height; y++) {
+        uint8_t* row = fb.pixels + y*fb.stride;
+        for (int x=0; x<fb.width; x++) {
+            memcpy(row + x*4, pixel, 4);
+        }
+    }
+}
+
+void
+render_api_clear(uint32_t color) {
+    float c[4] = {
+        ((color>>24)&255)/255.f,
+        ((color>>16)&255)/255.f,
+        ((color>>8)&255)/255.f,
+        (color&255)/255.f};
+    clear(c);
+}
+
+void
+render_api_clear_f(float* c) {
+    clear(c);
+}
+
+
+//
+// Drawing
+//
+
+void
+render_api_set_float(int32_t handle, float x) {
+    if (handle == HANDLE_MASK_LAYER) {
+        mask_layer = x;
+    } else if (handle == HANDLE_DEPTH) {
+        depth_z = x;
+    }
+}
+
+void
+render_api_set_vec(int32_t handle, float x, float y, float z, float w) {
+    if (handle == HANDLE_EYE_POS) {
+        eye_pos[0] = x; eye_pos[1] = y; eye_pos[2] = z; eye_pos[3] = w;
+    }
+}
+
+void
+render_api_set_matrix(int32_t handle, float const m[16]) {
+    if (handle == HANDLE_MASK_MATRIX) {
+        memcpy(mask_matrix, m, sizeof(mask_matrix));
+    }
+}
+
+static
+void
+mat_mul_vec(float out[4], float const m[16], float const v[4]) {
+    for (int r=0; r<4; r++) {
+        out[r] = m[r]*v[0] + m[4+r]*v[1] + m[8+r]*v[2] + m[12+r]*v[3];
+    }
+}
+
+bool
+render_api_supports_instancing(void) {
+    return false;
+}
+
+bool
+render_api_supports_texture_arrays(void) {
+    return true;
+}
+
+int
+render_api_max_texture_layers(void) {
+    return 256;
+}
+
+int
+render_api_max_batch_textures(void) {
+    return MAX_BATCH_TEXTURES;
+}
+
+void
+render_api_draw_batch(struct batch* batch,
+        struct shader_handles* shader,
+        struct material* material, struct material_handles* h,
+        enum l2d_blend blend) {
+    counters.draw_calls++;
+    counters.vertices += batch->vertexCount;
+    counters.indices += batch->indexCount;
+    counters.vertex_bytes += batch->vertexCount*sizeof(struct vertex);
+    counters.index_bytes += batch->indexCount*sizeof(vertex_index);
+
+    struct framebuffer fb;
+    if (!get_framebuffer(current_fbo, &fb)) return;
+
+    unsigned int variant = shader->id - 1;
+    struct soft_command* cmd = sbadd(queued_commands, 1);
+    memset(cmd->textures, 0, sizeof(cmd->textures));
+    cmd->textures[0] = unit_texture[handle_unit[HANDLE_TEXTURE]];
+    if (variant & SHADER_MULTI_TEXTURE) {
+        for (int i=1; i<MAX_BATCH_TEXTURES; i++) {
+            cmd->textures[i] =
+                unit_texture[handle_unit[HANDLE_BATCH_TEXTURE+i-1]];
+        }
+    }
+    cmd->mask_texture = (variant & SHADER_MASK)
+        ? unit_texture[handle_unit[HANDLE_MASK_TEXTURE]] : 0;
+    cmd->mask_layer = (variant & SHADER_MASK_ARRAY) ? (int)mask_layer : 0;
+    cmd->type = material->shader->type;
+    cmd->blend = blend;
+    cmd->desaturate = variant & SHADER_DESATURATE;
+    cmd->depth_mode = fb.depth ? depth_mode : DEPTH_OFF;
+    cmd->depth = (depth_z+1.f)*.5f;
+
+    float mask_p1[4];
+    if (cmd->mask_texture) {
+        mat_mul_vec(mask_p1, mask_matrix, eye_pos);
+    }
+
+    const int base = sbcount(queued_verticies);
+    struct soft_vertex* out = sbadd(queued_verticies, batch->vertexCount);
+    for (int i=0; i<batch->vertexCount; i++, out++) {
+        float p[2], uv[2];
+        vertex_unpack(&batch->verticies[i], p, uv, out->color,
+                &out->desaturate, &out->layer, &out->batch_texture);
+        float x = p[0];
+        float y = p[1];
+        out->x = (x+1.f)*.5f*fb.width;
+        out->y = (fb.flip_y ? (1.f-y) : (y+1.f))*.5f*fb.height;
+        out->u = uv[0];
+        out->v = uv[1];
+        out->mask_u = 0.f;
+        out->mask_v = 0.f;
+        if (cmd->mask_texture) {
+            // Same math as the mask vertex shader.
+            float p4[4] = {x, y, 0.f, 1.f};
+            float mask_p2[4];
+            mat_mul_vec(mask_p2, mask_matrix, p4);
+            float ray[3] = {mask_p2[0]-mask_p1[0], mask_p2[1]-mask_p1[1],
+                mask_p2[2]-mask_p1[2]};
+            if (ray[2] != 0.f) {
+                out->mask_u = -mask_p1[2]*ray[0]/ray[2] + mask_p1[0];
+                out->mask_v = -mask_p1[2]*ray[1]/ray[2] + mask_p1[1];
+            }
+        }
+    }
+
+    const int command = sbcount(queued_commands)-1;
+    for (int i=0; i+2<batch->indexCount; i+=3) {
+        struct soft_triangle* t = sbadd(queued_triangles, 1);
+        t->v[0] = base + batch->indicies[i+0];
+        t->v[1] = base + batch->indicies[i+1];
+        t->v[2] = base + batch->indicies[i+2];
+        t->command = command;
+    }
+}
+
+struct raster_job {
+    struct framebuffer fb;
+    int tiles_x;
+    bool avx2; // use raster_fns_avx2
+};
+
+// Edge functions are worked out from positions snapped to 1/256 of a pixel.
+// That keeps them exact in doubles for any sane viewport, so they can be
+// stepped from pixel to pixel without drifting, and triangles sharing an
+// edge agree on every pixel along it.
+struct raster_point {
+    double x, y;
+};
+
+static inline
+struct raster_point
+raster_point(struct soft_vertex const* v) {
+    struct raster_point p = {floor(v->x*256. + .5)/256.,
+        floor(v->y*256. + .5)/256.};
+    return p;
+}
+
+static inline
+double
+edge(struct raster_point a, struct raster_point b, double x, double y) {
+    return (b.x - a.x)*(y - a.y) - (b.y - a.y)*(x - a.x);
+}
+
+// Top-left fill rule, so shared edges are only drawn once.
+static inline
+bool
+edge_is_top_left(struct raster_point a, struct raster_point b) {
+    double dx = b.x - a.x;
+    double dy = b.y - a.y;
+    return dy < 0. || (dy == 0. && dx > 0.);
+}
+
+static inline
+vec4
+blend_pixel(enum l2d_blend blend, vec4 src, uint8_t const* dst_p) {
+    switch (blend) {
+    case l2d_BLEND_DISABLED:
+        return src;
+    case l2d_BLEND_DEFAULT: {
+        float a = v4_get(src, 3);
+        return v4_add(v4_mul(src, v4_splat(a)),
+                v4_mul(v4_load_texel(dst_p), v4_splat(1.f-a)));
+    }
+    case l2d_BLEND_PREMULT: {
+        float a = v4_get(src, 3);
+        return v4_add(src, v4_mul(v4_load_texel(dst_p), v4_splat(1.f-a)));
+    }
+    default:
+        assert(false);
+        return src;
+    }
+}
+
+// What raster_triangle works out once per triangle for raster_pixels.
+struct raster_setup {
+    struct soft_vertex const *a, *b, *c;
+    struct soft_texture* texture;
+    struct soft_texture* mask;
+    int mask_layer;
+    bool bilinear;
+    float* depth; // NULL unless the command depth tests
+    bool depth_write;
+    float z;
+    double inv_area;
+    int x0, y0, x1, y1;
+    // Edge functions at the center of pixel (x0, y0), and how much they
+    // change a pixel to the right and a pixel down.
+    double w[3];
+    double step_x[3];
+    double step_y[3];
+    int bias; // bit k is set if edge k is top-left
+};
+
+typedef void raster_fn(struct framebuffer*, struct raster_setup const*,
+        unsigned long* rejected);
+
+// raster_pixels is specialized for every combination of shader type, mask,
+// desaturate and blend below, so it has to really be inlined.
+#if defined(__GNUC__)
+#define RASTER_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define RASTER_INLINE __forceinline
+#else
+#define RASTER_INLINE inline
+#endif
+
+// Narrows [lo, hi) down to the part of a row that can be inside the
+// triangle, give or take a pixel, from the edge functions at the row's
+// first pixel. coverage4 still decides each pixel. False if none can be.
+static inline
+bool
+row_span(struct raster_setup const* s, double const row[3], int* lo, int* hi) {
+    for (int k=0; k<3; k++) {
+        const double step = s->step_x[k];
+        if (step > 0.) {
+            double x = s->x0 + floor(-row[k]/step) - 1.;
+            if (x >= *hi) return false;
+            if (x > *lo) *lo = (int)x;
+        } else if (step < 0.) {
+            double x = s->x0 + ceil(-row[k]/step) + 2.;
+            if (x <= *lo) return false;
+            if (x < *hi) *hi = (int)x;
+        } else if (row[k] < 0.) {
+            return false;
+        }
+    }
+    return *lo < *hi;
+}
+
+// Walks each row's span four pixels at a time, stepping the edge functions
+// and shading only the pixels coverage4 says are inside and that pass the
+// depth test. `avx2` picks the AVX2 helpers, for raster_fns_avx2.
+static RASTER_INLINE
+void
+raster_pixels(struct framebuffer* fb, struct raster_setup const* s,
+        unsigned long* rejected, enum shader_type type, bool masked,
+        bool desaturate, enum l2d_blend blend, bool avx2) {
+    struct soft_vertex const* a = s->a;
+    struct soft_vertex const* b = s->b;
+    struct soft_vertex const* c = s->c;
+    const double step4[3] = {4.*s->step_x[0], 4.*s->step_x[1],
+        4.*s->step_x[2]};
+    double row[3] = {s->w[0], s->w[1], s->w[2]};
+
+    for (int y=s->y0; y<s->y1; y++) {
+        uint8_t* dst_row = fb->pixels + y*fb->stride;
+        float* z_row = s->depth ? s->depth + y*fb->width : NULL;
+        int lo = s->x0;
+        int hi = s->x1;
+        const bool inside = row_span(s, row, &lo, &hi);
+        double w[3];
+        for (int k=0; k<3; k++) {
+            w[k] = row[k] + (lo - s->x0)*s->step_x[k];
+            row[k] += s->step_y[k];
+        }
+        if (!inside) continue;
+        for (int x=lo; x<hi; x+=4) {
+            double e[3][4];
+            int covered;
+#ifdef AVX2_PATH
+            if (avx2)
+                covered = coverage4_avx2(w, s->step_x, s->bias, e);
+            else
+#endif
+                covered = coverage4(w, s->step_x, s->bias, e);
+            for (int k=0; k<3; k++) {
+                w[k] += step4[k];
+            }
+            if (hi - x < 4) {
+                covered &= (1 << (hi - x)) - 1;
+            }
+            if (z_row) {
+                for (int i=0; i<4; i++) {
+                    if (!(covered & (1 << i))) continue;
+                    float* z = z_row + x+i;
+                    if (s->depth_write ? !(s->z < *z) : !(s->z <= *z)) {
+                        (*rejected)++;
+                        covered &= ~(1 << i);
+                    } else if (s->depth_write) {
+                        *z = s->z;
+                    }
+                }
+            }
+            if (!covered) continue;
+
+            struct weights4 bw = weights4(e, s->inv_area);
+            float u[4], v[4], color[4][4], mask_u[4], mask_v[4], d[4];
+            lerp4(u, a->u, b->u, c->u, &bw);
+            lerp4(v, a->v, b->v, c->v, &bw);
+            for (int k=0; k<4; k++) {
+                lerp4(color[k], a->color[k], b->color[k], c->color[k], &bw);
+            }
+            if (masked) {
+                lerp4(mask_u, a->mask_u, b->mask_u, c->mask_u, &bw);
+                lerp4(mask_v, a->mask_v, b->mask_v, c->mask_v, &bw);
+            }
+            if (desaturate) {
+                lerp4(d, a->desaturate, b->desaturate, c->desaturate, &bw);
+            }
+            float texels[4][4], mask[4][4];
+#ifdef AVX2_PATH
+            if (avx2) {
+                sample4_avx2(s->texture, a->layer, u, v, s->bilinear, texels);
+                if (masked) {
+                    sample4_avx2(s->mask, s->mask_layer, mask_u, mask_v,
+                            true, mask);
+                }
+            } else
+#endif
+            {
+                sample4(s->texture, a->layer, u, v, s->bilinear, texels);
+                if (masked) {
+                    sample4(s->mask, s->mask_layer, mask_u, mask_v, true,
+                            mask);
+                }
+            }
+
+            for (int i=0; covered; i++, covered >>= 1) {
+                if (!(covered & 1)) continue;
+                uint8_t* dst = dst_row + (x+i)*4;
+                vec4 tex = type == SHADER_SINGLE_CHANNEL
+                    ? v4(1.f, 1.f, 1.f, texels[3][i])
+                    : v4(texels[0][i], texels[1][i], texels[2][i],
+                            texels[3][i]);
+                vec4 frag;
+                if (type == SHADER_DEFAULT) {
+                    frag = v4_mul(tex, v4(color[0][i], color[1][i],
+                                color[2][i], color[3][i]));
+                } else {
+                    frag = v4_mul(v4_mul(tex, v4(color[0][i], color[1][i],
+                                    color[2][i], 1.f)),
+                            v4_splat(color[3][i]));
+                }
+                if (masked) {
+                    frag = v4_mul(frag, v4_splat(mask[3][i]));
+                }
+                if (desaturate) {
+                    float r = v4_get(frag, 0);
+                    float g = v4_get(frag, 1);
+                    float bl = v4_get(frag, 2);
+                    float grey = .3f*r + .59f*g + .11f*bl;
+                    frag = v4(r + (grey-r)*d[i], g + (grey-g)*d[i],
+                            bl + (grey-bl)*d[i], v4_get(frag, 3));
+                }
+                v4_store_pixel(dst, blend_pixel(blend, frag, dst));
+            }
+        }
+    }
+}
+
+// raster_PTMDB is raster_pixels for shader type T, mask M, desaturate D and
+// blend B. The AVX2 copies have P avx2_, attributes A AVX2_FN and W true.
+#define RASTER_FN(P, A, W, T, M, D, B) \
+    static A void raster_##P##T##M##D##B(struct framebuffer* fb, \
+            struct raster_setup const* s, unsigned long* rejected) { \
+        raster_pixels(fb, s, rejected, T, M, D, B, W); \
+    }
+#define RASTER_FNS_B(P, A, W, T, M, D) RASTER_FN(P, A, W, T, M, D, 0) \
+    RASTER_FN(P, A, W, T, M, D, 1) RASTER_FN(P, A, W, T, M, D, 2)
+#define RASTER_FNS_D(P, A, W, T, M) \
+    RASTER_FNS_B(P, A, W, T, M, 0) RASTER_FNS_B(P, A, W, T, M, 1)
+#define RASTER_FNS_M(P, A, W, T) \
+    RASTER_FNS_D(P, A, W, T, 0) RASTER_FNS_D(P, A, W, T, 1)
+#define RASTER_FNS(P, A, W) RASTER_FNS_M(P, A, W, 0) \
+    RASTER_FNS_M(P, A, W, 1) RASTER_FNS_M(P, A, W, 2)
+
+#define RASTER_ROW_B(P, T, M, D) {raster_##P##T##M##D##0, \
+    raster_##P##T##M##D##1, raster_##P##T##M##D##2}
+#define RASTER_ROW_D(P, T, M) \
+    {RASTER_ROW_B(P, T, M, 0), RASTER_ROW_B(P, T, M, 1)}
+#define RASTER_ROW(P, T) {RASTER_ROW_D(P, T, 0), RASTER_ROW_D(P, T, 1)}
+#define RASTER_TABLE(P) {RASTER_ROW(P, 0), RASTER_ROW(P, 1), RASTER_ROW(P, 2)}
+
+// Indexed by enum shader_type, mask, desaturate and enum l2d_blend.
+RASTER_FNS(, , false)
+static raster_fn* const raster_fns[3][2][2][3] = RASTER_TABLE();
+
+// The same, sampling and testing coverage with AVX2. Only used if
+// has_avx2() says the CPU can run them.
+#ifdef AVX2_PATH
+RASTER_FNS(avx2_, AVX2_FN, true)
+static raster_fn* const raster_fns_avx2[3][2][2][3] = RASTER_TABLE(avx2_);
+
+static
+bool
+has_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+#else
+static
+bool
+has_avx2(void) {
+    return false;
+}
+#endif
+
+static
+void
+raster_triangle(struct framebuffer* fb, struct soft_triangle const* tri,
+        int tx0, int ty0, int tx1, int ty1, unsigned long* rejected,
+        bool avx2) {
+    struct soft_command const* cmd = &queued_commands[tri->command];
+    struct soft_vertex const* a = &queued_verticies[tri->v[0]];
+    struct soft_vertex const* b = &queued_verticies[tri->v[1]];
+    struct soft_vertex const* c = &queued_verticies[tri->v[2]];
+
+    struct raster_point pa = raster_point(a);
+    struct raster_point pb = raster_point(b);
+    struct raster_point pc = raster_point(c);
+    double area = edge(pa, pb, pc.x, pc.y);
+    if (area == 0.) return;
+    if (area < 0.) {
+        struct soft_vertex const* t = b;
+        b = c;
+        c = t;
+        struct raster_point pt = pb;
+        pb = pc;
+        pc = pt;
+        area = -area;
+    }
+
+    struct raster_setup s;
+    s.x0 = (int)floorf(fminf(a->x, fminf(b->x, c->x)));
+    s.y0 = (int)floorf(fminf(a->y, fminf(b->y, c->y)));
+    s.x1 = (int)ceilf(fmaxf(a->x, fmaxf(b->x, c->x)));
+    s.y1 = (int)ceilf(fmaxf(a->y, fmaxf(b->y, c->y)));
+    if (s.x0 < tx0) s.x0 = tx0;
+    if (s.y0 < ty0) s.y0 = ty0;
+    if (s.x1 > tx1) s.x1 = tx1;
+    if (s.y1 > ty1) s.y1 = ty1;
+    if (s.x0 >= s.x1 || s.y0 >= s.y1) return;
+
+    s.a = a;
+    s.b = b;
+    s.c = c;
+    int batch_texture = a->batch_texture;
+    if (batch_texture < 0 || batch_texture >= MAX_BATCH_TEXTURES)
+        batch_texture = 0;
+    s.texture = get_texture(cmd->textures[batch_texture]);
+    s.mask = get_texture(cmd->mask_texture);
+    s.mask_layer = cmd->mask_layer;
+
+    // GL is set up with a linear min filter and a nearest mag filter. Pick
+    // one per triangle by comparing its texel and pixel footprints.
+    s.bilinear = false;
+    if (s.texture) {
+        float uv_area = fabsf((b->u - a->u)*(c->v - a->v)
+                - (c->u - a->u)*(b->v - a->v));
+        s.bilinear = uv_area*s.texture->width*s.texture->height > area;
+    }
+
+    s.depth = cmd->depth_mode != DEPTH_OFF ? fb->depth : NULL;
+    s.depth_write = cmd->depth_mode == DEPTH_WRITE;
+    s.z = cmd->depth;
+    s.inv_area = 1./area;
+
+    struct raster_point edges[3][2] = {{pb, pc}, {pc, pa}, {pa, pb}};
+    s.bias = 0;
+    for (int k=0; k<3; k++) {
+        struct raster_point p = edges[k][0];
+        struct raster_point q = edges[k][1];
+        s.w[k] = edge(p, q, s.x0 + .5, s.y0 + .5);
+        s.step_x[k] = p.y - q.y;
+        s.step_y[k] = q.x - p.x;
+        if (edge_is_top_left(p, q)) s.bias |= 1 << k;
+    }
+
+    assert(cmd->type <= SHADER_SINGLE_CHANNEL);
+    assert(cmd->blend <= l2d_BLEND_PREMULT);
+    raster_fn* const (*fns)[2][2][3] = raster_fns;
+#ifdef AVX2_PATH
+    if (avx2) fns = raster_fns_avx2;
+#endif
+    fns[cmd->type][s.mask != NULL][cmd->desaturate][cmd->blend](fb, &s,
+            rejected);
+}
+
+static
+void
+raster_tile(void* userdata, int tile) {
+    struct raster_job* job = userdata;
+    int* bin = tile_bins[tile];
+    if (!sbcount(bin)) return;
+
+    int tx0 = (tile % job->tiles_x)*TILE_SIZE;
+    int ty0 = (tile / job->tiles_x)*TILE_SIZE;
+    int tx1 = tx0 + TILE_SIZE;
+    int ty1 = ty0 + TILE_SIZE;
+    if (tx1 > job->fb.width) tx1 = job->fb.width;
+    if (ty1 > job->fb.height) ty1 = job->fb.height;
+
+    for (int i=0; i<sbcount(bin); i++) {
+        raster_triangle(&job->fb, &queued_triangles[bin[i]],
+                tx0, ty0, tx1, ty1, &tile_rejected[tile], job->avx2);
+    }
+}
+
+static
+void
+flush(void) {
+    if (!sbcount(queued_triangles)) {
+        sbempty(queued_verticies);
+        sbempty(queued_commands);
+        return;
+    }
+
+    struct raster_job job;
+    if (get_framebuffer(current_fbo, &job.fb)) {
+        job.tiles_x = (job.fb.width + TILE_SIZE-1)/TILE_SIZE;
+        job.avx2 = has_avx2();
+        int tiles_y = (job.fb.height + TILE_SIZE-1)/TILE_SIZE;
+        int tile_count = job.tiles_x*tiles_y;
+
+        while (sbcount(tile_bins) < tile_count) {
+            sbpush(tile_bins, NULL);
+            sbpush(tile_rejected, 0);
+        }
+        for (int i=0; i<tile_count; i++) {
+            sbempty(tile_bins[i]);
+            tile_rejected[i] = 0;
+        }
+
+        // Bin every triangle into each tile its bounds touch.
+        for (int i=0; i<sbcount(queued_triangles); i++) {
+            struct soft_triangle* t = &queued_triangles[i];
+            struct soft_vertex* a = &queued_verticies[t->v[0]];
+            struct soft_vertex* b = &queued_verticies[t->v[1]];
+            struct soft_vertex* c = &queued_verticies[t->v[2]];
+            float minx = fminf(a->x, fminf(b->x, c->x));
+            float miny = fminf(a->y, fminf(b->y, c->y));
+            float maxx = fmaxf(a->x, fmaxf(b->x, c->x));
+            float maxy = fmaxf(a->y, fmaxf(b->y, c->y));
+            if (maxx < 0.f || maxy < 0.f
+                    || minx >= job.fb.width || miny >= job.fb.height) {
+                continue;
+            }
+            int bx0 = minx < 0.f ? 0 : (int)minx/TILE_SIZE;
+            int by0 = miny < 0.f ? 0 : (int)miny/TILE_SIZE;
+            int bx1 = maxx >= job.fb.width ? job.tiles_x-1 : (int)maxx/TILE_SIZE;
+            int by1 = maxy >= job.fb.height ? tiles_y-1 : (int)maxy/TILE_SIZE;
+            for (int by=by0; by<=by1; by++) {
+                for (int bx=bx0; bx<=bx1; bx++) {
+                    sbpush(tile_bins[by*job.tiles_x+bx], i);
+                }
+            }
+        }
+
+        job_parallel_for(tile_count, raster_tile, &job);
+        for (int i=0; i<tile_count; i++) {
+            counters.depth_rejected_pixels += tile_rejected[i];
+        }
+    }
+
+    sbempty(queued_verticies);
+    sbempty(queued_triangles);
+    sbempty(queued_commands);
+}
+
+
+//
+// Shaders and materials. Only enough state is kept to pick the right
+// fragment math in raster_triangle.
+//
+
+static
+struct shader_variant*
+shader_get_variant(struct shader* shader, unsigned int variant) {
+    assert(variant < SHADER_VARIANT_COUNT);
+    for (int i=0; i<sbcount(shader->variants); i++) {
+        if (shader->variants[i]->variant == variant) {
+            return shader->variants[i];
+        }
+    }
+    struct shader_variant* v = calloc(1, sizeof(struct shader_variant));
+    v->variant = variant;
+    sbpush(shader->variants, v);
+    return v;
+}
+
+static
+struct material_handles*
+material_variant_handles(struct material* m, unsigned int variant) {
+    for (int i=0; i<sbcount(m->handles); i++) {
+        if (m->handles[i]->variant == variant) {
+            return m->handles[i];
+        }
+    }
+    struct material_handles* h = calloc(1, sizeof(struct material_handles));
+    h->variant = variant;
+    h->invalid = true;
+    sbpush(m->handles, h);
+    return h;
+}
+
+struct material*
+render_api_material_new(struct shader* shader, struct l2d_effect_stage* effect) {
+    static int next_id = 1;
+    struct material* material = malloc(sizeof(struct material));
+    material->id = next_id++;
+    material->shader = shader;
+    material->effect = effect;
+    material->attributes = NULL;
+    material->handles = NULL;
+    return material;
+}
+
+int
+render_api_material_get_id(struct material* m) {
+    return m->id;
+}
+
+struct material_attribute*
+render_api_get_attributes(struct material* m, int* count) {
+    *count = sbcount(m->attributes);
+    return m->attributes;
+}
+
+void
+render_api_material_set_float_v(struct material* m,
+        const char* name, int count, float* floats) {
+}
+
+void
+render_api_material_enable_vertex_data(struct material* m,
+        l2d_ident attribute, int size) {
+    for (size_t i=0; i<sbcount(m->attributes); i++) {
+        if (m->attributes[i].name == attribute) {
+            m->attributes[i].size = size;
+            return;
+        }
+    }
+    struct material_attribute* ma = sbadd(m->attributes, 1);
+    ma->name = attribute;
+    ma->size = (size_t)size;
+    for (int i=0; i<sbcount(m->handles); i++) {
+        m->handles[i]->invalid = true;
+    }
+}
+
+void
+render_api_material_use(struct material* m, unsigned int shader_variant,
+        struct shader_handles** sh, struct material_handles** mh,
+        int* next_texture_slot) {
+    *sh = &shader_get_variant(m->shader, shader_variant)->handles;
+    if ((*sh)->id == 0) {
+        struct shader_handles* h = *sh;
+        h->id = shader_variant + 1;
+        h->positionHandle = -1;
+        h->texCoordHandle = -1;
+        h->miscAttrib = -1;
+        h->colorAttrib = -1;
+        h->textureHandle = HANDLE_TEXTURE;
+        h->texture2Handle = HANDLE_TEXTURE2;
+        h->texturePixelSizeHandle = -1;
+        h->miscAnimatingHandle = -1;
+        h->maskTexture = (shader_variant & SHADER_MASK)
+            ? HANDLE_MASK_TEXTURE : -1;
+        h->maskTextureCoordMat = (shader_variant & SHADER_MASK)
+            ? HANDLE_MASK_MATRIX : -1;
+        h->eyePos = (shader_variant & SHADER_MASK) ? HANDLE_EYE_POS : -1;
+        h->maskLayer = (shader_variant & SHADER_MASK_ARRAY)
+            ? HANDLE_MASK_LAYER : -1;
+        h->depth = HANDLE_DEPTH;
+        h->batchTextures[0] = HANDLE_TEXTURE;
+        for (int i=1; i<MAX_BATCH_TEXTURES; i++) {
+            h->batchTextures[i] = (shader_variant & SHADER_MULTI_TEXTURE)
+                ? HANDLE_BATCH_TEXTURE+i-1 : -1;
+        }
+        h->cornerAttrib = -1;
+        h->instanceXAttrib = -1;
+        h->instanceYAttrib = -1;
+        h->instanceWAttrib = -1;
+        h->texRegionAttrib = -1;
+        counters.programs_compiled++;
+    }
+    *mh = material_variant_handles(m, shader_variant);
+    if ((*mh)->invalid) {
+        sbempty((*mh)->attributes);
+        for (int i=0; i<sbcount(m->attributes); i++) {
+            sbpush((*mh)->attributes, -1);
+        }
+        (*mh)->invalid = false;
+    }
+}
+
+struct shader*
+render_api_load_shader(enum shader_type t) {
+    struct shader* shader = malloc(sizeof(struct shader));
+    memset(shader, 0, sizeof(struct shader));
+    shader->type = t;
+    return shader;
+}
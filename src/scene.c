@@ -5,6 +5,7 @@
 #include "image_bank.h"
 #include "resources.h"
 #include "stretchy_buffer.h"
+#include "profile.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -30,11 +31,17 @@ l2d_scene_new(struct l2d_resources* r) {
 L2D_EXPORTED
 void
 l2d_scene_delete(struct l2d_scene* scene) {
-    ir_delete(scene->ir);
+    // Sprites delete their drawers, which must happen before ir_delete
+    // frees whatever drawers are left.
     sbforeachv(struct l2d_sprite* s, scene->sprites) {
         i_sprite_delete(s);
     }
     sbfree(scene->sprites);
+    ir_delete(scene->ir);
+    l2d_anim_release_all(&scene->anims_tx);
+    l2d_anim_release_all(&scene->anims_ty);
+    l2d_anim_release_all(&scene->anims_tz);
+    free(scene);
 }
 
 L2D_EXPORTED
@@ -46,12 +53,14 @@ l2d_scene_get_resources(struct l2d_scene* scene) {
 L2D_EXPORTED
 void
 l2d_scene_step(struct l2d_scene* scene, float dt) {
+    PROFILE_BEGIN(scene_step);
     sbforeachv(struct l2d_sprite* s, scene->sprites) {
         l2d_sprite_step(s, dt);
     }
     l2d_anim_step(&scene->anims_tx, dt, &scene->ir->translate[0]);
     l2d_anim_step(&scene->anims_ty, dt, &scene->ir->translate[1]);
     l2d_anim_step(&scene->anims_tz, dt, &scene->ir->translate[2]);
+    PROFILE_END(scene_step);
 }
 
 L2D_EXPORTED
@@ -63,8 +72,43 @@ l2d_clear(uint32_t color) {
 L2D_EXPORTED
 void
 l2d_scene_render(struct l2d_scene* s) {
+    struct render_api_counters before;
+    render_api_get_counters(&before);
+
     ib_upload_pending(s->res->ib);
     ir_render(s->ir);
+
+    // The backend's counters are shared by every scene, so only what
+    // changed during this call is ours.
+    struct render_api_counters after;
+    render_api_get_counters(&after);
+    struct l2d_frame_stats* stats = &s->ir->stats;
+    stats->draw_calls = after.draw_calls - before.draw_calls;
+    stats->vertices = after.vertices - before.vertices;
+    stats->indices = after.indices - before.indices;
+    stats->vertex_bytes = after.vertex_bytes - before.vertex_bytes;
+    stats->index_bytes = after.index_bytes - before.index_bytes;
+    stats->texture_bytes = after.texture_bytes - before.texture_bytes;
+    stats->textures_uploaded = after.texture_uploads - before.texture_uploads;
+    stats->programs_compiled =
+        after.programs_compiled - before.programs_compiled;
+    stats->state_calls = after.state_calls - before.state_calls;
+    stats->state_calls_elided =
+        after.state_calls_elided - before.state_calls_elided;
+    stats->pixels_depth_rejected =
+        after.depth_rejected_pixels - before.depth_rejected_pixels;
+}
+
+L2D_EXPORTED
+void
+l2d_scene_get_frame_stats(struct l2d_scene* s, struct l2d_frame_stats* out) {
+    *out = s->ir->stats;
+}
+
+L2D_EXPORTED
+bool
+l2d_scene_needs_render(struct l2d_scene* s) {
+    return ir_needs_render(s->ir);
 }
 
 L2D_EXPORTED
@@ -82,6 +126,12 @@ l2d_scene_set_translate(struct l2d_scene* scene, float x, float y, float z, floa
     l2d_anim_new(&scene->anims_tz, z, dt, flags);
 }
 
+L2D_EXPORTED
+void
+l2d_scene_set_spatial_index(struct l2d_scene* scene, float cell_size) {
+    ir_set_spatial_index(scene->ir, cell_size);
+}
+
 L2D_EXPORTED
 bool
 l2d_scene_feed_click(struct l2d_scene* scene, float x, float y, int button) {
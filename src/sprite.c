@@ -233,6 +233,12 @@ l2d_sprite_set_order(struct l2d_sprite* s, int order) {
     l2d_drawer_setOrder(s->drawer, order);
 }
 
+L2D_EXPORTED
+void
+l2d_sprite_set_visible(struct l2d_sprite* s, bool visible) {
+    l2d_drawer_set_visible(s->drawer, visible);
+}
+
 L2D_EXPORTED
 void
 l2d_sprite_set_on_click(struct l2d_sprite* s, l2d_event_cb cb, void* userdata) {
@@ -305,10 +311,11 @@ i_sprite_step(struct l2d_sprite* s, float dt, struct site* parent_site, bool par
     u_site |= l2d_anim_step(&s->anims_y, dt, &s->site.y);
     u_site |= l2d_anim_step(&s->anims_scale_x, dt, &s->site.scale_x);
     u_site |= l2d_anim_step(&s->anims_scale_y, dt, &s->site.scale_y);
+    // Outlives the if, the children are passed a pointer to it.
+    struct site stack_site;
     if (u_site || parent_changed) {
         struct site* site = &s->site;
         if (parent_site) {
-            struct site stack_site;
             site_copy(&stack_site, site);
             site_apply_parent(&stack_site, parent_site);
             site = &stack_site;
@@ -1,7 +1,7 @@
 #include "target.h"
 #include "renderer.h"
 #include "image_bank.h"
-#include "gl.h"
+#include "render_api.h"
 
 
 #include <stdlib.h>
@@ -45,12 +45,10 @@ i_prepair_targets_before_texture(struct ir* ir) {
 static
 void
 attachFBOTexture(struct l2d_target* target) {
-    // TODO abstract GL
     if (target->fbo == 0) {
-        glGenFramebuffers(1, &target->fbo);
+        target->fbo = render_api_framebuffer_new();
     }
-    glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
-    if (ib_image_bind_framebuffer_texture(target->image)) {
+    if (ib_image_bind_framebuffer_texture(target->image, target->fbo)) {
         target->needsTextureAttached = false;
     }
 }
@@ -68,10 +66,12 @@ i_prepair_targets_after_texture(struct ir* ir) {
 struct l2d_target*
 l2d_target_new(struct ir* ir, int width, int height, unsigned int flags) {
     struct l2d_target* target = malloc(sizeof(struct l2d_target));
+    ir->changed = true;
+    target->ir = ir;
     target->width = width;
     target->height = height;
     target->flags = flags;
-    target->drawerList = NULL;
+    target->drawers = NULL;
     init_sort_cache(&target->sort_cache);
     target->fbo = 0;
     target->needsTextureAttached = true;
@@ -122,6 +122,7 @@ l2d_target_as_drawer(struct l2d_target* target) {
 void
 l2d_target_clear_color(struct l2d_target* t, float r, float g, float b,
         float a) {
+    t->ir->changed = true;
     t->color[0] = r;
     t->color[1] = g;
     t->color[2] = b;
@@ -130,6 +131,7 @@ l2d_target_clear_color(struct l2d_target* t, float r, float g, float b,
 
 void
 l2d_target_set_dimensions(struct l2d_target* t, int width, int height) {
+    t->ir->changed = true;
     t->width = width;
     t->height = height;
 }
@@ -137,6 +139,7 @@ l2d_target_set_dimensions(struct l2d_target* t, int width, int height) {
 void
 l2d_target_set_scale(struct l2d_target* t, float scaleWidth,
         float scaleHeight) {
+    t->ir->changed = true;
     t->scaleWidth = scaleWidth;
     t->scaleHeight = scaleHeight;
 }
@@ -12,10 +12,11 @@ void
 i_prepair_targets_after_texture(struct ir* ir);
 
 struct l2d_target {
+    struct ir* ir;
     int width, height;
     float scaleWidth, scaleHeight;
     unsigned int flags;
-    struct l2d_drawer* drawerList;
+    struct l2d_drawer** drawers; // stretchy, any order
     struct sort_cache sort_cache;
     bool needsTextureAttached;
     uint32_t fbo;